@@ -1,11 +1,10 @@
-#define FUSE_USE_VERSION 29
+#define FUSE_USE_VERSION 31
 #define _FILE_OFFSET_BITS 64
-#define BLOCK_SIZE 512			// RedSea Block Size
-#define ISO_9660_SECTOR_SIZE 2048
-#define UNIX_CDATE_SECONDS 62167132800 	// seconds to subtract from CDate seconds for unix time
-					// 719527*84000
+#define _GNU_SOURCE				// O_DIRECT
+#include <linux/fs.h>				// BLKGETSIZE64 and BLKSSZGET, before redsea_format.h
+#include "redsea_format.h"
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -14,30 +13,68 @@
 #include <stdio.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
 
 /* RedSea FUSE driver
  * for the TempleOS RedSea filesystem
  * as of right now read only
  */
 
+/* Entries live in the metadata arena (see arena_alloc) and are never freed.
+ * Fields anything looking a file up or stat-ing it needs come first so
+ * that's one cache line, the write side state after. A file is two cache
+ * lines, what only writes and -o decompress need is behind pointers.
+ */
+struct staged_contents;
 struct redsea_file {
-	unsigned long long int seek_to;		// seek to here from parent block to get entry
-	unsigned char name[38]; 		// file names can be 37 chars + null
+	unsigned char name[MAX_NAME+1];		// file names can be 37 chars + null
+	uint16_t attributes;			// attribute flags from the entry, 0x400 is compressed
+	unsigned int seek_to;			// seek to here from parent block to get entry
+	unsigned int position;			// index in file_structs
 	unsigned long long int size;
 	unsigned long long int block;
 	unsigned long long int mod_date;
 	struct redsea_directory* parent;
+	unsigned long long int reserved_blocks;	// extent length when fallocate reserved more than the size needs
+	struct expanded_file* expanded;		// decoder state for -o decompress, see expanded_read
+	unsigned char* delayed;			// whole contents while allocation is delayed, see write_file
+	struct staged_contents* staged;		// expanded contents waiting to be compressed, see compress_staged
+	unsigned int ino;			// 0 until the kernel's seen it, see Inodes
+	unsigned int delayed_capacity;		// delayed files are capped at DELAYED_FILE_LIMIT
+	unsigned int disk_size;			// size the on disk extent was allocated for while delayed
+	bool dirty;				// size/date changed since the entry was last written, see write_back_entry
+	bool compress_queued;
 };
 struct redsea_directory {
-	unsigned long long int seek_to;		// seek to here from parent block to get entry
-	unsigned char name[38];
+	unsigned char name[MAX_NAME+1];
+	bool loaded;				// children have been read in, see load_directory
+	unsigned int seek_to;			// seek to here from parent block to get entry
+	unsigned int position;			// index in directory_structs
 	unsigned long long int size;
 	unsigned long long int block;
 	unsigned long long int mod_date;
-	unsigned long long int num_children;
-	unsigned char** children;
 	struct redsea_directory* parent;
-	
+	uintptr_t* children;			// child table, see Children
+	unsigned int children_capacity;
+	unsigned int children_used;		// live children + tombstones
+	unsigned long long int num_children;
+	unsigned int ino;
+	unsigned long long int* free_slots;	// deleted entries that can be reused, see take_free_slot
+	unsigned long long int free_slot_count;
+	unsigned long long int max_free_slots;
+	unsigned long long int next_slot;	// first entry past the end of the directory
+	pthread_rwlock_t lock;			// entries and child file data, see locking below
 };
 
 
@@ -46,622 +83,4094 @@ struct redsea_directory {
 // if you lean too far you'll crash. Don't do that
 int max_directory_count = 20;
 int max_file_count = 20;
-char** directory_paths;		// malloced in main
-char** file_paths;		// 20 max default, will be expanded if exceeded
-struct redsea_directory** directory_structs;
+struct redsea_directory** directory_structs;	// 20 max default, will be expanded if exceeded
 struct redsea_file** file_structs;
 int directory_count = 1;
 int file_count = 0;
-FILE* image;			// image is going to be global. makes it easier
-unsigned long long int free_space_pointer = 0;				// just point to the next free available location to expand files
-									// really naive implementation but should work.
-
-//Converts TempleOS CDate (Christ date?) format to unix time.
-long long int cdate_to_unix(unsigned long long int cdate) {
-	unsigned int lower = cdate & 0xFFFFFFFF;
-	unsigned int upper = (cdate>>32) & 0xFFFFFFFF;
-       	unsigned long long int cdate_upper_seconds = upper*86400LL;
-	long int cdate_lower_seconds = lower/49710;
-	long long int unix_seconds = cdate_upper_seconds+cdate_lower_seconds-UNIX_CDATE_SECONDS;
-	return unix_seconds;
-}
-//Converts unix time to TempleOS CDate.
-unsigned long long int unix_to_cdate(long long int unix_time) {
-	unsigned long long int cdate;
-	unsigned int lower = (unix_time % 84000LL)*49710;
-	unsigned int upper = (unix_time + UNIX_CDATE_SECONDS) / 86400;
-	cdate = (unsigned long long int) upper << 32 | lower;
-	return cdate;
+int image_fd;			// image is going to be global. makes it easier
+unsigned char* image_map = NULL;	// shared read only mapping of the whole image
+unsigned long long int image_map_length = 0;
+unsigned long long int image_length = 0;
+unsigned long long int free_space_pointer = 0;				// first block past all the data on the image
+									// holes below it are tracked in free_extents
+bool debug_output = false;		// fuse's -d, see debug_printf
+
+// messages about what the driver's doing that nobody wants without -d
+#define debug_printf(...) do { if (debug_output) fprintf(stderr, __VA_ARGS__); } while (0)
+
+/* Mount options
+ * given with -o like any other fuse option
+ */
+struct redsea_options {
+	int no_delalloc;			// nodelalloc: move growing files right away like we used to
+	unsigned int writeback_interval;	// writeback=SECONDS: how often dirty entries get written, 0 for only on close
+	char* index_path;			// index=FILE: keep the free map in FILE between mounts
+	int decompress;				// decompress: show compressed .Z files expanded
+	unsigned int zcache_mb;			// zcache=MB: how much expanded data to keep around for decompress
+	double entry_timeout;			// entry_timeout=SECONDS: how long the kernel can cache names
+	double attr_timeout;			// attr_timeout=SECONDS: and sizes, dates etc
+	unsigned int max_write;			// max_write=BYTES: biggest write the kernel should send in one go
+	unsigned int max_read;			// max_read=BYTES: and the biggest read it should ask for, 0 for its own limit
+	int no_splice;				// nosplice: copy file data through our own buffers, see Splicing
+	int direct;				// direct: file data bypasses the host page cache, see Direct I/O
+	char* journal_path;			// journal=FILE: log metadata updates in FILE first, see Journal
+	int sync_io;				// sync_io: don't use io_uring even if the kernel has it, see Async I/O
+	unsigned int io_depth;			// io_depth=N: chunks a copy keeps in flight
+	unsigned int cache_mb;			// cache=MB: size of the Block cache with -o direct, 0 for none
+};
+struct redsea_options options;
+
+#define REDSEA_OPT(templ, field, value) { templ, offsetof(struct redsea_options, field), value }
+static const struct fuse_opt redsea_opts[] = {
+	REDSEA_OPT("nodelalloc", no_delalloc, 1),
+	REDSEA_OPT("index=%s", index_path, 0),
+	REDSEA_OPT("writeback=%u", writeback_interval, 0),
+	REDSEA_OPT("decompress", decompress, 1),
+	REDSEA_OPT("zcache=%u", zcache_mb, 0),
+	REDSEA_OPT("entry_timeout=%lf", entry_timeout, 0),
+	REDSEA_OPT("attr_timeout=%lf", attr_timeout, 0),
+	REDSEA_OPT("max_write=%u", max_write, 0),
+	REDSEA_OPT("max_read=%u", max_read, 0),
+	REDSEA_OPT("nosplice", no_splice, 1),
+	REDSEA_OPT("direct", direct, 1),
+	REDSEA_OPT("journal=%s", journal_path, 0),
+	REDSEA_OPT("sync_io", sync_io, 1),
+	REDSEA_OPT("io_depth=%u", io_depth, 0),
+	REDSEA_OPT("cache=%u", cache_mb, 0),
+	FUSE_OPT_END
+};
+
+/* Locking
+ * fuse runs operations on several threads so everything above needs guarding.
+ * Always taken in this order:
+ *  table_lock - the global path arrays, indexes and children lists. read
+ *               locked by anything that only looks things up, write locked by
+ *               create/mkdir/unlink/rmdir/rename which reshape the tree.
+ *  directory->lock - a directory's entries on disk and the size/block of the
+ *               files in it. read locked to read file data, write locked to
+ *               write it (which can move the file).
+ *  expanded->lock - a compressed file's decoder, see expanded_read.
+ *  open->lock - an open file's read-ahead, see Read-ahead.
+ *  expand_cache_lock - the expanded page LRU.
+ *  journal_overlay_lock - metadata logged but not written in place yet.
+ *  journal_lock - the journal's queue of finished transactions.
+ *  allocator_lock - free_space_pointer and the free extent map.
+ *  image_lock - only held while remapping the image.
+ *  shard->lock - one Block cache shard, never more than one at a time.
+ *  direct_lock - the Direct I/O bounce buffers.
+ *  io_lock - the io_uring submission queue, then an io_group's lock.
+ *  inode_lock - the inode table, nothing's taken while holding it.
+ */
+pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t allocator_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Statistics
+ * every op counts itself and where its latency falls in a histogram, read
+ * out through /.redsea/stats. Bucket 0 is under a microsecond, bucket i
+ * from 2^(i-1) up to 2^i microseconds and the last one everything slower.
+ * All plain atomic adds so ops never wait on each other for this.
+ */
+enum stats_op {
+	STATS_LOOKUP,
+	STATS_GETATTR,
+	STATS_READDIR,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_CREATE,
+	STATS_MKDIR,
+	STATS_RENAME,
+	STATS_UNLINK,
+	STATS_RMDIR,
+	STATS_RELOCATE,			// a file or directory being copied somewhere else
+	STATS_COMPRESS,			// a .Z file packed after it was closed, an error if it changed meanwhile
+	STATS_COMMIT,			// a journal group commit, both syncs included
+	STATS_OPS
+};
+const char* stats_op_names[STATS_OPS] = {"lookup", "getattr", "readdir", "read", "write", "create", "mkdir", "rename", "unlink", "rmdir", "relocate", "compress", "commit"};
+#define STATS_BUCKETS 24		// the last bucket starts at ~4 seconds
+struct op_stats {
+	unsigned long long int count;
+	unsigned long long int errors;
+	unsigned long long int total_ns;
+	unsigned long long int max_ns;
+	unsigned long long int buckets[STATS_BUCKETS];
+};
+struct op_stats op_stats[STATS_OPS];
+unsigned long long int stats_bytes_read = 0;
+unsigned long long int stats_bytes_written = 0;
+unsigned long long int stats_bytes_relocated = 0;
+unsigned long long int stats_zcache_hits = 0;		// expanded pages found in the cache
+unsigned long long int stats_zcache_misses = 0;		// and ones that had to be decoded
+unsigned long long int stats_journal_transactions = 0;	// committed, divided by commit count it's the group size
+unsigned long long int stats_journal_commits = 0;	// journal_commits since the last reset, journal_sync waits on that one
+unsigned long long int stats_io_requests = 0;		// reads and writes through image_io_start
+unsigned long long int stats_io_calls = 0;		// io_uring_enter calls that submitted them
+unsigned long long int stats_cache_hits = 0;		// Block cache chunks found
+unsigned long long int stats_cache_misses = 0;		// and ones that had to be read (or were about to be overwritten)
+unsigned long long int stats_cache_writebacks = 0;	// dirty ranges written back
+
+unsigned long long int stats_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
 }
 
-bool is_directory(const char* path) {
-	for (int i = 0; i < directory_count; i++) {
-		if (strcmp (path, directory_paths[i]) == 0) return true;
+void stats_add(unsigned long long int* counter, unsigned long long int value) {
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+// start is what stats_clock returned when the op began
+void stats_record(enum stats_op op, unsigned long long int start, bool failed) {
+	unsigned long long int elapsed = stats_clock() - start;
+	struct op_stats* stats = &op_stats[op];
+	stats_add(&stats->count, 1);
+	if (failed) stats_add(&stats->errors, 1);
+	stats_add(&stats->total_ns, elapsed);
+	unsigned long long int max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+	while (elapsed > max && !__atomic_compare_exchange_n(&stats->max_ns, &max, elapsed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	int bucket = 0;
+	for (unsigned long long int us = elapsed / 1000; us > 0 && bucket < STATS_BUCKETS-1; us >>= 1) bucket++;
+	stats_add(&stats->buckets[bucket], 1);
+}
+
+/* Metadata arena
+ * files and directories are allocated by bumping a pointer through 1MB
+ * chunks instead of a malloc each. Nothing in here is ever freed (a
+ * deleted entry can still be sitting in the compress queue or the inode
+ * table), so there's no bookkeeping at all. Everything's handed out on
+ * a cache line boundary. Caller holds table_lock for writing.
+ */
+#define ARENA_CHUNK (1ULL << 20)
+#define ARENA_ALIGN 64
+unsigned char* arena_next = NULL;
+unsigned long long int arena_left = 0;
+unsigned long long int arena_bytes = 0;		// chunks allocated so far
+
+void* arena_alloc(unsigned long long int size) {
+	size = (size + ARENA_ALIGN - 1) & ~(unsigned long long int)(ARENA_ALIGN - 1);
+	if (size > arena_left) {
+		arena_left = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+		if (posix_memalign((void**) &arena_next, ARENA_ALIGN, arena_left) != 0) return NULL;
+		arena_bytes += arena_left;
 	}
-	return false;
+	void* block = arena_next;
+	arena_next += size;
+	arena_left -= size;
+	memset(block, 0, size);
+	return block;
 }
 
-unsigned long long int directory_position(const char* path) {
-	for (unsigned long long int i=0; i<directory_count; i++) {
-		if (strcmp (path, directory_paths[i]) == 0) return i;
+/* Children
+ * every directory has an open addressing hash table of what's in it,
+ * keyed by name. A slot is a pointer to the redsea_file or
+ * redsea_directory with the low bit set for directories (the arena
+ * aligns everything so it's free), names aren't copied, they're read out
+ * of the entry. Paths are never stored anywhere, a path is looked up one
+ * name at a time from the root (see resolve_path) and built from the
+ * names back up when something needs one (see directory_path). Renaming
+ * a directory is just renaming it in its parent's table.
+ */
+#define CHILD_DIRECTORY 1
+#define CHILD_TOMBSTONE ((uintptr_t) 2)	// a removed slot, probing carries on past it
+unsigned long long int children_bytes = 0;	// all the child tables together
+
+// FNV-1a. names are short so this is plenty
+unsigned long long int name_hash(const char* name) {
+	unsigned long long int hash = 0xcbf29ce484222325ULL;
+	for (; *name; name++) {
+		hash ^= (unsigned char) *name;
+		hash *= 0x100000001b3ULL;
 	}
-	return -1;
+	return hash;
 }
 
-unsigned long long int file_position(const char* path) {
-	for (unsigned long long int i = 0; i < file_count; i++) {
-		if (strcmp (path, file_paths[i]) == 0) return i;
+struct redsea_file* child_file(uintptr_t slot) {
+	return slot & CHILD_DIRECTORY ? NULL : (struct redsea_file*) slot;
+}
+
+struct redsea_directory* child_directory(uintptr_t slot) {
+	return slot & CHILD_DIRECTORY ? (struct redsea_directory*) (slot & ~(uintptr_t) CHILD_DIRECTORY) : NULL;
+}
+
+const char* child_name(uintptr_t slot) {
+	return slot & CHILD_DIRECTORY ? child_directory(slot)->name : child_file(slot)->name;
+}
+
+// the slot holding name, or the empty one where it would go. capacity is a power of 2
+unsigned int child_slot(struct redsea_directory* directory, const char* name) {
+	unsigned int mask = directory->children_capacity - 1;
+	unsigned int slot = name_hash(name) & mask;
+	while (directory->children[slot] != 0) {
+		uintptr_t child = directory->children[slot];
+		if (child != CHILD_TOMBSTONE && strcmp(child_name(child), name) == 0) break;
+		slot = (slot + 1) & mask;
 	}
-	return -1;
+	return slot;
+}
+
+void child_insert(struct redsea_directory* directory, struct redsea_file* file, struct redsea_directory* subdirectory);
+
+// grow (or just clear out tombstones) once the table is 3/4 full
+void child_rehash(struct redsea_directory* directory) {
+	uintptr_t* old = directory->children;
+	unsigned int old_capacity = directory->children_capacity;
+	unsigned int capacity = old_capacity ? old_capacity : 8;
+	while (directory->num_children*2 >= capacity) capacity *= 2;
+	directory->children = calloc(capacity, sizeof(uintptr_t));
+	children_bytes += (capacity - old_capacity)*sizeof(uintptr_t);
+	directory->children_capacity = capacity;
+	directory->children_used = directory->num_children;
+	for (unsigned int i = 0; i < old_capacity; i++) {
+		if (old[i] != 0 && old[i] != CHILD_TOMBSTONE) {
+			directory->children[child_slot(directory, child_name(old[i]))] = old[i];
+		}
+	}
+	free(old);
+}
+
+// a new child, the name isn't already there. caller holds table_lock for writing
+void child_insert(struct redsea_directory* directory, struct redsea_file* file, struct redsea_directory* subdirectory) {
+	if ((directory->children_used + 1) * 4 >= directory->children_capacity * 3) child_rehash(directory);
+	uintptr_t child = file != NULL ? (uintptr_t) file : (uintptr_t) subdirectory | CHILD_DIRECTORY;
+	unsigned int slot = child_slot(directory, child_name(child));
+	directory->children[slot] = child;
+	directory->num_children++;
+	directory->children_used++;
+}
+
+// 0 if there's no such child
+uintptr_t child_lookup(struct redsea_directory* directory, const char* name) {
+	if (directory->children_capacity == 0) return 0;
+	return directory->children[child_slot(directory, name)];
+}
+
+bool child_remove(struct redsea_directory* directory, const char* name) {
+	if (directory->children_capacity == 0) return false;
+	unsigned int slot = child_slot(directory, name);
+	if (directory->children[slot] == 0) return false;
+	directory->children[slot] = CHILD_TOMBSTONE;	// still counted in children_used until the next rehash
+	directory->num_children--;
+	return true;
+}
+
+/* What path refers to, 0 if nothing (or it's inside a directory that
+ * hasn't been loaded yet). Caller holds table_lock
+ */
+uintptr_t resolve_path(const char* path) {
+	uintptr_t child = (uintptr_t) directory_structs[0] | CHILD_DIRECTORY;
+	char name[40];
+	while (*path == '/') path++;
+	while (*path != '\0') {
+		const char* end = strchr(path, '/');
+		if (end == NULL) end = path + strlen(path);
+		if (end - path >= sizeof(name)) return 0;
+		memcpy(name, path, end - path);
+		name[end - path] = '\0';
+		struct redsea_directory* directory = child_directory(child);
+		if (directory == NULL) return 0;
+		child = child_lookup(directory, name);
+		if (child == 0) return 0;
+		path = end;
+		while (*path == '/') path++;
+	}
+	return child;
+}
+
+bool is_directory(const char* path) {
+	return child_directory(resolve_path(path)) != NULL;
+}
+
+unsigned long long int directory_position(const char* path) {
+	struct redsea_directory* directory = child_directory(resolve_path(path));
+	if (directory == NULL) return -1;
+	return directory->position;
+}
+
+unsigned long long int file_position(const char* path) {
+	uintptr_t child = resolve_path(path);
+	if (child == 0 || child_file(child) == NULL) return -1;
+	return child_file(child)->position;
 }
 
 // double directory array
 void expand_directory_array() {
 	max_directory_count *= 2;
-	directory_paths = realloc(directory_paths, sizeof(char*)*max_directory_count);
 	directory_structs = realloc(directory_structs, sizeof(struct redsea_directory*)*max_directory_count);
 }
 // double file array
 void expand_file_array() {
 	max_file_count *= 2;
-	file_paths = realloc(file_paths, sizeof(char*)*max_file_count);
 	file_structs = realloc(file_structs, sizeof(struct redsea_file*)*max_file_count);
 }
 
-unsigned int boot_catalog_pointer(FILE* image) {
-	unsigned int buf;			// 4 byte
-	fseek(image, 0x8800, SEEK_SET);
-	fseek(image, 0x47, SEEK_CUR);
-	fread(&buf, 4, 1, image);
-	rewind(image);
-	return buf;
+// append to the global arrays
+void add_file_position(struct redsea_file* file) {
+	if (file_count+1 >= max_file_count) expand_file_array();
+	file->position = file_count;
+	file_structs[file_count++] = file;
 }
 
-/*
- * find block for root directory in allocation bitmap (I think?)
- * block is always 0x58 as far as i know, but kept as a parameter just in case
- * root directory block is given at 0x18, presumably next 7 bytes as well
+void add_directory_position(struct redsea_directory* directory) {
+	if (directory_count+1 >= max_directory_count) expand_directory_array();
+	directory->position = directory_count;
+	directory_structs[directory_count++] = directory;
+}
+
+/* Remove an entry from the global arrays.
+ * order in the arrays doesn't matter (readdir goes through children), so
+ * the last entry is moved into the hole instead of shifting everything down.
  */
-unsigned long long int root_directory_block(unsigned int block, FILE* image) {
-	unsigned long long int root_block;
-	fseek(image, (block*BLOCK_SIZE), SEEK_SET);
-	fseek(image, 0x18, SEEK_CUR);
-	fread(&root_block, 8, 1, image);
-	printf("0x%x\n", root_block);
-	return root_block;
+void remove_file_position(unsigned long long int fid) {
+	file_count--;
+	if (fid != file_count) {
+		file_structs[fid] = file_structs[file_count];
+		file_structs[fid]->position = fid;
+	}
 }
 
-/*
- *Check boot catalog sector for 0x54 0x65 0x64 0x70 block indicating TOS
+void remove_directory_position(unsigned long long int did) {
+	directory_count--;
+	if (did != directory_count) {
+		directory_structs[did] = directory_structs[directory_count];
+		directory_structs[did]->position = did;
+	}
+}
+
+/* Inodes
+ * the kernel refers to everything by inode number. A file or directory gets
+ * one the first time the kernel sees it and keeps it for the rest of the
+ * mount. lookups is the kernel's reference count, every entry handed to it
+ * adds one and forget gives them back. A deleted entry's number gets reused
+ * once it's back to zero, with the generation bumped so the kernel can
+ * tell the two apart. FUSE_ROOT_ID is the root and the control files
+ * (see Control files) come right after it.
  */
-bool redsea_identity_check(unsigned int boot_catalog, FILE* image) {
-	unsigned int buf;
-	fseek(image, (boot_catalog*ISO_9660_SECTOR_SIZE+4), SEEK_SET);
-	fread(&buf, 4, 1, image);
-	unsigned int tos_string = 0x706d6554;	// check for TempleOS fs signature. not the actual signature location
-						// but will this will always be there. I should probably make this 
-						// look for the actual RedSea signature. :/
-	if (buf != tos_string) return false;
+#define CONTROL_DIR_INO 2
+#define CONTROL_COMPACT_INO 3
+#define CONTROL_STATS_INO 4
+#define FIRST_FREE_INO 5
+struct redsea_inode {
+	struct redsea_file* file;		// at most one of these is set, neither once it's deleted
+	struct redsea_directory* directory;
+	unsigned long long int lookups;
+	unsigned long long int generation;
+};
+struct redsea_inode* inodes = NULL;
+unsigned long long int inode_count = FIRST_FREE_INO;	// next number never handed out
+unsigned long long int inode_capacity = 0;
+unsigned long long int* free_inodes = NULL;
+unsigned long long int free_inode_count = 0;
+unsigned long long int max_free_inodes = 0;
+pthread_mutex_t inode_lock = PTHREAD_MUTEX_INITIALIZER;
+const char* control_paths[FIRST_FREE_INO] = {NULL, NULL, "/.redsea", "/.redsea/compact", "/.redsea/stats"};
+
+const char* control_inode_path(fuse_ino_t ino) {
+	return ino < FIRST_FREE_INO ? control_paths[ino] : NULL;
+}
+
+// inode_lock held
+void release_inode(unsigned long long int ino) {
+	inodes[ino].generation++;
+	if (free_inode_count == max_free_inodes) {
+		max_free_inodes = max_free_inodes ? max_free_inodes*2 : 64;
+		free_inodes = realloc(free_inodes, sizeof(unsigned long long int)*max_free_inodes);
+	}
+	free_inodes[free_inode_count++] = ino;
+}
+
+/* Inode number of a file or directory (the other one NULL), giving it one
+ * if it hasn't got one yet. reference counts it as one more lookup the
+ * kernel holds, generation can be NULL
+ */
+fuse_ino_t inode_for(struct redsea_file* file, struct redsea_directory* directory, bool reference, uint64_t* generation) {
+	pthread_mutex_lock(&inode_lock);
+	unsigned int* ino = file != NULL ? &file->ino : &directory->ino;
+	if (*ino == 0) {
+		if (free_inode_count > 0) *ino = free_inodes[--free_inode_count];
+		else {
+			if (inode_count == inode_capacity) {
+				inode_capacity *= 2;
+				inodes = realloc(inodes, sizeof(struct redsea_inode)*inode_capacity);
+				memset(inodes + inode_count, 0, sizeof(struct redsea_inode)*(inode_capacity - inode_count));
+			}
+			*ino = inode_count++;
+		}
+		inodes[*ino].file = file;
+		inodes[*ino].directory = directory;
+		inodes[*ino].lookups = 0;
+	}
+	if (reference) inodes[*ino].lookups++;
+	if (generation != NULL) *generation = inodes[*ino].generation;
+	fuse_ino_t number = *ino;
+	pthread_mutex_unlock(&inode_lock);
+	return number;
+}
+
+// what ino refers to, false if it's nothing (anymore). Caller holds table_lock so it can't be deleted meanwhile
+bool inode_object(fuse_ino_t ino, struct redsea_file** file, struct redsea_directory** directory) {
+	pthread_mutex_lock(&inode_lock);
+	*file = NULL;
+	*directory = NULL;
+	if (ino < inode_count) {
+		*file = inodes[ino].file;
+		*directory = inodes[ino].directory;
+	}
+	pthread_mutex_unlock(&inode_lock);
+	return *file != NULL || *directory != NULL;
+}
+
+// the entry behind ino (a file's or directory's ino field) was deleted, table_lock write locked
+void inode_deleted(unsigned int* ino) {
+	if (*ino == 0) return;
+	pthread_mutex_lock(&inode_lock);
+	inodes[*ino].file = NULL;
+	inodes[*ino].directory = NULL;
+	if (inodes[*ino].lookups == 0) release_inode(*ino);
+	*ino = 0;
+	pthread_mutex_unlock(&inode_lock);
+}
+
+void inode_forget(fuse_ino_t ino, uint64_t count) {
+	pthread_mutex_lock(&inode_lock);
+	if (ino >= FIRST_FREE_INO && ino < inode_count && inodes[ino].lookups > 0) {
+		inodes[ino].lookups -= count < inodes[ino].lookups ? count : inodes[ino].lookups;
+		if (inodes[ino].lookups == 0 && inodes[ino].file == NULL && inodes[ino].directory == NULL) release_inode(ino);
+	}
+	pthread_mutex_unlock(&inode_lock);
+}
+
+// the path a directory is indexed under, built from the names up to the root. malloced, caller holds table_lock
+char* directory_path(struct redsea_directory* directory) {
+	if (directory->parent == NULL) return strdup("/");
+	char* parent_path = directory_path(directory->parent);
+	char* path = malloc(strlen(parent_path) + strlen(directory->name) + 2);
+	sprintf(path, "%s%s%s", parent_path, directory->parent->parent == NULL ? "" : "/", directory->name);
+	free(parent_path);
+	return path;
+}
+
+char* child_path(struct redsea_directory* directory, const char* name) {
+	char* parent_path = directory_path(directory);
+	char* path = malloc(strlen(parent_path) + strlen(name) + 2);
+	sprintf(path, "%s%s%s", parent_path, directory->parent == NULL ? "" : "/", name);
+	free(parent_path);
+	return path;
+}
+
+/* Image I/O
+ * the whole image is mapped shared so reads and metadata decoding come
+ * straight out of the page cache with no seeking or copying. Writes go
+ * through pwrite on the same fd, which the mapping sees immediately. The
+ * mapping is reserved bigger than the file so it only has to be redone
+ * once the image grows past it, bytes past the end of the file are never
+ * touched (that would SIGBUS).
+ *
+ * Nothing keeps a seek position so any thread can do I/O at any time. Old
+ * mappings are kept around after a remap instead of being unmapped, another
+ * thread could still be copying out of one.
+ */
+#define IMAGE_MAP_HEADROOM (1ULL << 30)	// extra address space reserved past the end of the image
+
+struct retired_map {
+	unsigned char* map;
+	unsigned long long int length;
+	struct retired_map* next;
+};
+struct retired_map* retired_maps = NULL;
+
+// image_length is published after image_map so a reader that sees the new length sees the new map
+unsigned long long int image_size() {
+	return __atomic_load_n(&image_length, __ATOMIC_ACQUIRE);
+}
+
+// a block device's stat size is 0, it has to be asked
+unsigned long long int image_file_length() {
+	struct stat st;
+	if (fstat(image_fd, &st) != 0) return 0;
+	unsigned long long int length = st.st_size;
+	if (S_ISBLK(st.st_mode) && ioctl(image_fd, BLKGETSIZE64, &length) != 0) return 0;
+	return length;
+}
+
+void image_remap() {
+	pthread_mutex_lock(&image_lock);
+	unsigned long long int file_length = image_file_length();
+	if (image_map == NULL || file_length > image_map_length) {
+		unsigned long long int length = (file_length + IMAGE_MAP_HEADROOM) & ~(IMAGE_MAP_HEADROOM-1);
+		unsigned char* map = mmap(NULL, length, PROT_READ, MAP_SHARED, image_fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		if (image_map != NULL) {
+			struct retired_map* retired = malloc(sizeof(struct retired_map));
+			retired->map = image_map;
+			retired->length = image_map_length;
+			retired->next = retired_maps;
+			retired_maps = retired;
+		}
+		image_map = map;
+		image_map_length = length;
+		debug_printf("IMAGE MAPPED: %#llx bytes\n", length);
+	}
+	__atomic_store_n(&image_length, file_length, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&image_lock);
+}
+
+void image_unmap() {
+	munmap(image_map, image_map_length);
+	while (retired_maps != NULL) {
+		struct retired_map* next = retired_maps->next;
+		munmap(retired_maps->map, retired_maps->length);
+		free(retired_maps);
+		retired_maps = next;
+	}
+}
+
+struct cache_shard* cache_shards = NULL;		// see Block cache, NULL when it's off
+unsigned long long int cache_dirty_chunks = 0;
+void cache_flush_range(unsigned long long int offset, unsigned long long int size);
+
+// pointer to size bytes at offset in the image, NULL if that runs past the end
+unsigned char* image_bytes(unsigned long long int offset, unsigned long long int size) {
+	if (offset + size > image_size()) return NULL;
+	cache_flush_range(offset, size);
+	return image_map + offset;
+}
+
+int journal_fd = -1;
+pthread_rwlock_t journal_overlay_lock = PTHREAD_RWLOCK_INITIALIZER;
+void journal_patch(unsigned char* buffer, unsigned long long int size, unsigned long long int offset);
+
+// copy out of the image, anything past the end reads as zeroes. sees metadata still waiting in the journal
+void image_read(void* buffer, unsigned long long int size, unsigned long long int offset) {
+	cache_flush_range(offset, size);
+	if (journal_fd != -1) pthread_rwlock_rdlock(&journal_overlay_lock);
+	unsigned long long int length = image_size();
+	unsigned long long int available = 0;
+	if (offset < length) available = length - offset;
+	if (available > size) available = size;
+	memcpy(buffer, image_map + offset, available);
+	memset((unsigned char*) buffer + available, 0, size - available);
+	if (journal_fd != -1) {
+		journal_patch(buffer, size, offset);
+		pthread_rwlock_unlock(&journal_overlay_lock);
+	}
+}
+
+// image_bytes for metadata, with the journal on it's a copy from image_read. give it back with image_view_done
+unsigned char* image_view(unsigned long long int offset, unsigned long long int size) {
+	if (journal_fd == -1) return image_bytes(offset, size);
+	unsigned char* copy = malloc(size ? size : 1);
+	image_read(copy, size, offset);
+	return copy;
+}
+
+void image_view_done(unsigned char* view) {
+	if (journal_fd != -1) free(view);
+}
+
+bool image_pwrite(int fd, const void* buffer, unsigned long long int size, unsigned long long int offset) {
+	const unsigned char* pos = buffer;
+	unsigned long long int done = 0;
+	while (done < size) {
+		ssize_t written = pwrite(fd, pos + done, size - done, offset + done);
+		if (written <= 0) {
+			if (written < 0 && errno == EINTR) continue;
+			perror("pwrite");
+			return false;
+		}
+		done += written;
+	}
 	return true;
 }
 
-/*
- * Reads all the files and child directories of a given redsea directory
- * First called in main.
+/* Async I/O
+ * bulk image I/O, copying an extent somewhere else and putting a journal
+ * commit in place, goes through one io_uring shared by every thread. A copy
+ * keeps io_depth chunks in flight and a commit hands all its writes to the
+ * kernel in one call instead of a pwrite each. A thread reaps completions
+ * and hands each request back to the io_group whoever started it is waiting
+ * on, a short read or write just gets the rest submitted again.
+ * Without io_uring (an old kernel, seccomp, -o sync_io, and before init or
+ * after destroy) image_io_start does the pread/pwrite right away on the
+ * caller's thread, whoever's waiting can't tell the difference.
+ * It's the raw syscalls, liburing would be a dependency for 100 lines.
  */
-void redsea_read_files(struct redsea_directory* directory, unsigned char *path_so_far) {
-	
-	unsigned long long int block = directory->block;
-	unsigned long long int size = directory->size;
-	unsigned char *directory_name = directory->name; 
-	unsigned long long int num_children = directory->num_children;
+#define IO_RING_ENTRIES 64
+#define IMAGE_COPY_CHUNK (256ULL << 10)
 
+struct io_group;
+struct image_io {
+	int fd;
+	bool write;
+	unsigned char* buffer;
+	unsigned long long int size;
+	unsigned long long int offset;
+	unsigned long long int done;		// bytes so far, a read that hit the end stops short
+	int error;				// errno if it failed
+	struct iovec iov;			// READV/WRITEV, plain READ/WRITE needs 5.6
+	struct io_group* group;
+	struct image_io* next;			// in group->finished
+};
 
-	//strcat(path_so_far, "/");
-	uint16_t filetype = 0;		// 0x0810 for directories, 0x0820 for files, 0x0c20 for compressed files
-	unsigned char name[38];
-	unsigned long long int file_block;
-	unsigned long long int file_size;
-	unsigned long long int timestamp;
-	int subdirec = -1;
-	struct redsea_directory* subdirectories[size/64]; 	// directory size / 64 is max entries in a directory
-	unsigned char subdirectory_paths[size/64][512];
-	unsigned char path[strlen(path_so_far)+40];
-	fseek(image, (block*BLOCK_SIZE), SEEK_SET);
-	for (int i = 0; i < size/64; i++ ) {
-		fread(&filetype, 2, 1, image);
-		if (filetype == 0) {
-			break;				// end of directory
+// requests someone is waiting on
+struct io_group {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int outstanding;		// started and not handed back by image_io_wait yet
+	struct image_io* finished;
+};
+
+int io_ring_fd = -1;
+unsigned int* io_sq_head;
+unsigned int* io_sq_tail;
+unsigned int* io_sq_mask;
+unsigned int* io_sq_array;
+struct io_uring_sqe* io_sqes;
+unsigned int* io_cq_head;
+unsigned int* io_cq_tail;
+unsigned int* io_cq_mask;
+struct io_uring_cqe* io_cqes;
+void* io_sq_ring = MAP_FAILED;
+void* io_cq_ring = MAP_FAILED;
+unsigned long long int io_sq_ring_size = 0;
+unsigned long long int io_cq_ring_size = 0;
+unsigned long long int io_sqes_size = 0;
+unsigned int io_inflight = 0;			// requests the ring has, at most IO_RING_ENTRIES so the CQ can't overflow
+pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t io_space_cond = PTHREAD_COND_INITIALIZER;
+pthread_t io_thread;
+
+void io_group_init(struct io_group* group) {
+	pthread_mutex_init(&group->lock, NULL);
+	pthread_cond_init(&group->cond, NULL);
+	group->outstanding = 0;
+	group->finished = NULL;
+}
+
+void io_group_destroy(struct io_group* group) {
+	pthread_mutex_destroy(&group->lock);
+	pthread_cond_destroy(&group->cond);
+}
+
+void image_io_prepare(struct image_io* io, struct io_group* group, int fd, bool write, void* buffer, unsigned long long int size, unsigned long long int offset) {
+	io->fd = fd;
+	io->write = write;
+	io->buffer = buffer;
+	io->size = size;
+	io->offset = offset;
+	io->done = 0;
+	io->error = 0;
+	io->group = group;
+}
+
+void io_finished(struct image_io* io) {
+	struct io_group* group = io->group;
+	pthread_mutex_lock(&group->lock);
+	io->next = group->finished;
+	group->finished = io;
+	pthread_cond_signal(&group->cond);
+	pthread_mutex_unlock(&group->lock);
+}
+
+// what's left of io, with plain syscalls
+void image_io_sync(struct image_io* io) {
+	while (io->done < io->size) {
+		ssize_t moved = io->write ? pwrite(io->fd, io->buffer + io->done, io->size - io->done, io->offset + io->done)
+			: pread(io->fd, io->buffer + io->done, io->size - io->done, io->offset + io->done);
+		if (moved < 0 && errno == EINTR) continue;
+		if (moved < 0) io->error = errno;
+		else if (moved == 0 && io->write) io->error = EIO;
+		if (moved <= 0) return;
+		io->done += moved;
+	}
+}
+
+// put what's left of io in the submission queue. io_lock held
+void io_queue_locked(struct image_io* io) {
+	unsigned int tail = *io_sq_tail;
+	unsigned int index = tail & *io_sq_mask;
+	struct io_uring_sqe* sqe = &io_sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	io->iov.iov_base = io->buffer + io->done;
+	io->iov.iov_len = io->size - io->done;
+	if (io->iov.iov_len > (1ULL << 30)) io->iov.iov_len = 1ULL << 30;	// the rest goes in again when this finishes
+	sqe->opcode = io->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = io->fd;
+	sqe->addr = (uintptr_t) &io->iov;
+	sqe->len = 1;
+	sqe->off = io->offset + io->done;
+	sqe->user_data = (uintptr_t) io;
+	io_sq_array[index] = index;
+	__atomic_store_n(io_sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// hand the kernel count queued entries. io_lock held
+void io_submit_locked(unsigned int count) {
+	while (count > 0) {
+		int submitted = syscall(__NR_io_uring_enter, io_ring_fd, count, 0, 0, NULL, 0);
+		if (submitted < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) continue;
+		if (submitted < 0) {
+			perror("io_uring_enter");
+			exit(1);
 		}
-		printf("0x%04x ", filetype);
-		// handle deleted files
-		// this implementation is INCORRECT and will not work with all potential filetypes. I need to fix that
-		// these are attribute flags!
-		if (filetype == 0x0910 || filetype == 0x0920 || filetype == 0x0d20 || filetype == 0x0d00 || filetype == 0x0900) {
-			printf("DELETED FILE\n");
-			fseek(image, 62, SEEK_CUR);
-			continue;
+		stats_add(&stats_io_calls, 1);
+		count -= submitted;
+	}
+}
+
+// start count requests, prepared with image_io_prepare. they come back out of image_io_wait on their group
+void image_io_start(struct image_io* ios, unsigned int count) {
+	for (unsigned int i = 0; i < count; i++) {
+		pthread_mutex_lock(&ios[i].group->lock);
+		ios[i].group->outstanding++;
+		pthread_mutex_unlock(&ios[i].group->lock);
+	}
+	stats_add(&stats_io_requests, count);
+	if (io_ring_fd == -1) {
+		for (unsigned int i = 0; i < count; i++) {
+			image_io_sync(&ios[i]);
+			io_finished(&ios[i]);
 		}
-		if (filetype == 0x0810) printf("Directory ");
-		else if (filetype == 0x0820 || filetype == 0x0800) printf("File ");
-		else if (filetype == 0x0c20 || filetype == 0x0c00) printf("Compressed File ");
-		for (int i = 0; i < 38; i++) {
-			unsigned char current;
-			fread(&current, 1, 1, image);
-			if (current == 0 || i == 37) {	// find end of file name
-				if (current != 0) {
-					name[i] = current;
-					i++; 
-				}
-				name[i] = '\0';		// terminate file name
-				fseek(image, 37-i, SEEK_CUR);
-				break;
-			}
-			name[i] = current;
-		}
-		fread(&file_block, 8, 1, image);
-		
-		fread(&file_size, 8, 1, image);
-		strcpy(path, path_so_far);
-		strcat(path, "/");
-		strcat(path, name);
-		fread(&timestamp, 8, 1, image);						   			
-		printf("%s BLOCK %#lx SIZE %#lx TIMESTAMP %#016lx \n", path, file_block, file_size, timestamp);
-		if (filetype == 0x0810) {
-			if (strcmp(directory_name, name) != 0 && strcmp("..", name) != 0) {
-				subdirec++;
+		return;
+	}
+	pthread_mutex_lock(&io_lock);
+	unsigned int queued = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		while (io_inflight == IO_RING_ENTRIES) {
+			if (queued > 0) io_submit_locked(queued);
+			queued = 0;
+			pthread_cond_wait(&io_space_cond, &io_lock);
+		}
+		io_inflight++;
+		io_queue_locked(&ios[i]);
+		queued++;
+	}
+	if (queued > 0) io_submit_locked(queued);
+	pthread_mutex_unlock(&io_lock);
+}
 
-				strcpy(subdirectory_paths[subdirec], path);
+// the next finished request of group, NULL once they've all been handed back
+struct image_io* image_io_wait(struct io_group* group) {
+	pthread_mutex_lock(&group->lock);
+	struct image_io* io = NULL;
+	if (group->outstanding > 0) {
+		while (group->finished == NULL) pthread_cond_wait(&group->cond, &group->lock);
+		io = group->finished;
+		group->finished = io->next;
+		group->outstanding--;
+	}
+	pthread_mutex_unlock(&group->lock);
+	return io;
+}
 
-				// global directory array
-				if (directory_count+1 >= max_directory_count) {
-					expand_directory_array();
-				}
-				directory_paths[directory_count] = malloc(strlen(path)+1);
-				strcpy(directory_paths[directory_count], path);	
-				struct redsea_directory* directory_entry = malloc(sizeof(struct redsea_directory));
-				strcpy(directory_entry->name, name);
-				directory_entry -> seek_to = i*64;
-				directory_entry -> size = file_size;
-				directory_entry -> block = file_block;
-				directory_entry -> mod_date = timestamp;
-				directory_entry -> children = malloc(sizeof(char*)*(file_size/64));
-				directory_entry -> num_children = 0;
-				directory_entry -> parent = directory;
-				directory_structs[directory_count] = directory_entry;
-				subdirectories[subdirec] = directory_entry;
-				
-				directory_count++;
-			}
+void* io_thread_main(void* arg) {
+	bool stop = false;
+	while (!stop) {
+		if (syscall(__NR_io_uring_enter, io_ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+			perror("io_uring_enter");
+			exit(1);
 		}
-		else {
-			if (file_count+1 >= max_file_count) {
-				expand_file_array();
+		unsigned int head = *io_cq_head;
+		unsigned int tail = __atomic_load_n(io_cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe* cqe = &io_cqes[head & *io_cq_mask];
+			struct image_io* io = (struct image_io*) (uintptr_t) cqe->user_data;
+			int result = cqe->res;
+			if (io == NULL) {		// the nop from image_io_shutdown
+				stop = true;
+				continue;
 			}
-			file_paths[file_count] = malloc(strlen(path)+1);
-			strcpy(file_paths[file_count], path);
-			// create file entry struct after inserting path
-			struct redsea_file* file_entry = malloc(sizeof(struct redsea_file));
-			strcpy(file_entry->name, name);
-			file_entry -> seek_to = i*64;
-			file_entry -> size = file_size;
-			file_entry -> block = file_block;
-			file_entry -> mod_date = timestamp;
-			file_entry -> parent = directory;
-			file_structs[file_count] = file_entry;
-
-			file_count++;
-		}
-		if (strcmp(directory_name, name) != 0 && strcmp("..", name) != 0) {
-			directory -> children[num_children] = malloc(sizeof(char)*strlen(name)+1);
-			strcpy(directory -> children[num_children], name);
-			num_children++;
-		}
-		// set the free space pointer, eventually to the end of the image.
-		if (file_block != 0xFFFFFFFFFFFFFFFF) {					// templeos puts empty files at 0xFFFFFFFFFFFFFFFF
-											// but nothing actually gets created there
-											// (it would be rather difficult to find a 
-											// 16 EiB disk anways)
-			
-			// below really should probably be > and not >= but it makes it slightly easier to deal with 0
-			// size files. I should have just gone the proper TOS implementation route in doing this.
-			// but I didn't
-			if ((file_block*BLOCK_SIZE + file_size + BLOCK_SIZE-1) / BLOCK_SIZE >= free_space_pointer) {
-				free_space_pointer = (file_block*BLOCK_SIZE+file_size+BLOCK_SIZE-1)/BLOCK_SIZE+1;
+			pthread_mutex_lock(&io_lock);		// it was queued under this
+			bool finished = true;
+			if (result == -EINTR || result == -EAGAIN) finished = false;
+			else if (result < 0) io->error = -result;
+			else if (result == 0 && io->write) io->error = EIO;
+			else if (result > 0) {
+				io->done += result;
+				finished = io->done == io->size;
+			}
+			if (finished) {
+				io_inflight--;
+				pthread_cond_signal(&io_space_cond);
 			}
+			else {
+				io_queue_locked(io);
+				io_submit_locked(1);
+			}
+			pthread_mutex_unlock(&io_lock);
+			if (finished) io_finished(io);
 		}
+		__atomic_store_n(io_cq_head, head, __ATOMIC_RELEASE);
 	}
-	directory->num_children = num_children;
-	for (int i = 0; i<=subdirec; i++) {
+	return NULL;
+}
+
+void io_unmap_ring() {
+	if (io_sqes != NULL && io_sqes != MAP_FAILED) munmap(io_sqes, io_sqes_size);
+	if (io_cq_ring != MAP_FAILED && io_cq_ring != io_sq_ring) munmap(io_cq_ring, io_cq_ring_size);
+	if (io_sq_ring != MAP_FAILED) munmap(io_sq_ring, io_sq_ring_size);
+	io_sqes = NULL;
+	io_sq_ring = io_cq_ring = MAP_FAILED;
+}
 
-		struct redsea_directory* subdir = subdirectories[i];
-		unsigned char* sub_path = subdirectory_paths[i];
-		redsea_read_files(subdir, sub_path);
+// at init, fuse has daemonized by then. false leaves everything synchronous
+bool image_io_setup() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+	if (fd < 0) {
+		perror("io_uring_setup");
+		return false;
 	}
+	io_sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+	io_cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (io_cq_ring_size > io_sq_ring_size) io_sq_ring_size = io_cq_ring_size;
+		io_cq_ring_size = io_sq_ring_size;
+	}
+	io_sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+	io_sq_ring = mmap(NULL, io_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) io_cq_ring = io_sq_ring;
+	else io_cq_ring = mmap(NULL, io_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	io_sqes = mmap(NULL, io_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (io_sq_ring == MAP_FAILED || io_cq_ring == MAP_FAILED || io_sqes == MAP_FAILED) {
+		perror("io_uring mmap");
+		io_unmap_ring();
+		close(fd);
+		return false;
+	}
+	unsigned char* sq = io_sq_ring;
+	unsigned char* cq = io_cq_ring;
+	io_sq_head = (unsigned int*) (sq + params.sq_off.head);
+	io_sq_tail = (unsigned int*) (sq + params.sq_off.tail);
+	io_sq_mask = (unsigned int*) (sq + params.sq_off.ring_mask);
+	io_sq_array = (unsigned int*) (sq + params.sq_off.array);
+	io_cq_head = (unsigned int*) (cq + params.cq_off.head);
+	io_cq_tail = (unsigned int*) (cq + params.cq_off.tail);
+	io_cq_mask = (unsigned int*) (cq + params.cq_off.ring_mask);
+	io_cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+	io_ring_fd = fd;
+	if (pthread_create(&io_thread, NULL, io_thread_main, NULL) != 0) {
+		io_ring_fd = -1;
+		io_unmap_ring();
+		close(fd);
+		return false;
+	}
+	debug_printf("IO_URING: %u entries, depth %u\n", params.sq_entries, options.io_depth);
+	return true;
+}
 
+// at destroy once nothing else is using it, anything after goes back to synchronous
+void image_io_shutdown() {
+	if (io_ring_fd == -1) return;
+	pthread_mutex_lock(&io_lock);
+	unsigned int tail = *io_sq_tail;
+	unsigned int index = tail & *io_sq_mask;
+	memset(&io_sqes[index], 0, sizeof(struct io_uring_sqe));
+	io_sqes[index].opcode = IORING_OP_NOP;
+	io_sq_array[index] = index;
+	__atomic_store_n(io_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	io_submit_locked(1);
+	pthread_mutex_unlock(&io_lock);
+	pthread_join(io_thread, NULL);
+	io_unmap_ring();
+	close(io_ring_fd);
+	io_ring_fd = -1;
 }
 
-/* Gets the contents of a given file
- * 
+/* Direct I/O
+ * with -o direct file data goes to and from the image through a second fd
+ * opened O_DIRECT, so a partition or LV doesn't get cached by the host
+ * under us as well as by the kernel above fuse. O_DIRECT wants the buffer,
+ * offset and length all on a sector boundary (direct_align, the device's
+ * logical sector size or 4K for a plain file), so everything is bounced
+ * through one of a fixed set of aligned buffers, each big enough that a
+ * whole read or write request from the kernel is one I/O. The unaligned
+ * ends of a write, which is all a metadata update ever is, go through the
+ * normal fd and the page cache, the kernel keeps the two coherent.
+ * Directories are still decoded out of the mapping, they're small and
+ * looked at over and over.
  */
+#define DIRECT_BUFFER_SIZE (1ULL << 20)
+#define DIRECT_BUFFERS 8
+int direct_fd = -1;
+unsigned long long int direct_align = 4096;
+unsigned char* direct_buffers[DIRECT_BUFFERS];		// the free ones are at the front
+unsigned int direct_free_buffers = 0;
+pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t direct_cond = PTHREAD_COND_INITIALIZER;
 
-unsigned char* redsea_file_content(struct redsea_file* rs_file, size_t size, off_t offset) {
-	rewind(image);
-	unsigned char* content = malloc(size);
-	fseek(image, (rs_file->block)*BLOCK_SIZE+offset, SEEK_SET);
-	fread(content, 1, size, image);
-	return content;
+// false if the image can't do O_DIRECT, everything just stays buffered then
+bool open_direct(const char* devfile) {
+	direct_fd = open(devfile, O_RDWR | O_DIRECT);
+	if (direct_fd == -1) {
+		perror("O_DIRECT");
+		return false;
+	}
+	struct stat st;
+	int sector;
+	if (fstat(direct_fd, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(direct_fd, BLKSSZGET, &sector) == 0) direct_align = sector;
+	for (int i = 0; i < DIRECT_BUFFERS; i++) {
+		if (posix_memalign((void**) &direct_buffers[i], direct_align, DIRECT_BUFFER_SIZE) != 0) exit(1);
+	}
+	direct_free_buffers = DIRECT_BUFFERS;
+	debug_printf("DIRECT I/O: %llu byte sectors\n", direct_align);
+	return true;
 }
 
-int redsea_remove_common(struct redsea_directory* parent, unsigned long long int seek_to, unsigned char* name) {
-	unsigned long long int loc = -1;			//file loc in parent->children
-	for (int i = 0; i<parent->num_children; i++) {
-		if (strcmp(parent->children[i], name) == 0) {
-			loc = i;
-			break;
+unsigned char* take_direct_buffer() {
+	pthread_mutex_lock(&direct_lock);
+	while (direct_free_buffers == 0) pthread_cond_wait(&direct_cond, &direct_lock);
+	unsigned char* buffer = direct_buffers[--direct_free_buffers];
+	pthread_mutex_unlock(&direct_lock);
+	return buffer;
+}
+
+void give_direct_buffer(unsigned char* buffer) {
+	pthread_mutex_lock(&direct_lock);
+	direct_buffers[direct_free_buffers++] = buffer;
+	pthread_cond_signal(&direct_cond);
+	pthread_mutex_unlock(&direct_lock);
+}
+
+void cache_read(void* buffer, unsigned long long int size, unsigned long long int offset);
+
+// image_read without the page cache, anything past the end reads as zeroes
+void image_read_direct(void* buffer, unsigned long long int size, unsigned long long int offset) {
+	if (cache_shards != NULL) {
+		cache_read(buffer, size, offset);
+		return;
+	}
+	unsigned char* bounce = take_direct_buffer();
+	unsigned char* out = buffer;
+	unsigned long long int done = 0;
+	while (done < size) {
+		unsigned long long int position = offset + done;
+		unsigned long long int start = position & ~(direct_align-1);
+		unsigned long long int length = (position + size - done - start + direct_align-1) & ~(direct_align-1);
+		if (length > DIRECT_BUFFER_SIZE) length = DIRECT_BUFFER_SIZE;
+		ssize_t got = pread(direct_fd, bounce, length, start);
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0) {
+			perror("pread");
+			got = 0;
 		}
+		unsigned long long int skip = position - start;
+		unsigned long long int count = length - skip;
+		if (count > size - done) count = size - done;
+		unsigned long long int have = got > skip ? got - skip : 0;
+		if (have > count) have = count;
+		memcpy(out + done, bounce + skip, have);
+		memset(out + done + have, 0, count - have);
+		done += count;
 	}
-	if (loc == -1) return -1;
-	
-	// remove file from parent children list.
-	// I could also remove it from the global file list but there's no
-	// real need to other than for memory concerns. (so I probably should)
-	for (unsigned long long int i = loc; i<parent->num_children; i++) {
-		parent->children[i]=parent->children[i+1];
-	}
-	parent->num_children--;
-
-	rewind(image);
-	fseek(image, (parent->block*BLOCK_SIZE), SEEK_SET);
-	uint16_t filetype;
-	fseek(image, seek_to, SEEK_CUR);
-	fread(&filetype, 2, 1, image);
-	fseek(image, -2, SEEK_CUR);
-	filetype += 0x100;					// mark file as deleted
-	unsigned char buf[2];
-	buf[0] = filetype & 0xff;
-	buf[1] = (filetype >> 8) & 0xff;
-	fwrite(buf, 2, 1, image);
+	give_direct_buffer(bounce);
+}
 
-	return 0;
+// the whole sectors in the middle go O_DIRECT, the bits either side buffered
+void image_write_direct(const unsigned char* buffer, unsigned long long int size, unsigned long long int offset) {
+	unsigned long long int start = (offset + direct_align-1) & ~(direct_align-1);
+	unsigned long long int end = (offset + size) & ~(direct_align-1);
+	if (start >= end) {
+		image_pwrite(image_fd, buffer, size, offset);
+		return;
+	}
+	if (start > offset) image_pwrite(image_fd, buffer, start - offset, offset);
+	unsigned char* bounce = take_direct_buffer();
+	for (unsigned long long int position = start; position < end; position += DIRECT_BUFFER_SIZE) {
+		unsigned long long int length = end - position;
+		if (length > DIRECT_BUFFER_SIZE) length = DIRECT_BUFFER_SIZE;
+		memcpy(bounce, buffer + (position - offset), length);
+		if (!image_pwrite(direct_fd, bounce, length, position)) break;
+	}
+	give_direct_buffer(bounce);
+	if (offset + size > end) image_pwrite(image_fd, buffer + (end - offset), offset + size - end, end);
 }
 
-void move_file_to_end(struct redsea_file* file) {
-	unsigned long long int new_block = free_space_pointer;
-	unsigned long long int old_block = file -> block;
-	unsigned long long int size = file -> size;
-	unsigned char* buf = malloc(size);
-	rewind(image);
-	fseek(image, old_block*BLOCK_SIZE, SEEK_SET);
-	fread(buf, 1, size, image);
-	fseek(image, new_block*BLOCK_SIZE, SEEK_SET);
-	fwrite(buf, 1, size, image);
-	free(buf);	
+/* Block cache
+ * with -o direct and -o cache=MB file data doesn't go straight to the disk
+ * but through a cache of CACHE_CHUNK pieces of the image, so data that's
+ * read over and over is only read once and writes sit in memory until an
+ * fsync, a close, the writeback timer or being evicted writes them back.
+ * It's split into CACHE_SHARDS shards by chunk number, each with its own
+ * lock, hash table and LRU list, so neighbouring chunks are in different
+ * shards and readers of different files hardly ever wait on each other.
+ * Without -o direct the page cache behind the mapping is already this, and
+ * directories are only read off the image once at mount anyway.
+ * Everything else that touches the image has to agree with it: readers of
+ * the mapping (image_bytes, image_read) write back anything dirty in their
+ * range first, writes that go around it (journal commits, image_copy,
+ * anything growing the image) write back and drop the chunks they overlap,
+ * and image_sync writes the whole lot back before syncing.
+ */
+#define CACHE_CHUNK (64ULL << 10)
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 1024		// per shard
+struct cache_chunk {
+	unsigned long long int index;		// offset / CACHE_CHUNK
+	unsigned char* data;			// direct_align aligned so a miss is one O_DIRECT read
+	unsigned int dirty_start;		// what's been written since it was last written back,
+	unsigned int dirty_end;			// always one run. 0 if it's clean
+	struct cache_chunk* hash_next;
+	struct cache_chunk* newer;
+	struct cache_chunk* older;
+};
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct cache_chunk* buckets[CACHE_BUCKETS];
+	struct cache_chunk* newest;
+	struct cache_chunk* oldest;
+	unsigned long long int chunks;
+};
+unsigned long long int cache_shard_limit = 0;	// chunks each shard can hold
 
-	file -> block = new_block;
-	rewind(image);
-	fseek(image, file->parent->block*BLOCK_SIZE + file->seek_to, SEEK_SET);
-	fseek(image, 40, SEEK_CUR);				// find block
-	unsigned char nb_char[8] = {new_block & 0xff, (new_block >> 8) & 0xff, (new_block >> 16) & 0xff, (new_block>>24) & 0xff,
-		(new_block>>32) & 0xff, (new_block >> 40) & 0xff, (new_block >> 48) & 0xff, (new_block >> 56) & 0xff};
-	fwrite(nb_char, 8, 1, image);
-	// should be always true?
-	if ((new_block*BLOCK_SIZE + size + BLOCK_SIZE-1) / BLOCK_SIZE > free_space_pointer) {
-			free_space_pointer = (new_block*BLOCK_SIZE+size+BLOCK_SIZE-1)/BLOCK_SIZE+1;
-	}
+void cache_init() {
+	cache_shard_limit = ((unsigned long long int)options.cache_mb << 20) / CACHE_CHUNK / CACHE_SHARDS;
+	if (cache_shard_limit == 0) cache_shard_limit = 1;
+	cache_shards = calloc(CACHE_SHARDS, sizeof(struct cache_shard));
+	for (int i = 0; i < CACHE_SHARDS; i++) pthread_mutex_init(&cache_shards[i].lock, NULL);
+	debug_printf("BLOCK CACHE: %llu chunks of %llu bytes\n", cache_shard_limit*CACHE_SHARDS, CACHE_CHUNK);
 }
 
-// could probably merge a lot of this functions functionality with the above function
-// without too many issues
+struct cache_shard* cache_shard_for(unsigned long long int index) {
+	return &cache_shards[index % CACHE_SHARDS];
+}
 
-void move_directory_to_end(struct redsea_directory* directory) {
-	unsigned long long int new_block = free_space_pointer;
-	unsigned long long int old_block = directory -> block;
-	unsigned long long int size = directory -> size;
-	unsigned char* buf = malloc(size);
-	rewind(image);
-	fseek(image, old_block*BLOCK_SIZE, SEEK_SET);
-	fread(buf, 1, size, image);
-	fseek(image, new_block*BLOCK_SIZE, SEEK_SET);
-	fwrite(buf, 1, size, image);
-	directory -> block = new_block;
-	free(buf);
+// shard->lock held for all of these
+struct cache_chunk* cache_find(struct cache_shard* shard, unsigned long long int index) {
+	struct cache_chunk* chunk = shard->buckets[(index / CACHE_SHARDS) % CACHE_BUCKETS];
+	while (chunk != NULL && chunk->index != index) chunk = chunk->hash_next;
+	return chunk;
+}
 
-	unsigned char* blank = calloc(BLOCK_SIZE, 1);
-	fwrite(blank, BLOCK_SIZE, 1, image);
-	free(blank);
+void cache_link_newest(struct cache_shard* shard, struct cache_chunk* chunk) {
+	chunk->older = shard->newest;
+	chunk->newer = NULL;
+	if (shard->newest != NULL) shard->newest->newer = chunk;
+	else shard->oldest = chunk;
+	shard->newest = chunk;
+}
 
-	// add more space for directory
-	size += BLOCK_SIZE;
-	directory->size = size;
-	directory->children = realloc(directory->children, sizeof(char*)*size/64);
+void cache_unlink_lru(struct cache_shard* shard, struct cache_chunk* chunk) {
+	if (chunk->newer != NULL) chunk->newer->older = chunk->older;
+	else shard->newest = chunk->older;
+	if (chunk->older != NULL) chunk->older->newer = chunk->newer;
+	else shard->oldest = chunk->newer;
+}
+
+// out of the hash table and the LRU, the caller frees or reuses it
+void cache_remove(struct cache_shard* shard, struct cache_chunk* chunk) {
+	struct cache_chunk** link = &shard->buckets[(chunk->index / CACHE_SHARDS) % CACHE_BUCKETS];
+	while (*link != chunk) link = &(*link)->hash_next;
+	*link = chunk->hash_next;
+	cache_unlink_lru(shard, chunk);
+	shard->chunks--;
+}
+
+void cache_write_back(struct cache_chunk* chunk) {
+	if (chunk->dirty_end == 0) return;
+	image_write_direct(chunk->data + chunk->dirty_start, chunk->dirty_end - chunk->dirty_start, chunk->index*CACHE_CHUNK + chunk->dirty_start);
+	chunk->dirty_start = chunk->dirty_end = 0;
+	__atomic_fetch_sub(&cache_dirty_chunks, 1, __ATOMIC_RELEASE);
+	stats_add(&stats_cache_writebacks, 1);
+}
+
+// dropping it without writing it back, for what's been cut off the image
+void cache_discard(struct cache_chunk* chunk) {
+	if (chunk->dirty_end != 0) __atomic_fetch_sub(&cache_dirty_chunks, 1, __ATOMIC_RELEASE);
+	free(chunk->data);
+	free(chunk);
+}
+
+/* the chunk at index, now the newest. On a miss the oldest one makes room
+ * once the shard's full, and if fill is set it's read off the image, past
+ * the end reads as zeroes. Without fill the caller's about to overwrite all
+ * of it
+ */
+struct cache_chunk* cache_get(struct cache_shard* shard, unsigned long long int index, bool fill) {
+	struct cache_chunk* chunk = cache_find(shard, index);
+	if (chunk != NULL) {
+		stats_add(&stats_cache_hits, 1);
+		cache_unlink_lru(shard, chunk);
+		cache_link_newest(shard, chunk);
+		return chunk;
+	}
+	stats_add(&stats_cache_misses, 1);
+	if (shard->chunks >= cache_shard_limit) {
+		chunk = shard->oldest;
+		cache_write_back(chunk);
+		cache_remove(shard, chunk);
+	}
+	else {
+		chunk = malloc(sizeof(struct cache_chunk));
+		if (posix_memalign((void**) &chunk->data, direct_align, CACHE_CHUNK) != 0) exit(1);
+	}
+	chunk->index = index;
+	chunk->dirty_start = chunk->dirty_end = 0;
+	if (fill) {
+		ssize_t got;
+		while ((got = pread(direct_fd, chunk->data, CACHE_CHUNK, index*CACHE_CHUNK)) < 0 && errno == EINTR);
+		if (got < 0) {
+			perror("pread");
+			got = 0;
+		}
+		memset(chunk->data + got, 0, CACHE_CHUNK - got);
+	}
+	struct cache_chunk** bucket = &shard->buckets[(index / CACHE_SHARDS) % CACHE_BUCKETS];
+	chunk->hash_next = *bucket;
+	*bucket = chunk;
+	cache_link_newest(shard, chunk);
+	shard->chunks++;
+	return chunk;
+}
+
+void cache_read(void* buffer, unsigned long long int size, unsigned long long int offset) {
+	unsigned char* out = buffer;
+	for (unsigned long long int done = 0; done < size;) {
+		unsigned long long int index = (offset + done) / CACHE_CHUNK;
+		unsigned long long int skip = (offset + done) % CACHE_CHUNK;
+		unsigned long long int count = CACHE_CHUNK - skip < size - done ? CACHE_CHUNK - skip : size - done;
+		struct cache_shard* shard = cache_shard_for(index);
+		pthread_mutex_lock(&shard->lock);
+		memcpy(out + done, cache_get(shard, index, true)->data + skip, count);
+		pthread_mutex_unlock(&shard->lock);
+		done += count;
+	}
+}
+
+// only inside the image, image_write sends anything growing it around the cache
+void cache_write(const void* buffer, unsigned long long int size, unsigned long long int offset) {
+	const unsigned char* in = buffer;
+	for (unsigned long long int done = 0; done < size;) {
+		unsigned long long int index = (offset + done) / CACHE_CHUNK;
+		unsigned long long int skip = (offset + done) % CACHE_CHUNK;
+		unsigned long long int count = CACHE_CHUNK - skip < size - done ? CACHE_CHUNK - skip : size - done;
+		struct cache_shard* shard = cache_shard_for(index);
+		pthread_mutex_lock(&shard->lock);
+		struct cache_chunk* chunk = cache_get(shard, index, count < CACHE_CHUNK);
+		// a gap between this and what's dirty would get written back too, over whatever went around the cache there
+		if (chunk->dirty_end != 0 && (skip > chunk->dirty_end || skip + count < chunk->dirty_start)) cache_write_back(chunk);
+		memcpy(chunk->data + skip, in + done, count);
+		if (chunk->dirty_end == 0) {
+			chunk->dirty_start = skip;
+			chunk->dirty_end = skip + count;
+			__atomic_fetch_add(&cache_dirty_chunks, 1, __ATOMIC_RELEASE);
+		}
+		else {
+			if (skip < chunk->dirty_start) chunk->dirty_start = skip;
+			if (skip + count > chunk->dirty_end) chunk->dirty_end = skip + count;
+		}
+		pthread_mutex_unlock(&shard->lock);
+		done += count;
+	}
+}
+
+// dirty chunks in the range written back, and if drop is set taken out too
+void cache_sweep(unsigned long long int offset, unsigned long long int size, bool drop) {
+	if (size == 0) return;
+	for (unsigned long long int index = offset / CACHE_CHUNK; index <= (offset + size - 1) / CACHE_CHUNK; index++) {
+		struct cache_shard* shard = cache_shard_for(index);
+		pthread_mutex_lock(&shard->lock);
+		struct cache_chunk* chunk = cache_find(shard, index);
+		if (chunk != NULL) {
+			cache_write_back(chunk);
+			if (drop) {
+				cache_remove(shard, chunk);
+				cache_discard(chunk);
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+// before reading the range some other way than through the cache
+void cache_flush_range(unsigned long long int offset, unsigned long long int size) {
+	if (cache_shards == NULL || __atomic_load_n(&cache_dirty_chunks, __ATOMIC_ACQUIRE) == 0) return;
+	cache_sweep(offset, size, false);
+}
+
+// before writing the range some other way than through the cache
+void cache_drop_range(unsigned long long int offset, unsigned long long int size) {
+	if (cache_shards == NULL) return;
+	cache_sweep(offset, size, true);
+}
+
+void cache_flush_all() {
+	if (cache_shards == NULL || __atomic_load_n(&cache_dirty_chunks, __ATOMIC_ACQUIRE) == 0) return;
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard* shard = &cache_shards[i];
+		pthread_mutex_lock(&shard->lock);
+		for (struct cache_chunk* chunk = shard->oldest; chunk != NULL; chunk = chunk->newer) cache_write_back(chunk);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+// the image is being cut down to length, what's past it goes without being written
+void cache_truncate(unsigned long long int length) {
+	if (cache_shards == NULL) return;
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard* shard = &cache_shards[i];
+		pthread_mutex_lock(&shard->lock);
+		struct cache_chunk* chunk = shard->oldest;
+		while (chunk != NULL) {
+			struct cache_chunk* newer = chunk->newer;
+			unsigned long long int start = chunk->index*CACHE_CHUNK;
+			if (start + CACHE_CHUNK > length) {
+				if (start < length && chunk->dirty_end > length - start) chunk->dirty_end = length - start;
+				if (start < length && chunk->dirty_start < chunk->dirty_end) cache_write_back(chunk);
+				cache_remove(shard, chunk);
+				cache_discard(chunk);
+			}
+			chunk = newer;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+// cache written back then the image synced, 0 or -1 like fsync
+int image_sync(bool datasync) {
+	cache_flush_all();
+	return datasync ? fdatasync(image_fd) : fsync(image_fd);
+}
+
+void image_write(const void* buffer, unsigned long long int size, unsigned long long int offset) {
+	if (cache_shards != NULL && offset + size <= image_size()) {
+		cache_write(buffer, size, offset);
+		return;
+	}
+	cache_drop_range(offset, size);
+	if (direct_fd != -1) image_write_direct(buffer, size, offset);
+	else image_pwrite(image_fd, buffer, size, offset);
+	cache_drop_range(offset, size);		// in case someone read it back in meanwhile
+	if (offset + size > image_size()) image_remap();
+}
+
+// little endian helpers, RedSea (and the host) is little endian
+uint16_t image_le16(unsigned long long int offset) {
+	uint16_t value;
+	image_read(&value, 2, offset);
+	return value;
+}
+
+unsigned long long int image_le64(unsigned long long int offset) {
+	unsigned long long int value;
+	image_read(&value, 8, offset);
+	return value;
+}
+
+// image_copy one piece after another on this thread
+void image_copy_sync(unsigned long long int to, unsigned long long int from, unsigned long long int size) {
+	if (direct_fd != -1) {
+		unsigned long long int step = size < DIRECT_BUFFER_SIZE ? size : DIRECT_BUFFER_SIZE;
+		unsigned char* chunk = malloc(step ? step : 1);
+		for (unsigned long long int done = 0; done < size; done += step) {
+			if (step > size - done) step = size - done;
+			image_read_direct(chunk, step, from + done);
+			image_write(chunk, step, to + done);
+		}
+		free(chunk);
+		return;
+	}
+	unsigned long long int length = image_size();
+	unsigned long long int available = 0;
+	if (from < length) available = length - from;
+	if (available > size) available = size;
+	image_write(image_map + from, available, to);
+	if (available < size) {
+		unsigned char* blank = calloc(size - available, 1);
+		image_write(blank, size - available, to + available);
+		free(blank);
+	}
+}
+
+/* copy size bytes inside the image. source and destination must not overlap.
+ * With io_uring it's io_depth chunks at a time, each written as soon as it's
+ * read. Buffered the chunks are written straight out of the mapping so
+ * there's no read step, with -o direct they're read into aligned buffers
+ * and written O_DIRECT, which only works if everything's sector aligned.
+ */
+void image_copy(unsigned long long int to, unsigned long long int from, unsigned long long int size) {
+	bool direct = direct_fd != -1;
+	cache_flush_range(from, size);
+	cache_drop_range(to, size);
+	if (io_ring_fd == -1 || (direct && ((to | from | size) & (direct_align-1)) != 0)) {
+		image_copy_sync(to, from, size);
+		return;
+	}
+	unsigned long long int copied = size;
+	if (!direct) {
+		unsigned long long int length = image_size();
+		copied = from < length ? length - from : 0;
+		if (copied > size) copied = size;
+	}
+	unsigned long long int chunks = (copied + IMAGE_COPY_CHUNK-1) / IMAGE_COPY_CHUNK;
+	unsigned int depth = chunks < options.io_depth ? chunks : options.io_depth;
+	struct image_io* ios = calloc(depth ? depth : 1, sizeof(struct image_io));
+	struct io_group group;
+	io_group_init(&group);
+	unsigned long long int next = 0;		// start of the first chunk nothing's been started for
+	for (unsigned int i = 0; i < depth; i++) {
+		unsigned long long int length = copied - next < IMAGE_COPY_CHUNK ? copied - next : IMAGE_COPY_CHUNK;
+		if (direct) {
+			unsigned char* buffer;
+			if (posix_memalign((void**) &buffer, direct_align, IMAGE_COPY_CHUNK) != 0) exit(1);
+			image_io_prepare(&ios[i], &group, direct_fd, false, buffer, length, from + next);
+		}
+		else image_io_prepare(&ios[i], &group, image_fd, true, image_map + from + next, length, to + next);
+		next += length;
+	}
+	image_io_start(ios, depth);
+	struct image_io* io;
+	while ((io = image_io_wait(&group)) != NULL) {
+		if (io->error != 0) fprintf(stderr, "image copy at %#llx: %s\n", io->offset, strerror(io->error));
+		if (!io->write) {
+			memset(io->buffer + io->done, 0, io->size - io->done);	// past the end reads as zeroes
+			image_io_prepare(io, &group, direct_fd, true, io->buffer, io->size, to + (io->offset - from));
+			image_io_start(io, 1);
+			continue;
+		}
+		if (next == copied) {
+			if (direct) free(io->buffer);
+			continue;
+		}
+		unsigned long long int length = copied - next < IMAGE_COPY_CHUNK ? copied - next : IMAGE_COPY_CHUNK;
+		if (direct) image_io_prepare(io, &group, direct_fd, false, io->buffer, length, from + next);
+		else image_io_prepare(io, &group, image_fd, true, image_map + from + next, length, to + next);
+		next += length;
+		image_io_start(io, 1);
+	}
+	io_group_destroy(&group);
+	free(ios);
+	cache_drop_range(to, copied);		// in case someone read it back in meanwhile
+	if (copied < size) {
+		unsigned char* blank = calloc(size - copied, 1);
+		image_write(blank, size - copied, to + copied);
+		free(blank);
+	}
+	else if (to + size > image_size()) image_remap();
+}
+
+// same but the ranges may overlap as long as it's moving down, like when compacting
+void image_move(unsigned long long int to, unsigned long long int from, unsigned long long int size) {
+	unsigned long long int step = size;
+	if (to < from && from - to < size) step = from - to;		// pieces that don't overlap, front to back
+	for (unsigned long long int done = 0; done < size; done += step) {
+		if (step > size - done) step = size - done;
+		image_copy(to + done, from + done, step);
+	}
+}
+
+// cut the image down to length bytes. the mapping stays as it is, nothing reads past image_size()
+void image_truncate(unsigned long long int length) {
+	cache_truncate(length);
+	pthread_mutex_lock(&image_lock);
+	if (ftruncate(image_fd, length) != 0) perror("ftruncate");
+	else __atomic_store_n(&image_length, length, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&image_lock);
+}
+
+unsigned int boot_catalog_pointer() {
+	unsigned int buf;			// 4 byte
+	image_read(&buf, 4, 0x8800 + 0x47);
+	return buf;
+}
+
+/*
+ * find block for root directory in allocation bitmap (I think?)
+ * block is always 0x58 as far as i know, but kept as a parameter just in case
+ * root directory block is given at 0x18, presumably next 7 bytes as well
+ */
+unsigned long long int root_directory_block(unsigned int block) {
+	unsigned long long int root_block = image_le64(block*BLOCK_SIZE + 0x18);
+	debug_printf("ROOT DIRECTORY BLOCK: %#llx\n", root_block);
+	return root_block;
+}
+
+/*
+ *Check boot catalog sector for 0x54 0x65 0x64 0x70 block indicating TOS
+ */
+bool redsea_identity_check(unsigned int boot_catalog) {
+	unsigned int buf;
+	image_read(&buf, 4, boot_catalog*ISO_9660_SECTOR_SIZE+4);
+	unsigned int tos_string = 0x706d6554;	// check for TempleOS fs signature. not the actual signature location
+						// but will this will always be there. I should probably make this 
+						// look for the actual RedSea signature. :/
+	if (buf != tos_string) return false;
+	return true;
+}
+
+/* Free space
+ * free_extents is a sorted array of the holes between used data, rebuilt
+ * from the directory walk at mount. Everything from free_space_pointer on
+ * is free too, it's only moved forward when no hole is big enough.
+ * Allocation is best fit so small holes get used up before big ones get
+ * split. Nothing below the root directory is ever handed out, that's the
+ * boot area. Guarded by allocator_lock.
+ */
+struct extent {
+	unsigned long long int block;
+	unsigned long long int count;			// in blocks
+};
+struct extent* free_extents = NULL;
+unsigned long long int free_extent_count = 0;
+unsigned long long int max_free_extents = 0;
+unsigned long long int free_hole_blocks = 0;		// total blocks in free_extents
+struct extent* used_extents = NULL;			// only used while walking the tree at mount
+unsigned long long int used_extent_count = 0;
+unsigned long long int max_used_extents = 0;
+
+void note_used_extent(unsigned long long int block, unsigned long long int count) {
+	if (block == 0xFFFFFFFFFFFFFFFF) return;			// templeos empty file, takes no space
+	if (used_extent_count == max_used_extents) {
+		max_used_extents = max_used_extents ? max_used_extents*2 : 64;
+		used_extents = realloc(used_extents, sizeof(struct extent)*max_used_extents);
+	}
+	used_extents[used_extent_count].block = block;
+	used_extents[used_extent_count].count = count;
+	used_extent_count++;
+}
+
+int compare_extents(const void* a, const void* b) {
+	const struct extent* x = a;
+	const struct extent* y = b;
+	if (x->block < y->block) return -1;
+	return x->block > y->block;
+}
+
+void free_extent_insert(unsigned long long int pos, unsigned long long int block, unsigned long long int count) {
+	if (free_extent_count == max_free_extents) {
+		max_free_extents = max_free_extents ? max_free_extents*2 : 64;
+		free_extents = realloc(free_extents, sizeof(struct extent)*max_free_extents);
+	}
+	memmove(&free_extents[pos+1], &free_extents[pos], sizeof(struct extent)*(free_extent_count-pos));
+	free_extents[pos].block = block;
+	free_extents[pos].count = count;
+	free_extent_count++;
+}
+
+void free_extent_remove(unsigned long long int pos) {
+	memmove(&free_extents[pos], &free_extents[pos+1], sizeof(struct extent)*(free_extent_count-pos-1));
+	free_extent_count--;
+}
+
+// first hole starting after block
+unsigned long long int free_extent_search(unsigned long long int block) {
+	unsigned long long int low = 0;
+	unsigned long long int high = free_extent_count;
+	while (low < high) {
+		unsigned long long int mid = (low + high) / 2;
+		if (free_extents[mid].block <= block) low = mid + 1;
+		else high = mid;
+	}
+	return low;
+}
+
+/* Turn the extents seen during the walk into the free map.
+ * start is the first block the allocator may use
+ */
+void build_free_extents(unsigned long long int start) {
+	qsort(used_extents, used_extent_count, sizeof(struct extent), compare_extents);
+	unsigned long long int end = start;
+	for (unsigned long long int i = 0; i < used_extent_count; i++) {
+		if (used_extents[i].block > end) {
+			free_extent_insert(free_extent_count, end, used_extents[i].block - end);
+			free_hole_blocks += used_extents[i].block - end;
+		}
+		if (used_extents[i].block + used_extents[i].count > end) {
+			end = used_extents[i].block + used_extents[i].count;
+		}
+	}
+	free_space_pointer = end;
+	free(used_extents);
+	used_extents = NULL;
+	used_extent_count = max_used_extents = 0;
+	debug_printf("FREE EXTENTS: %llu holes, %#llx blocks, end %#llx\n", free_extent_count, free_hole_blocks, free_space_pointer);
+}
+
+/* Building the free map needs every extent on the image, which would mean
+ * walking the whole tree at mount. Instead a scan of the on disk directories
+ * that only notes extents (no structs, no paths) runs in the background,
+ * started from init. Anything that touches the allocator waits for it in
+ * ensure_free_map first, and anything that frees space does that before
+ * changing the disk, so the scan never sees a half done operation.
+ */
+pthread_once_t free_map_once = PTHREAD_ONCE_INIT;
+
+void scan_directory_extents(unsigned long long int block, unsigned long long int size, int depth) {
+	if (depth > 64) return;				// in case a broken image loops
+	unsigned char* entries = image_view(block*BLOCK_SIZE, size);
+	if (entries == NULL) return;
+	for (unsigned long long int i = 2; i < size/64; i++) {	// skip the directory itself and ..
+		unsigned char* entry = entries + i*64;
+		uint16_t filetype;
+		unsigned long long int entry_block;
+		unsigned long long int entry_size;
+		memcpy(&filetype, entry, 2);
+		if (filetype == 0) break;			// end of directory
+		if (filetype & 0x100) continue;			// deleted
+		memcpy(&entry_block, entry+40, 8);
+		memcpy(&entry_size, entry+48, 8);
+		note_used_extent(entry_block, blocks_for(entry_size));
+		if (filetype & 0x10) scan_directory_extents(entry_block, entry_size, depth+1);
+	}
+	image_view_done(entries);
+}
+
+/* Index sidecar
+ * With -o index=FILE the free map gets saved at unmount and read back at the
+ * next mount instead of scanning. Directories don't need saving, they're only
+ * decoded when something looks at them. The header has the image size and
+ * mtime from after our last write, so if anything else touched the image
+ * since (templeos, another tool, us crashing) it won't match and the scan
+ * runs like normal. The file is the header followed by the extents as they
+ * are in memory, so loading is just a map and a copy.
+ */
+#define INDEX_MAGIC "RSIDX001"
+struct index_header {
+	char magic[8];
+	unsigned long long int image_size;
+	long long int mtime_sec;
+	long long int mtime_nsec;
+	unsigned long long int root_block;
+	unsigned long long int free_space_pointer;
+	unsigned long long int extent_count;
+	unsigned long long int checksum;		// FNV-1a over the extents
+	// struct extent[extent_count] follows
+};
+
+// FNV-1a, for the index and the journal
+unsigned long long int checksum_bytes(const void* data, unsigned long long int size) {
+	const unsigned char* bytes = data;
+	unsigned long long int hash = 0xcbf29ce484222325ULL;
+	for (unsigned long long int i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+bool load_index(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return false;
+	struct stat index_stat;
+	struct stat image_stat;
+	bool good = false;
+	// a block device's mtime doesn't move when it's written so there'd be no telling if it's stale
+	if (fstat(fd, &index_stat) == 0 && fstat(image_fd, &image_stat) == 0 && !S_ISBLK(image_stat.st_mode) && index_stat.st_size >= sizeof(struct index_header)) {
+		struct index_header* header = mmap(NULL, index_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (header != MAP_FAILED) {
+			struct extent* extents = (struct extent*) (header + 1);
+			good = memcmp(header->magic, INDEX_MAGIC, 8) == 0
+				&& header->image_size == image_stat.st_size
+				&& header->mtime_sec == image_stat.st_mtim.tv_sec
+				&& header->mtime_nsec == image_stat.st_mtim.tv_nsec
+				&& header->root_block == directory_structs[0]->block
+				&& header->extent_count == (index_stat.st_size - sizeof(struct index_header)) / sizeof(struct extent)
+				&& header->checksum == checksum_bytes(extents, sizeof(struct extent)*header->extent_count);
+			if (good) {
+				max_free_extents = header->extent_count > 64 ? header->extent_count : 64;
+				free_extents = malloc(sizeof(struct extent)*max_free_extents);
+				memcpy(free_extents, extents, sizeof(struct extent)*header->extent_count);
+				free_extent_count = header->extent_count;
+				free_hole_blocks = 0;
+				for (unsigned long long int i = 0; i < free_extent_count; i++) free_hole_blocks += free_extents[i].count;
+				free_space_pointer = header->free_space_pointer;
+				debug_printf("INDEX LOADED: %llu holes, %#llx blocks, end %#llx\n", free_extent_count, free_hole_blocks, free_space_pointer);
+			}
+			munmap(header, index_stat.st_size);
+		}
+	}
+	close(fd);
+	if (!good) debug_printf("INDEX %s IS STALE, SCANNING\n", path);
+	return good;
+}
+
+// called at unmount once the image won't change anymore. written next to the
+// old one and renamed over it so a crash never leaves half an index
+void save_index(const char* path) {
+	struct stat image_stat;
+	if (fstat(image_fd, &image_stat) != 0) return;
+	struct index_header header = {0};
+	memcpy(header.magic, INDEX_MAGIC, 8);
+	header.image_size = image_stat.st_size;
+	header.mtime_sec = image_stat.st_mtim.tv_sec;
+	header.mtime_nsec = image_stat.st_mtim.tv_nsec;
+	header.root_block = directory_structs[0]->block;
+	header.free_space_pointer = free_space_pointer;
+	header.extent_count = free_extent_count;
+	header.checksum = checksum_bytes(free_extents, sizeof(struct extent)*free_extent_count);
+
+	char* temp_path = malloc(strlen(path) + 5);
+	sprintf(temp_path, "%s.tmp", path);
+	int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror(temp_path);
+		free(temp_path);
+		return;
+	}
+	bool good = write(fd, &header, sizeof(header)) == sizeof(header);
+	size_t extents_size = sizeof(struct extent)*free_extent_count;
+	if (good && extents_size > 0) good = write(fd, free_extents, extents_size) == extents_size;
+	if (close(fd) != 0) good = false;
+	if (good && rename(temp_path, path) == 0) debug_printf("INDEX SAVED: %llu holes\n", free_extent_count);
+	else unlink(temp_path);
+	free(temp_path);
+}
+
+void scan_free_space() {
+	struct redsea_directory* root = directory_structs[0];
+	note_used_extent(root->block, root->size/BLOCK_SIZE);
+	scan_directory_extents(root->block, root->size, 0);
+	build_free_extents(root->block);
+}
+
+void ensure_free_map() {
+	pthread_once(&free_map_once, scan_free_space);
+}
+
+void free_map_loaded() {
+	// nothing to do, the index already filled it in
+}
+
+void* free_map_thread(void* arg) {
+	ensure_free_map();
+	return NULL;
+}
+
+// best fit out of the holes, otherwise off the end
+unsigned long long int allocate_blocks(unsigned long long int count) {
+	ensure_free_map();
+	pthread_mutex_lock(&allocator_lock);
+	unsigned long long int best = -1;
+	for (unsigned long long int i = 0; i < free_extent_count; i++) {
+		if (free_extents[i].count >= count && (best == -1 || free_extents[i].count < free_extents[best].count)) {
+			best = i;
+			if (free_extents[i].count == count) break;
+		}
+	}
+	unsigned long long int block;
+	if (best == -1) {
+		block = free_space_pointer;
+		free_space_pointer += count;
+	}
+	else {
+		block = free_extents[best].block;
+		free_extents[best].block += count;
+		free_extents[best].count -= count;
+		if (free_extents[best].count == 0) free_extent_remove(best);
+		free_hole_blocks -= count;
+	}
+	pthread_mutex_unlock(&allocator_lock);
+	return block;
+}
+
+/* Take exactly [block, block+count) if it's all free.
+ * used to grow something in place instead of moving it
+ */
+bool claim_blocks(unsigned long long int block, unsigned long long int count) {
+	bool claimed = false;
+	ensure_free_map();
+	pthread_mutex_lock(&allocator_lock);
+	if (block >= free_space_pointer) {
+		if (block > free_space_pointer) {
+			free_extent_insert(free_extent_count, free_space_pointer, block - free_space_pointer);
+			free_hole_blocks += block - free_space_pointer;
+		}
+		free_space_pointer = block + count;
+		claimed = true;
+	}
+	else {
+		unsigned long long int pos = free_extent_search(block);
+		if (pos > 0) {
+			struct extent* hole = &free_extents[pos-1];
+			unsigned long long int hole_end = hole->block + hole->count;
+			if (block + count <= hole_end) {
+				unsigned long long int hole_start = hole->block;
+				free_extent_remove(pos-1);
+				if (block + count < hole_end) free_extent_insert(pos-1, block + count, hole_end - block - count);
+				if (hole_start < block) free_extent_insert(pos-1, hole_start, block - hole_start);
+				free_hole_blocks -= count;
+				claimed = true;
+			}
+			else if (hole_end == free_space_pointer && block + count > free_space_pointer) {
+				// runs from the last hole into the free space at the end
+				free_hole_blocks -= hole_end - block;
+				if (hole->block < block) hole->count = block - hole->block;
+				else free_extent_remove(pos-1);
+				free_space_pointer = block + count;
+				claimed = true;
+			}
+		}
+	}
+	pthread_mutex_unlock(&allocator_lock);
+	return claimed;
+}
+
+// straight back into the free map, release_blocks is what everything else uses
+void return_blocks(unsigned long long int block, unsigned long long int count) {
+	pthread_mutex_lock(&allocator_lock);
+	unsigned long long int pos = free_extent_search(block);
+	free_extent_insert(pos, block, count);
+	free_hole_blocks += count;
+	// merge with the neighbours
+	if (pos + 1 < free_extent_count && free_extents[pos].block + free_extents[pos].count == free_extents[pos+1].block) {
+		free_extents[pos].count += free_extents[pos+1].count;
+		free_extent_remove(pos+1);
+	}
+	if (pos > 0 && free_extents[pos-1].block + free_extents[pos-1].count == free_extents[pos].block) {
+		free_extents[pos-1].count += free_extents[pos].count;
+		free_extent_remove(pos);
+		pos--;
+	}
+	// a hole running up to free_space_pointer just becomes part of the end
+	if (pos == free_extent_count-1 && free_extents[pos].block + free_extents[pos].count == free_space_pointer) {
+		free_space_pointer = free_extents[pos].block;
+		free_hole_blocks -= free_extents[pos].count;
+		free_extent_remove(pos);
+	}
+	pthread_mutex_unlock(&allocator_lock);
+}
+
+// with the journal on the blocks only come back once the update that freed them is committed, see Journal
+bool journal_defer_release(unsigned long long int block, unsigned long long int count);
+
+void release_blocks(unsigned long long int block, unsigned long long int count) {
+	if (count == 0 || block == 0xFFFFFFFFFFFFFFFF) return;
+	ensure_free_map();
+	if (journal_defer_release(block, count)) return;
+	return_blocks(block, count);
+}
+
+/* Journal
+ * with -o journal=FILE every metadata update (directory entries, whole
+ * directories when they move, the root pointers, the ISO sizes) is logged
+ * in FILE before it goes anywhere near the image, so a crash halfway
+ * through something like a directory move can't leave it half rewritten.
+ * Updates that take several writes are wrapped in journal_begin/journal_end
+ * and get logged together, a write outside one is a transaction by itself.
+ *
+ * Until it's committed a write only exists in journal_overlay, which
+ * image_read lays over what's on the image. The commit thread takes every
+ * transaction that's finished since it last went, syncs the image (file
+ * data that moved has to be down before the entries pointing at it are),
+ * writes them to the start of FILE as one batch, syncs that and only then
+ * writes them in place. However many operations pile up while it's syncing
+ * share the next two syncs, and nothing waits for them unless it has to
+ * (fsync, compaction, unmount). FILE only ever holds the last batch, the
+ * one before is on the image by the time it's overwritten, and mount
+ * replays whatever's there.
+ *
+ * If a batch can't be logged nothing goes in place from then on, not that
+ * batch and not any after it since they can build on it. The records stay
+ * in the overlay so the mount still reads what it wrote, held blocks stay
+ * held and fsync returns EIO. The image is left as of the last good commit.
+ *
+ * Blocks a transaction frees stay out of the free map until it's
+ * committed, or file data could land on them while the entry on disk
+ * still points there. Ones the batch itself wrote to wait one more commit
+ * so replaying it can't clobber whatever goes there next.
+ */
+#define JOURNAL_MAGIC "RSJRNL01"
+#define JOURNAL_MAX_PENDING (16ULL << 20)	// logged but not committed, past this journal_end waits
+struct journal_header {
+	char magic[8];
+	unsigned long long int sequence;
+	unsigned long long int length;		// of the records after it
+	unsigned long long int checksum;	// FNV-1a over them
+	// records follow: offset, size, then size bytes
+};
+struct journal_record {
+	unsigned long long int offset;
+	unsigned long long int size;
+	struct journal_record* next;		// in its transaction
+	bool committed;
+	unsigned char data[];
+};
+struct journal_transaction {
+	struct journal_record* records;
+	struct journal_record* last_record;
+	unsigned long long int bytes;
+	struct extent* frees;
+	unsigned long long int free_count;
+	unsigned long long int max_frees;
+	unsigned int depth;			// journal_begin nesting
+	struct journal_transaction* next;	// in journal_queue
+};
+__thread struct journal_transaction* journal_transaction = NULL;	// the one this thread has open
+
+struct journal_record** journal_overlay = NULL;		// not in place yet, oldest first
+unsigned long long int journal_overlay_count = 0;
+unsigned long long int journal_overlay_capacity = 0;
+
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;		// something for the commit thread
+pthread_cond_t journal_done_cond = PTHREAD_COND_INITIALIZER;	// a commit finished
+struct journal_transaction* journal_queue = NULL;		// finished, waiting to be committed
+struct journal_transaction* journal_queue_tail = NULL;
+unsigned long long int journal_pending_bytes = 0;
+unsigned long long int journal_queued = 0;			// transactions ever queued
+unsigned long long int journal_committed = 0;			// how many of those are committed
+unsigned long long int journal_commits = 0;
+unsigned long long int journal_sequence = 0;
+unsigned long long int journal_sync_waiters = 0;
+bool journal_holding = false;				// the last commit held some frees back
+bool journal_failed = false;				// a batch didn't make it to the log, see journal_commit
+struct extent* journal_held = NULL;			// those, only the committing thread touches them
+unsigned long long int journal_held_count = 0;
+unsigned long long int max_journal_held = 0;
+unsigned long long int journal_releasing = 0;			// blocks freed but not given back yet, for statfs
+bool journal_stop = false;
+bool journal_started = false;
+pthread_t journal_thread;
+
+// lay what's waiting in the overlay over buffer, caller holds journal_overlay_lock
+void journal_patch(unsigned char* buffer, unsigned long long int size, unsigned long long int offset) {
+	for (unsigned long long int i = 0; i < journal_overlay_count; i++) {
+		struct journal_record* record = journal_overlay[i];
+		if (record->offset >= offset + size || record->offset + record->size <= offset) continue;
+		unsigned long long int from = record->offset > offset ? record->offset : offset;
+		unsigned long long int to = record->offset + record->size < offset + size ? record->offset + record->size : offset + size;
+		memcpy(buffer + (from - offset), record->data + (from - record->offset), to - from);
+	}
+}
+
+void journal_begin() {
+	if (journal_fd == -1) return;
+	if (journal_transaction == NULL) journal_transaction = calloc(1, sizeof(struct journal_transaction));
+	journal_transaction->depth++;
+}
+
+bool extents_overlap(unsigned long long int a, unsigned long long int a_size, unsigned long long int b, unsigned long long int b_size) {
+	return a < b + b_size && b < a + a_size;
+}
+
+// write a wave and wait for all of it
+void journal_apply_wave(struct image_io* wave, unsigned int count, struct io_group* group) {
+	for (unsigned int i = 0; i < count; i++) cache_drop_range(wave[i].offset, wave[i].size);
+	image_io_start(wave, count);
+	struct image_io* io;
+	while ((io = image_io_wait(group)) != NULL) {
+		if (io->error != 0) fprintf(stderr, "journal apply at %#llx: %s\n", io->offset, strerror(io->error));
+	}
+	for (unsigned int i = 0; i < count; i++) cache_drop_range(wave[i].offset, wave[i].size);
+}
+
+// sync the image then write batch to the log and sync that. false if either didn't happen
+bool journal_log(struct journal_transaction* batch) {
+	bool failed = image_sync(true) != 0;
+	unsigned long long int length = 0;
+	for (struct journal_transaction* transaction = batch; transaction != NULL; transaction = transaction->next) {
+		for (struct journal_record* record = transaction->records; record != NULL; record = record->next) length += 16 + record->size;
+	}
+	unsigned char* buffer = malloc(sizeof(struct journal_header) + length);
+	struct journal_header* header = (struct journal_header*) buffer;
+	memcpy(header->magic, JOURNAL_MAGIC, 8);
+	header->sequence = ++journal_sequence;
+	header->length = length;
+	unsigned char* pos = buffer + sizeof(struct journal_header);
+	for (struct journal_transaction* transaction = batch; transaction != NULL; transaction = transaction->next) {
+		for (struct journal_record* record = transaction->records; record != NULL; record = record->next) {
+			memcpy(pos, &record->offset, 8);
+			memcpy(pos+8, &record->size, 8);
+			memcpy(pos+16, record->data, record->size);
+			pos += 16 + record->size;
+		}
+	}
+	header->checksum = checksum_bytes(buffer + sizeof(struct journal_header), length);
+	if (!image_pwrite(journal_fd, buffer, sizeof(struct journal_header) + length, 0) || fdatasync(journal_fd) != 0) failed = true;
+	free(buffer);
+	if (failed) fprintf(stderr, "journal commit %llu failed, nothing more goes in place until it's remounted\n", journal_sequence);
+	return !failed;
+}
+
+/* Write one batch to the log and then in place. Returns false if it didn't
+ * make it to the log, or one before it didn't, and then it's left where it
+ * is: not in the log either, a later batch replayed without the one that
+ * failed could be just as torn. Only ever runs on one thread at a time.
+ */
+bool journal_commit(struct journal_transaction* batch) {
+	unsigned long long int start = stats_clock();
+	if (journal_failed || !journal_log(batch)) {
+		// the records stay in the overlay and the frees out of the free map, only the transactions go
+		while (batch != NULL) {
+			struct journal_transaction* transaction = batch;
+			batch = transaction->next;
+			free(transaction->frees);
+			free(transaction);
+		}
+		stats_record(STATS_COMMIT, start, true);
+		return false;
+	}
+
+	// it's safe in the log, now it can go in place. a wave of writes goes out together, one that
+	// overlaps something already in the wave waits for the next so the later write still wins
+	pthread_rwlock_wrlock(&journal_overlay_lock);
+	struct image_io wave[IO_RING_ENTRIES];
+	unsigned int wave_count = 0;
+	unsigned long long int end = 0;
+	struct io_group group;
+	io_group_init(&group);
+	for (struct journal_transaction* transaction = batch; transaction != NULL; transaction = transaction->next) {
+		for (struct journal_record* record = transaction->records; record != NULL; record = record->next) {
+			bool overlaps = wave_count == IO_RING_ENTRIES;
+			for (unsigned int i = 0; i < wave_count && !overlaps; i++) {
+				overlaps = extents_overlap(wave[i].offset, wave[i].size, record->offset, record->size);
+			}
+			if (overlaps) {
+				journal_apply_wave(wave, wave_count, &group);
+				wave_count = 0;
+			}
+			image_io_prepare(&wave[wave_count++], &group, image_fd, true, record->data, record->size, record->offset);
+			if (record->offset + record->size > end) end = record->offset + record->size;
+			record->committed = true;
+		}
+	}
+	journal_apply_wave(wave, wave_count, &group);
+	io_group_destroy(&group);
+	if (end > image_size()) image_remap();
+	unsigned long long int kept = 0;
+	for (unsigned long long int i = 0; i < journal_overlay_count; i++) {
+		if (!journal_overlay[i]->committed) journal_overlay[kept++] = journal_overlay[i];
+	}
+	journal_overlay_count = kept;
+	pthread_rwlock_unlock(&journal_overlay_lock);
+
+	// the previous batch isn't in the log anymore
+	for (unsigned long long int i = 0; i < journal_held_count; i++) {
+		return_blocks(journal_held[i].block, journal_held[i].count);
+		__atomic_sub_fetch(&journal_releasing, journal_held[i].count, __ATOMIC_RELAXED);
+	}
+	journal_held_count = 0;
+	for (struct journal_transaction* transaction = batch; transaction != NULL; transaction = transaction->next) {
+		for (unsigned long long int i = 0; i < transaction->free_count; i++) {
+			struct extent* freed = &transaction->frees[i];
+			bool written = false;
+			for (struct journal_transaction* other = batch; other != NULL && !written; other = other->next) {
+				for (struct journal_record* record = other->records; record != NULL && !written; record = record->next) {
+					written = extents_overlap(freed->block*BLOCK_SIZE, freed->count*BLOCK_SIZE, record->offset, record->size);
+				}
+			}
+			if (!written) {
+				return_blocks(freed->block, freed->count);
+				__atomic_sub_fetch(&journal_releasing, freed->count, __ATOMIC_RELAXED);
+				continue;
+			}
+			if (journal_held_count == max_journal_held) {
+				max_journal_held = max_journal_held ? max_journal_held*2 : 16;
+				journal_held = realloc(journal_held, sizeof(struct extent)*max_journal_held);
+			}
+			journal_held[journal_held_count++] = *freed;
+		}
+	}
+	unsigned long long int transactions = 0;
+	while (batch != NULL) {
+		struct journal_transaction* transaction = batch;
+		batch = transaction->next;
+		while (transaction->records != NULL) {
+			struct journal_record* record = transaction->records;
+			transaction->records = record->next;
+			free(record);
+		}
+		free(transaction->frees);
+		free(transaction);
+		transactions++;
+	}
+	stats_add(&stats_journal_transactions, transactions);
+	stats_record(STATS_COMMIT, start, false);
+	return true;
+}
+
+// commit everything queued. journal_lock held, it's let go while the batch is written
+void journal_commit_queue() {
+	struct journal_transaction* batch = journal_queue;
+	unsigned long long int queued = journal_queued;
+	unsigned long long int bytes = 0;
+	for (struct journal_transaction* transaction = batch; transaction != NULL; transaction = transaction->next) bytes += transaction->bytes;
+	journal_queue = journal_queue_tail = NULL;
+	pthread_mutex_unlock(&journal_lock);
+	bool committed = journal_commit(batch);
+	pthread_mutex_lock(&journal_lock);
+	journal_committed = queued;
+	journal_commits++;
+	stats_add(&stats_journal_commits, 1);
+	if (!committed) journal_failed = true;
+	journal_holding = committed && journal_held_count > 0;	// after a failure they're held for good
+	journal_pending_bytes -= bytes;
+	pthread_cond_broadcast(&journal_done_cond);
+}
+
+void journal_end() {
+	if (journal_fd == -1) return;
+	struct journal_transaction* transaction = journal_transaction;
+	if (--transaction->depth > 0) return;
+	journal_transaction = NULL;
+	if (transaction->records == NULL && transaction->free_count == 0) {
+		free(transaction);
+		return;
+	}
+	pthread_mutex_lock(&journal_lock);
+	if (journal_queue_tail != NULL) journal_queue_tail->next = transaction;
+	else journal_queue = transaction;
+	journal_queue_tail = transaction;
+	journal_queued++;
+	journal_pending_bytes += transaction->bytes;
+	if (!journal_started) journal_commit_queue();		// mounting or unmounting, there's no thread
+	else pthread_cond_signal(&journal_cond);
+	while (journal_started && journal_pending_bytes > JOURNAL_MAX_PENDING) pthread_cond_wait(&journal_done_cond, &journal_lock);
+	pthread_mutex_unlock(&journal_lock);
+}
+
+// wait until everything logged so far is committed and the blocks it freed are back. false if it can't be
+bool journal_sync() {
+	if (journal_fd == -1) return true;
+	pthread_mutex_lock(&journal_lock);
+	unsigned long long int target = journal_queued;
+	journal_sync_waiters++;
+	pthread_cond_signal(&journal_cond);
+	while (journal_committed < target) {
+		if (!journal_started) journal_commit_queue();
+		else pthread_cond_wait(&journal_done_cond, &journal_lock);
+	}
+	// frees held back by that commit come back with the next one, empty or not
+	unsigned long long int commits = journal_commits;
+	while (journal_holding && journal_commits == commits) {
+		if (!journal_started) journal_commit_queue();
+		else pthread_cond_wait(&journal_done_cond, &journal_lock);
+	}
+	journal_sync_waiters--;
+	bool synced = !journal_failed;
+	pthread_mutex_unlock(&journal_lock);
+	return synced;
+}
+
+void* journal_thread_main(void* arg) {
+	pthread_mutex_lock(&journal_lock);
+	while (true) {
+		if (journal_queue != NULL || (journal_sync_waiters > 0 && journal_holding)) {
+			journal_commit_queue();
+			continue;
+		}
+		if (journal_stop) break;
+		pthread_cond_wait(&journal_cond, &journal_lock);
+	}
+	pthread_mutex_unlock(&journal_lock);
+	return NULL;
+}
+
+// write that goes through the journal when there is one
+void metadata_write(const void* buffer, unsigned long long int size, unsigned long long int offset) {
+	if (journal_fd == -1) {
+		image_write(buffer, size, offset);
+		return;
+	}
+	journal_begin();
+	struct journal_record* record = malloc(sizeof(struct journal_record) + size);
+	record->offset = offset;
+	record->size = size;
+	record->next = NULL;
+	record->committed = false;
+	memcpy(record->data, buffer, size);
+	struct journal_transaction* transaction = journal_transaction;
+	if (transaction->last_record != NULL) transaction->last_record->next = record;
+	else transaction->records = record;
+	transaction->last_record = record;
+	transaction->bytes += size;
+	pthread_rwlock_wrlock(&journal_overlay_lock);
+	if (journal_overlay_count == journal_overlay_capacity) {
+		journal_overlay_capacity = journal_overlay_capacity ? journal_overlay_capacity*2 : 64;
+		journal_overlay = realloc(journal_overlay, sizeof(struct journal_record*)*journal_overlay_capacity);
+	}
+	journal_overlay[journal_overlay_count++] = record;
+	pthread_rwlock_unlock(&journal_overlay_lock);
+	journal_end();
+}
+
+void metadata_write_le64(unsigned long long int value, unsigned long long int offset) {
+	unsigned char buf[8];
+	put_le64(buf, value);
+	metadata_write(buf, 8, offset);
+}
+
+bool journal_defer_release(unsigned long long int block, unsigned long long int count) {
+	if (journal_fd == -1) return false;
+	journal_begin();
+	struct journal_transaction* transaction = journal_transaction;
+	if (transaction->free_count == transaction->max_frees) {
+		transaction->max_frees = transaction->max_frees ? transaction->max_frees*2 : 4;
+		transaction->frees = realloc(transaction->frees, sizeof(struct extent)*transaction->max_frees);
+	}
+	transaction->frees[transaction->free_count++] = (struct extent) {block, count};
+	__atomic_add_fetch(&journal_releasing, count, __ATOMIC_RELAXED);
+	journal_end();
+	return true;
+}
+
+// at mount before anything reads the image: put back whatever the last commit logged, then start fresh
+bool journal_open(const char* path) {
+	journal_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (journal_fd == -1) {
+		perror(path);
+		return false;
+	}
+	struct journal_header header;
+	struct stat st;
+	if (fstat(journal_fd, &st) == 0 && pread(journal_fd, &header, sizeof(header), 0) == sizeof(header)
+		&& memcmp(header.magic, JOURNAL_MAGIC, 8) == 0 && header.length <= st.st_size - sizeof(header)) {
+		unsigned char* records = malloc(header.length ? header.length : 1);
+		if (pread(journal_fd, records, header.length, sizeof(header)) == header.length && checksum_bytes(records, header.length) == header.checksum) {
+			unsigned long long int count = 0;
+			unsigned long long int pos = 0;
+			while (pos + 16 <= header.length) {
+				unsigned long long int offset, size;
+				memcpy(&offset, records + pos, 8);
+				memcpy(&size, records + pos + 8, 8);
+				if (size > header.length - pos - 16) break;
+				image_write(records + pos + 16, size, offset);
+				pos += 16 + size;
+				count++;
+			}
+			image_sync(false);
+			fprintf(stderr, "journal replayed: %llu writes from commit %llu\n", count, header.sequence);
+		}
+		free(records);
+	}
+	// everything in it is on the image
+	if (ftruncate(journal_fd, 0) != 0 || fsync(journal_fd) != 0) {
+		perror(path);
+		return false;
+	}
+	return true;
+}
+
+// at unmount once nothing else will be written
+void journal_close() {
+	if (journal_fd == -1) return;
+	journal_sync();
+	if (journal_started) {
+		pthread_mutex_lock(&journal_lock);
+		journal_stop = true;
+		pthread_cond_signal(&journal_cond);
+		pthread_mutex_unlock(&journal_lock);
+		pthread_join(journal_thread, NULL);
+		journal_started = false;
+	}
+	image_sync(false);
+	if (ftruncate(journal_fd, 0) != 0) perror("journal");
+	fsync(journal_fd);
+	close(journal_fd);
+	journal_fd = -1;
+}
+
+// entry slot of a directory that can be reused. caller holds table_lock for writing
+void add_free_slot(struct redsea_directory* directory, unsigned long long int slot) {
+	if (directory->free_slot_count == directory->max_free_slots) {
+		directory->max_free_slots = directory->max_free_slots ? directory->max_free_slots*2 : 8;
+		directory->free_slots = realloc(directory->free_slots, sizeof(unsigned long long int)*directory->max_free_slots);
+	}
+	directory->free_slots[directory->free_slot_count++] = slot;
+}
+
+/*
+ * Reads the files and child directories of a given redsea directory.
+ * Directories are loaded the first time something looks inside them (see
+ * loaded_directory), subdirectories just get registered here and are read when
+ * they're needed. Caller holds table_lock for writing.
+ */
+void load_directory(struct redsea_directory* directory) {
+	
+	unsigned long long int size = directory->size;
+
+	uint16_t filetype = 0;		// 0x0810 for directories, 0x0820 for files, 0x0c20 for compressed files
+	unsigned char name[MAX_NAME+1];
+	unsigned long long int file_block;
+	unsigned long long int file_size;
+	unsigned long long int timestamp;
+	directory->loaded = true;
+	directory->free_slot_count = 0;
+	directory->next_slot = size/64;
+	// the whole directory is one contiguous run of blocks, entries are decoded straight out of it
+	unsigned char* entries = image_view(directory->block*BLOCK_SIZE, size);
+	if (entries == NULL) {
+		fprintf(stderr, "directory %s is past the end of the image\n", directory->name);
+		return;
+	}
+	for (int i = 0; i < size/64; i++ ) {
+		unsigned char* entry = entries + i*64;
+		memcpy(&filetype, entry, 2);
+		if (filetype == 0) {
+			directory->next_slot = i;
+			break;				// end of directory
+		}
+		// handle deleted files
+		// this implementation is INCORRECT and will not work with all potential filetypes. I need to fix that
+		// these are attribute flags!
+		if (filetype == 0x0910 || filetype == 0x0920 || filetype == 0x0d20 || filetype == 0x0d00 || filetype == 0x0900) {
+			add_free_slot(directory, i);
+			continue;
+		}
+		unsigned long long int name_length = strnlen(entry+2, MAX_NAME);	// find end of file name
+		memcpy(name, entry+2, name_length);
+		name[name_length] = '\0';		// terminate file name
+		memcpy(&file_block, entry+40, 8);
+		memcpy(&file_size, entry+48, 8);
+		memcpy(&timestamp, entry+56, 8);
+		if (filetype == 0x0810) {
+			// the first two are the directory itself and .., not by name since
+			// an entry renamed by an older version still has its old name in there
+			if (i >= 2 && file_block != directory->block) {
+				struct redsea_directory* directory_entry = arena_alloc(sizeof(struct redsea_directory));
+				strcpy(directory_entry->name, name);
+				directory_entry -> seek_to = i*64;
+				directory_entry -> size = file_size;
+				directory_entry -> block = file_block;
+				directory_entry -> mod_date = timestamp;
+				directory_entry -> parent = directory;
+				directory_entry -> next_slot = 2;
+				pthread_rwlock_init(&directory_entry->lock, NULL);
+				add_directory_position(directory_entry);
+				child_insert(directory, NULL, directory_entry);
+			}
+		}
+		else {
+			// arena memory comes zeroed, only what isn't 0/NULL/false needs setting
+			struct redsea_file* file_entry = arena_alloc(sizeof(struct redsea_file));
+			strcpy(file_entry->name, name);
+			file_entry -> seek_to = i*64;
+			file_entry -> size = file_size;
+			file_entry -> block = file_block;
+			file_entry -> mod_date = timestamp;
+			file_entry -> parent = directory;
+			file_entry -> attributes = filetype;
+			add_file_position(file_entry);
+			child_insert(directory, file_entry, NULL);
+		}
+	}
+	image_view_done(entries);
+}
+
+/* Make sure every directory along path has been loaded, and path itself
+ * too if it's a directory and self is set. Caller holds table_lock for
+ * writing. Directories are never unloaded so once this has run for a path
+ * it stays true.
+ */
+void load_path_locked(const char* path, bool self) {
+	struct redsea_directory* directory = directory_structs[0];
+	char name[40];
+	for (;;) {
+		if (!directory->loaded) load_directory(directory);
+		while (*path == '/') path++;
+		const char* end = strchr(path, '/');
+		if (end == NULL) end = path + strlen(path);
+		// the last name only gets loaded if it's wanted
+		if (*path == '\0' || (!self && *end == '\0') || end - path >= sizeof(name)) return;
+		memcpy(name, path, end - path);
+		name[end - path] = '\0';
+		directory = child_directory(child_lookup(directory, name));
+		if (directory == NULL) return;
+		path = end;
+	}
+}
+
+/* Gets the contents of a given file
+ * returns a pointer into the image mapping, size gets clamped to what's
+ * actually left in the file.
+ */
+
+unsigned char* redsea_file_content(struct redsea_file* rs_file, size_t* size, off_t offset) {
+	if (offset >= rs_file->size) {
+		*size = 0;
+		return NULL;
+	}
+	if (offset + *size > rs_file->size) *size = rs_file->size - offset;
+	if (rs_file->delayed != NULL) return rs_file->delayed + offset;
+	unsigned char* content = image_bytes(rs_file->block*BLOCK_SIZE + offset, *size);
+	if (content == NULL) *size = 0;
+	return content;
+}
+
+/* Read-ahead
+ * a file is one contiguous range of the image, so someone reading a file
+ * front to back is reading the image front to back. Every open file keeps
+ * where its last read ended, a read that starts there is sequential and
+ * grows the window (READAHEAD_MIN doubling up to READAHEAD_MAX), anything
+ * else drops it back to nothing. Buffered, the window past each read is
+ * handed to readahead() once the reader is halfway through the last one,
+ * so the pages are in the page cache before the mapping or a splice gets
+ * to them. With -o direct there's no page cache, so the open file gets its
+ * own buffer instead: a sequential read it can't answer reads a whole
+ * window in one go and the reads after come out of memory. Anything that
+ * changes file data bumps file_data_version, which throws every buffer
+ * away, files are read a lot more than they're written.
+ */
+#define READAHEAD_MIN (128ULL << 10)
+#define READAHEAD_MAX (4ULL << 20)
+
+struct open_file {
+	pthread_mutex_t lock;			// the kernel can send several reads for one handle at once
+	unsigned long long int next_offset;	// where the last read ended
+	unsigned long long int window;		// 0 until it looks sequential
+	unsigned long long int prefetched;	// readahead() has been asked for up to here
+	unsigned char* buffer;			// -o direct: buffer_length bytes of the image from buffer_start
+	unsigned long long int buffer_capacity;
+	unsigned long long int buffer_start;
+	unsigned long long int buffer_length;
+	unsigned long long int buffer_block;	// where the file was when it was read
+	unsigned long long int buffer_version;	// and file_data_version
+};
+unsigned long long int file_data_version = 0;
+unsigned long long int stats_readahead_hits = 0;	// direct reads answered from the buffer
+unsigned long long int stats_readahead_fills = 0;	// windows read ahead, either way
+unsigned long long int stats_readahead_bytes = 0;
+
+// with parent->lock write locked, before changing what's in a file
+void file_data_changed() {
+	__atomic_add_fetch(&file_data_version, 1, __ATOMIC_RELEASE);
+}
+
+struct open_file* open_file_new() {
+	struct open_file* open = calloc(1, sizeof(struct open_file));
+	pthread_mutex_init(&open->lock, NULL);
+	return open;
+}
+
+void open_file_free(struct open_file* open) {
+	if (open == NULL) return;
+	pthread_mutex_destroy(&open->lock);
+	free(open->buffer);
+	free(open);
+}
+
+// a read of size at offset is about to happen, true if it's sequential. open->lock held
+bool readahead_note(struct open_file* open, unsigned long long int offset, unsigned long long int size) {
+	bool sequential = offset == open->next_offset;
+	if (!sequential) {
+		open->window = 0;
+		open->prefetched = 0;
+	}
+	else if (open->window == 0) open->window = READAHEAD_MIN;
+	open->next_offset = offset + size;
+	return sequential;
+}
+
+void readahead_grow(struct open_file* open) {
+	open->window = open->window*2 < READAHEAD_MAX ? open->window*2 : READAHEAD_MAX;
+	stats_add(&stats_readahead_fills, 1);
+}
+
+// buffered: ask the kernel for the window past [offset, offset+size) of file. parent->lock read locked
+void readahead_buffered(struct open_file* open, struct redsea_file* file, unsigned long long int offset, unsigned long long int size) {
+	if (open == NULL) return;
+	pthread_mutex_lock(&open->lock);
+	if (readahead_note(open, offset, size) && offset + size + open->window/2 > open->prefetched) {
+		unsigned long long int from = offset + size > open->prefetched ? offset + size : open->prefetched;
+		unsigned long long int to = offset + size + open->window;
+		if (to > file->size) to = file->size;
+		if (to > from) {
+			readahead(image_fd, file->block*BLOCK_SIZE + from, to - from);
+			stats_add(&stats_readahead_bytes, to - from);
+		}
+		open->prefetched = offset + size + open->window;
+		readahead_grow(open);
+	}
+	pthread_mutex_unlock(&open->lock);
+}
+
+/* -o direct: size bytes of file at offset into out, already clamped to the
+ * file. From the buffer if it has them, a sequential read it doesn't have
+ * reads the window straight into it, sector aligned so it's one O_DIRECT
+ * read with no bounce. It's only good while the file hasn't moved or been
+ * written. parent->lock read locked
+ */
+void readahead_direct(struct open_file* open, struct redsea_file* file, unsigned char* out, unsigned long long int size, unsigned long long int offset) {
+	if (size == 0 || offset >= file->size) return;	// at or past the end, the window would wrap
+	unsigned long long int position = file->block*BLOCK_SIZE + offset;
+	if (open == NULL) {
+		image_read_direct(out, size, position);
+		return;
+	}
+	pthread_mutex_lock(&open->lock);
+	bool sequential = readahead_note(open, offset, size);
+	unsigned long long int version = __atomic_load_n(&file_data_version, __ATOMIC_ACQUIRE);
+	bool buffered = open->buffer != NULL && open->buffer_version == version && open->buffer_block == file->block
+		&& position >= open->buffer_start && position + size <= open->buffer_start + open->buffer_length;
+	if (!buffered && sequential) {
+		unsigned long long int length = size + open->window;
+		if (length > file->size - offset) length = file->size - offset;
+		unsigned long long int start = position & ~(direct_align-1);
+		unsigned long long int end = (position + length + direct_align-1) & ~(direct_align-1);
+		if (end - start > open->buffer_capacity) {
+			free(open->buffer);
+			if (posix_memalign((void**) &open->buffer, direct_align, end - start) != 0) exit(1);
+			open->buffer_capacity = end - start;
+		}
+		cache_flush_range(start, end - start);
+		ssize_t got;
+		while ((got = pread(direct_fd, open->buffer, end - start, start)) < 0 && errno == EINTR);
+		if (got >= (ssize_t) (position + size - start)) {
+			open->buffer_start = start;
+			open->buffer_length = got;
+			open->buffer_block = file->block;
+			open->buffer_version = version;
+			stats_add(&stats_readahead_bytes, got);
+			readahead_grow(open);
+			buffered = true;
+		}
+		else open->buffer_version = version - 1;	// short, the plain read sorts it out
+	}
+	else if (buffered) stats_add(&stats_readahead_hits, 1);
+	if (buffered) memcpy(out, open->buffer + (position - open->buffer_start), size);
+	else image_read_direct(out, size, position);
+	pthread_mutex_unlock(&open->lock);
+}
+
+/* Compressed files
+ * TempleOS keeps .Z files (attribute 0x400) LZW compressed, they start
+ * with a CArcCompress header:
+ *  0  compressed size, header included
+ *  8  expanded size
+ *  16 compression type, CT_NONE stored as is, CT_7_BIT/CT_8_BIT LZW
+ *  17 the codes, packed lsb first
+ * With -o decompress these show up expanded. LZW can't be started in the
+ * middle so the decoder saves its whole state every EXPAND_CHECKPOINT bytes
+ * of output the first time it gets there, and a read further in starts
+ * from the closest checkpoint instead of from byte 0. Expanded pages go in
+ * an LRU bounded by -o zcache. The decoder is ArcExpandBuf from
+ * Compress.HC step for step, quirks and all, anything else won't line up
+ * with the codes TempleOS wrote.
+ * Writing them goes through Compression on close further down.
+ */
+#define ARC_HEADER_SIZE 17
+#define CT_NONE 1
+#define CT_7_BIT 2
+#define CT_8_BIT 3
+#define LZW_MAX_BITS 12
+#define LZW_TABLE_SIZE (1 << LZW_MAX_BITS)
+#define LZW_NONE 0xFFFF
+#define EXPAND_PAGE 65536
+#define EXPAND_CHECKPOINT (8*EXPAND_PAGE)	// a checkpoint is ~32k so they take about 6% of the expanded size
+
+// everything ArcExpandBuf keeps in CArcCtrl, with indexes instead of pointers so it can be copied
+struct lzw_state {
+	unsigned long long int src_pos;		// in bits from the start of the header, like TempleOS counts it
+	unsigned long long int dst_pos;		// bytes expanded so far
+	unsigned int min_bits;
+	unsigned int min_table_entry;		// first code that's a table entry instead of a character
+	unsigned int cur_bits;			// width of the code being written, only compressing uses it
+	unsigned int next_bits;			// width of the next code
+	unsigned int free_idx;
+	unsigned int free_limit;
+	unsigned int cur_entry;			// entry the next code fills in
+	unsigned int next_entry;
+	long long int saved_basecode;		// -1 before the first code
+	unsigned int last_ch;
+	bool entry_used;
+	unsigned int stack_length;		// characters decoded but not handed out yet, last first
+	uint16_t basecode[LZW_TABLE_SIZE];
+	uint16_t chain[LZW_TABLE_SIZE];		// next entry with the same basecode, 0 ends it
+	uint16_t hash[LZW_TABLE_SIZE];		// first entry built on each code, 0 if none
+	unsigned char ch[LZW_TABLE_SIZE];
+	unsigned char stack[LZW_TABLE_SIZE];
+};
+
+struct expanded_page {
+	struct expanded_file* owner;
+	unsigned long long int index;
+	unsigned long long int length;
+	struct expanded_page* newer;
+	struct expanded_page* older;
+	unsigned char data[];
+};
+
+struct expanded_file {
+	pthread_mutex_t lock;			// cursor and checkpoints
+	int type;
+	unsigned long long int size;		// expanded size
+	struct lzw_state cursor;		// wherever the last decode stopped
+	struct lzw_state** checkpoints;		// checkpoints[k] is the state k*EXPAND_CHECKPOINT bytes in
+	unsigned long long int checkpoint_count;
+	struct expanded_page** pages;		// cached pages by index, guarded by expand_cache_lock
+};
+
+pthread_mutex_t expand_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+struct expanded_page* expand_newest = NULL;
+struct expanded_page* expand_oldest = NULL;
+unsigned long long int expand_cached_bytes = 0;
+
+/* Expanded size of file if it gets shown expanded, -1 if it's shown as it
+ * is. A file that's still being copied in (sizes don't match yet) or isn't
+ * really compressed stays raw. Caller holds file->parent->lock.
+ */
+unsigned long long int expanded_file_size(struct redsea_file* file, int* type) {
+	if (!options.decompress || !(file->attributes & 0x400) || file->size < ARC_HEADER_SIZE) return -1;
+	size_t length = ARC_HEADER_SIZE;
+	unsigned char* header = redsea_file_content(file, &length, 0);
+	if (length < ARC_HEADER_SIZE) return -1;
+	unsigned long long int compressed_size, expanded_size;
+	memcpy(&compressed_size, header, 8);
+	memcpy(&expanded_size, header+8, 8);
+	if (compressed_size != file->size || header[16] < CT_NONE || header[16] > CT_8_BIT) return -1;
+	if (header[16] == CT_NONE && expanded_size > compressed_size - ARC_HEADER_SIZE) return -1;
+	if (type != NULL) *type = header[16];
+	return expanded_size;
+}
+
+// BFieldExtU32, reads past the end come back as zero bits
+unsigned int lzw_code(const unsigned char* src, unsigned long long int src_size, unsigned long long int pos, unsigned int bits) {
+	unsigned long long int byte = pos >> 3;
+	uint32_t word = 0;
+	for (int i = 0; i < 3 && byte+i < src_size; i++) word |= (uint32_t)src[byte+i] << (8*i);
+	return (word >> (pos & 7)) & ((1 << bits) - 1);
+}
+
+// ArcGetTableEntry, false if the table's in a state TempleOS could never have written
+bool lzw_next_entry(struct lzw_state* state) {
+	if (!state->entry_used) return true;
+	unsigned int i = state->free_idx;
+	state->entry_used = false;
+	state->cur_entry = state->next_entry;
+	state->cur_bits = state->next_bits;
+	if (state->next_bits < LZW_MAX_BITS) {
+		state->next_entry = i++;
+		if (i == state->free_limit) {
+			state->next_bits++;
+			state->free_limit = 1 << state->next_bits;
+		}
+	}
+	else {
+		// table's full, reuse the next entry nothing is built on
+		unsigned int tries = 0;
+		do {
+			if (++i == state->free_limit) i = state->min_table_entry;
+			if (++tries > LZW_TABLE_SIZE) return false;
+		} while (state->hash[i] != 0);
+		state->next_entry = i;
+		uint16_t* link = &state->hash[state->basecode[i]];
+		while (*link != 0 && *link != i) link = &state->chain[*link];
+		if (*link == i) *link = state->chain[i];
+	}
+	state->free_idx = i;
+	return true;
+}
+
+// ArcCtrlNew
+void lzw_init(struct lzw_state* state, int type) {
+	memset(state, 0, sizeof(struct lzw_state));
+	state->src_pos = ARC_HEADER_SIZE*8;
+	state->min_bits = type == CT_7_BIT ? 7 : 8;
+	state->min_table_entry = 1 << state->min_bits;
+	state->free_idx = state->min_table_entry;
+	state->next_bits = state->min_bits+1;
+	state->free_limit = 1 << state->next_bits;
+	state->saved_basecode = -1;
+	state->cur_entry = state->next_entry = LZW_NONE;
+	state->entry_used = true;
+	lzw_next_entry(state);
+	state->entry_used = true;
+}
+
+/* ArcExpandBuf, expands up to length bytes into out (or throws them away if
+ * out is NULL) and returns how many it made. Fewer than length means the
+ * codes ran out or stopped making sense, the state's left so every later
+ * call returns 0 too.
+ */
+unsigned long long int lzw_expand(struct lzw_state* state, const unsigned char* src, unsigned long long int src_size, unsigned char* out, unsigned long long int length) {
+	unsigned long long int done = 0;
+	unsigned long long int src_bits = src_size*8;
+	while (done < length && state->stack_length > 0) {
+		unsigned char c = state->stack[--state->stack_length];
+		if (out != NULL) out[done] = c;
+		done++;
+	}
+	if (done < length) {
+		long long int lastcode;
+		if (state->saved_basecode == -1) {
+			if (state->src_pos + state->next_bits > src_bits) goto broken;
+			lastcode = lzw_code(src, src_size, state->src_pos, state->next_bits);
+			state->src_pos += state->next_bits;
+			if (lastcode >= state->min_table_entry) goto broken;
+			if (out != NULL) out[done] = lastcode;
+			done++;
+			lzw_next_entry(state);
+			state->last_ch = lastcode;
+		}
+		else lastcode = state->saved_basecode;
+		while (done < length && state->src_pos + state->next_bits <= src_bits) {
+			unsigned int basecode = lzw_code(src, src_size, state->src_pos, state->next_bits);
+			unsigned int code;
+			state->src_pos += state->next_bits;
+			if (state->cur_entry == basecode) {
+				state->stack[state->stack_length++] = state->last_ch;
+				code = lastcode;
+			}
+			else code = basecode;
+			while (code >= state->min_table_entry) {
+				if (state->stack_length >= LZW_TABLE_SIZE-1) goto broken;	// codes that loop back on themselves
+				state->stack[state->stack_length++] = state->ch[code];
+				code = state->basecode[code];
+			}
+			state->stack[state->stack_length++] = code;
+			state->last_ch = code;
+
+			state->entry_used = true;
+			unsigned int entry = state->cur_entry;
+			state->basecode[entry] = lastcode;
+			state->ch[entry] = state->last_ch;
+			state->chain[entry] = state->hash[lastcode];
+			state->hash[lastcode] = entry;
+
+			if (!lzw_next_entry(state)) goto broken;
+			while (done < length && state->stack_length > 0) {
+				unsigned char c = state->stack[--state->stack_length];
+				if (out != NULL) out[done] = c;
+				done++;
+			}
+			lastcode = basecode;
+		}
+		state->saved_basecode = lastcode;
+	}
+	state->dst_pos += done;
+	return done;
+broken:
+	fprintf(stderr, "bad LZW codes at bit %llu\n", state->src_pos);
+	state->stack_length = 0;
+	state->src_pos = src_bits;
+	state->saved_basecode = 0;
+	state->dst_pos += done;
+	return done;
+}
+
+// allocated the first time file gets read expanded, caller holds file->parent->lock
+struct expanded_file* expanded_state(struct redsea_file* file, unsigned long long int size, int type) {
+	pthread_mutex_lock(&expand_cache_lock);
+	struct expanded_file* expanded = file->expanded;
+	if (expanded == NULL) {
+		expanded = malloc(sizeof(struct expanded_file));
+		pthread_mutex_init(&expanded->lock, NULL);
+		expanded->type = type;
+		expanded->size = size;
+		lzw_init(&expanded->cursor, type);
+		expanded->checkpoints = malloc(sizeof(struct lzw_state*)*(size/EXPAND_CHECKPOINT + 1));
+		expanded->checkpoints[0] = malloc(sizeof(struct lzw_state));
+		memcpy(expanded->checkpoints[0], &expanded->cursor, sizeof(struct lzw_state));
+		expanded->checkpoint_count = 1;
+		expanded->pages = calloc(size/EXPAND_PAGE + 1, sizeof(struct expanded_page*));
+		file->expanded = expanded;
+	}
+	pthread_mutex_unlock(&expand_cache_lock);
+	return expanded;
+}
+
+// expand_cache_lock held
+void evict_expanded_page(struct expanded_page* page) {
+	if (page->newer != NULL) page->newer->older = page->older;
+	else expand_newest = page->older;
+	if (page->older != NULL) page->older->newer = page->newer;
+	else expand_oldest = page->newer;
+	page->owner->pages[page->index] = NULL;
+	expand_cached_bytes -= page->length;
+	free(page);
+}
+
+// copy count bytes from offset in page index if it's cached
+bool copy_cached_page(struct expanded_file* expanded, unsigned long long int index, unsigned long long int offset, char* buffer, unsigned long long int count) {
+	pthread_mutex_lock(&expand_cache_lock);
+	struct expanded_page* page = expanded->pages[index];
+	if (page != NULL) {
+		memcpy(buffer, page->data + offset, count);
+		if (page != expand_newest) {
+			// to the front of the LRU
+			page->newer->older = page->older;
+			if (page->older != NULL) page->older->newer = page->newer;
+			else expand_oldest = page->newer;
+			page->older = expand_newest;
+			page->newer = NULL;
+			expand_newest->newer = page;
+			expand_newest = page;
+		}
+	}
+	pthread_mutex_unlock(&expand_cache_lock);
+	return page != NULL;
+}
+
+// takes page over, it's freed right away if someone else cached the same one first
+void cache_expanded_page(struct expanded_page* page) {
+	pthread_mutex_lock(&expand_cache_lock);
+	if (page->owner->pages[page->index] != NULL) free(page);
+	else {
+		page->owner->pages[page->index] = page;
+		page->newer = NULL;
+		page->older = expand_newest;
+		if (expand_newest != NULL) expand_newest->newer = page;
+		else expand_oldest = page;
+		expand_newest = page;
+		expand_cached_bytes += page->length;
+		unsigned long long int limit = (unsigned long long int)options.zcache_mb << 20;
+		while (expand_cached_bytes > limit && expand_oldest != NULL) evict_expanded_page(expand_oldest);
+	}
+	pthread_mutex_unlock(&expand_cache_lock);
+}
+
+// decode the next length bytes at the cursor, saving a checkpoint if that lands on a new one
+bool expand_step(struct expanded_file* expanded, const unsigned char* src, unsigned long long int src_size, unsigned char* out, unsigned long long int length) {
+	struct lzw_state* cursor = &expanded->cursor;
+	if (lzw_expand(cursor, src, src_size, out, length) != length) return false;
+	if (cursor->dst_pos % EXPAND_CHECKPOINT == 0 && cursor->dst_pos / EXPAND_CHECKPOINT == expanded->checkpoint_count) {
+		struct lzw_state* checkpoint = malloc(sizeof(struct lzw_state));
+		memcpy(checkpoint, cursor, sizeof(struct lzw_state));
+		expanded->checkpoints[expanded->checkpoint_count++] = checkpoint;
+	}
+	return true;
+}
+
+// expand page index of file into out, expanded->lock held
+bool expand_page(struct redsea_file* file, struct expanded_file* expanded, unsigned long long int index, unsigned char* out, unsigned long long int length) {
+	size_t src_size = file->size;
+	const unsigned char* src = redsea_file_content(file, &src_size, 0);
+	if (src_size != file->size) return false;
+	unsigned long long int start = index*EXPAND_PAGE;
+	if (expanded->type == CT_NONE) {
+		memcpy(out, src + ARC_HEADER_SIZE + start, length);
+		return true;
+	}
+	unsigned long long int checkpoint = start / EXPAND_CHECKPOINT;
+	if (checkpoint >= expanded->checkpoint_count) checkpoint = expanded->checkpoint_count-1;
+	// carry on from the last decode if it's between the checkpoint and here, that way reading straight through never goes back
+	if (expanded->cursor.dst_pos > start || expanded->cursor.dst_pos < checkpoint*EXPAND_CHECKPOINT) {
+		memcpy(&expanded->cursor, expanded->checkpoints[checkpoint], sizeof(struct lzw_state));
+	}
+	while (expanded->cursor.dst_pos < start) {
+		if (!expand_step(expanded, src, src_size, NULL, EXPAND_PAGE)) return false;
+	}
+	return expand_step(expanded, src, src_size, out, length);
+}
+
+/* read from the expanded contents of file, caller holds file->parent->lock
+ * for reading so the compressed data stays put. size is what
+ * expanded_file_size said
+ */
+int expanded_read(struct redsea_file* file, unsigned long long int expanded_size, int type, char* buffer, size_t size, off_t offset) {
+	if (offset >= expanded_size) return 0;
+	if (offset + size > expanded_size) size = expanded_size - offset;
+	struct expanded_file* expanded = expanded_state(file, expanded_size, type);
+	unsigned long long int done = 0;
+	while (done < size) {
+		unsigned long long int index = (offset + done) / EXPAND_PAGE;
+		unsigned long long int in_page = (offset + done) % EXPAND_PAGE;
+		unsigned long long int count = EXPAND_PAGE - in_page;
+		if (count > size - done) count = size - done;
+		if (copy_cached_page(expanded, index, in_page, buffer + done, count)) {
+			stats_add(&stats_zcache_hits, 1);
+			done += count;
+			continue;
+		}
+		unsigned long long int length = expanded_size - index*EXPAND_PAGE;
+		if (length > EXPAND_PAGE) length = EXPAND_PAGE;
+		pthread_mutex_lock(&expanded->lock);
+		// someone else might have just decoded it while we waited
+		if (copy_cached_page(expanded, index, in_page, buffer + done, count)) {
+			pthread_mutex_unlock(&expanded->lock);
+			stats_add(&stats_zcache_hits, 1);
+			done += count;
+			continue;
+		}
+		struct expanded_page* page = malloc(sizeof(struct expanded_page) + length);
+		page->owner = expanded;
+		page->index = index;
+		page->length = length;
+		bool ok = expand_page(file, expanded, index, page->data, length);
+		pthread_mutex_unlock(&expanded->lock);
+		if (!ok) {
+			free(page);
+			errno = EIO;
+			return -errno;
+		}
+		stats_add(&stats_zcache_misses, 1);
+		memcpy(buffer + done, page->data + in_page, count);
+		cache_expanded_page(page);
+		done += count;
+	}
+	return size;
+}
+
+// forget everything decoded for file, caller holds file->parent->lock for writing so nothing's reading it
+void drop_expanded(struct redsea_file* file) {
+	struct expanded_file* expanded = file->expanded;
+	if (expanded == NULL) return;
+	pthread_mutex_lock(&expand_cache_lock);
+	for (unsigned long long int i = 0; i <= expanded->size/EXPAND_PAGE; i++) {
+		if (expanded->pages[i] != NULL) evict_expanded_page(expanded->pages[i]);
+	}
+	file->expanded = NULL;
+	pthread_mutex_unlock(&expand_cache_lock);
+	for (unsigned long long int i = 0; i < expanded->checkpoint_count; i++) free(expanded->checkpoints[i]);
+	free(expanded->checkpoints);
+	free(expanded->pages);
+	pthread_mutex_destroy(&expanded->lock);
+	free(expanded);
+}
+
+int redsea_remove_common(struct redsea_directory* parent, unsigned long long int seek_to, unsigned char* name) {
+	if (!child_remove(parent, name)) return -1;
+
+	unsigned long long int entry = parent->block*BLOCK_SIZE + seek_to;
+	uint16_t filetype = image_le16(entry);
+	filetype += 0x100;					// mark file as deleted
+	unsigned char buf[2];
+	buf[0] = filetype & 0xff;
+	buf[1] = (filetype >> 8) & 0xff;
+	metadata_write(buf, 2, entry);
+	add_free_slot(parent, seek_to/64);
+
+	return 0;
+}
+
+// blocks in the extent a file owns, fallocate can make that more than its size needs
+unsigned long long int file_blocks(struct redsea_file* file) {
+	unsigned long long int blocks = blocks_for(file->size);
+	if (file->reserved_blocks > blocks) return file->reserved_blocks;
+	return blocks;
+}
+
+// copy a file's data to new_block and point its entry there. the old extent is left to the caller
+void move_file_data(struct redsea_file* file, unsigned long long int new_block) {
+	unsigned long long int start = stats_clock();
+	if (file->block != 0xFFFFFFFFFFFFFFFF) {
+		image_move(new_block*BLOCK_SIZE, file->block*BLOCK_SIZE, file->size);
+		stats_add(&stats_bytes_relocated, file->size);
+	}
+	file -> block = new_block;
+	metadata_write_le64(new_block, file->parent->block*BLOCK_SIZE + file->seek_to + 40);	// block field
+	stats_record(STATS_RELOCATE, start, false);
+}
+
+// move a file to a fresh extent of blocks blocks, giving back the one it was in
+void relocate_file(struct redsea_file* file, unsigned long long int blocks) {
+	unsigned long long int new_block = allocate_blocks(blocks);
+	unsigned long long int old_block = file -> block;
+	unsigned long long int old_blocks = file_blocks(file);
+	move_file_data(file, new_block);
+	file -> reserved_blocks = blocks;
+	release_blocks(old_block, old_blocks);
+}
+
+/* Make a file's extent at least new_blocks long.
+ * grows in place when the blocks after it are free, otherwise moves it to
+ * the best fitting hole. With relocate false it gives up and returns false
+ * instead of moving the file.
+ */
+bool grow_file_blocks(struct redsea_file* file, unsigned long long int new_blocks, bool relocate) {
+	unsigned long long int old_blocks = file_blocks(file);
+	if (file->block != 0xFFFFFFFFFFFFFFFF) {
+		if (new_blocks <= old_blocks) return true;
+		if (claim_blocks(file->block + old_blocks, new_blocks - old_blocks)) {
+			file->reserved_blocks = new_blocks;
+			return true;
+		}
+	}
+	if (!relocate) return false;
+	debug_printf("RELOCATED FILE %s\n", file->name);
+	relocate_file(file, new_blocks);
+	return true;
+}
+
+/* Make room for a file to hold new_size bytes.
+ * shrinking gives the tail blocks back, any reservation included.
+ */
+bool resize_file_extent(struct redsea_file* file, unsigned long long int new_size, bool relocate) {
+	unsigned long long int new_blocks = blocks_for(new_size);
+	if (file->block == 0xFFFFFFFFFFFFFFFF && new_size == 0) return true;
+	if (new_size < file->size) {
+		unsigned long long int old_blocks = file_blocks(file);
+		if (new_blocks < old_blocks) release_blocks(file->block + new_blocks, old_blocks - new_blocks);
+		file->reserved_blocks = 0;
+		return true;
+	}
+	return grow_file_blocks(file, new_blocks, relocate);
+}
+
+/* Copy a directory to new_block and rewrite everything pointing at it: its
+ * entry in the parent, its own first entry, the .. entries of its
+ * subdirectories and for the root the root pointers in the boot area. The
+ * old blocks are left to the caller.
+ */
+void move_directory_data(struct redsea_directory* directory, unsigned long long int new_block) {
+	unsigned long long int start = stats_clock();
+	unsigned long long int size = directory -> size;
+	journal_begin();
+	// read in whole first so it can overlap where it's going, and it's one write for the journal
+	unsigned char* entries = malloc(size);
+	image_read(entries, size, directory->block*BLOCK_SIZE);
+	metadata_write(entries, size, new_block*BLOCK_SIZE);
+	free(entries);
+	stats_add(&stats_bytes_relocated, size);
+	directory -> block = new_block;
+
+	debug_printf("RELOCATED DIRECTORY %s\n", directory->name);
+	if (strcmp(directory->name, ".") != 0) {
+		metadata_write_le64(new_block, directory->parent->block*BLOCK_SIZE + directory->seek_to + 40);
+	}
+	metadata_write_le64(new_block, new_block*BLOCK_SIZE + 40);
+	for (unsigned long long int i = 2; i < size/64; i++) {
+		unsigned long long int entry = new_block*BLOCK_SIZE + i*64;
+		uint16_t filetype = image_le16(entry);
+		if (filetype == 0) break;			// end of directory
+		if ((filetype & 0x10) && !(filetype & 0x100)) {	// If file is a (not deleted) directory
+			unsigned long long int subdir_block = image_le64(entry + 40);
+			// point the subdirectory's .. entry at the new block
+			metadata_write_le64(new_block, subdir_block*BLOCK_SIZE + 104);
+			metadata_write_le64(0, subdir_block*BLOCK_SIZE + 112);
+		}
+	}
+
+	unsigned char nb_char[8];
+	put_le64(nb_char, new_block);
+	unsigned char rdb_char[8];
+	put_root_pointer(rdb_char, new_block);
+	if (strcmp(directory->name, ".") == 0) {
+		debug_printf("ROOT DIRECTORY MOVED TO %#llx\n", new_block);
+		metadata_write(rdb_char, 8, 0x8098);
+		metadata_write(rdb_char, 8, 0x9098);
+		metadata_write(nb_char, 8, 0xB018);
+		metadata_write(nb_char, 8, new_block*BLOCK_SIZE + 104);
+	}
+	journal_end();
+	stats_record(STATS_RELOCATE, start, false);
+}
+
+/* Grow a directory by one block.
+ * in place if the block after it is free, otherwise the whole directory
+ * moves with move_directory_data.
+ */
+void grow_directory(struct redsea_directory* directory) {
+	unsigned long long int old_block = directory -> block;
+	unsigned long long int size = directory -> size;
+	journal_begin();
+	if (!claim_blocks(old_block + size/BLOCK_SIZE, 1)) {
+		move_directory_data(directory, allocate_blocks(size/BLOCK_SIZE + 1));
+		release_blocks(old_block, size/BLOCK_SIZE);
+	}
+	unsigned long long int block = directory -> block;
+
+	unsigned char* blank = calloc(BLOCK_SIZE, 1);
+	metadata_write(blank, BLOCK_SIZE, block*BLOCK_SIZE + size);
+	free(blank);
+
+	// add more space for directory
+	size += BLOCK_SIZE;
+	directory->size = size;
+
+	if (strcmp(directory->name, ".") != 0) {
+		metadata_write_le64(size, directory->parent->block*BLOCK_SIZE + directory->seek_to + 48);
+	}
+	metadata_write_le64(size, block*BLOCK_SIZE + 48);
+	journal_end();
+}
+
+/* Entry write back
+ * writes only change the size and date in memory and mark the file dirty,
+ * the entry on disk gets them all in one write when the file is flushed,
+ * released, fsynced, every writeback seconds, or at unmount. A file that's
+ * still delayed is left alone, its entry gets written when it's committed.
+ * Caller has the parent directory write locked.
+ */
+void write_back_entry(struct redsea_file* file) {
+	unsigned char fields[24];
+	put_le64(fields, file->block);
+	put_le64(fields+8, file->size);
+	put_le64(fields+16, file->mod_date);
+	metadata_write(fields, 24, file->parent->block*BLOCK_SIZE + file->seek_to + 40);
+	file->dirty = false;
+}
+
+/* Delayed allocation
+ * a file that has to grow but can't do it in place would get copied to a
+ * new extent on every write that crosses its last block, and again every
+ * time another growing file lands after it. Instead its contents are pulled
+ * into memory once and written to a single extent sized for the final
+ * length when it's flushed, released, fsynced or the filesystem goes away.
+ * Everything here runs with the parent directory write locked.
+ */
+#define DELAYED_FILE_LIMIT (64ULL << 20)		// bigger than this and the file just gets moved
+#define DELAYED_TOTAL_LIMIT (256ULL << 20)		// across all files
+unsigned long long int delayed_bytes = 0;		// capacity of all delayed buffers
+
+bool reserve_delayed_capacity(struct redsea_file* file, unsigned long long int needed) {
+	if (needed <= file->delayed_capacity) return true;
+	if (needed > DELAYED_FILE_LIMIT) return false;
+	unsigned long long int capacity = file->delayed_capacity ? file->delayed_capacity : 0x10000;
+	while (capacity < needed) capacity *= 2;
+	if (capacity > DELAYED_FILE_LIMIT) capacity = DELAYED_FILE_LIMIT;
+	unsigned long long int total = __atomic_add_fetch(&delayed_bytes, capacity - file->delayed_capacity, __ATOMIC_RELAXED);
+	if (total > DELAYED_TOTAL_LIMIT) {
+		__atomic_sub_fetch(&delayed_bytes, capacity - file->delayed_capacity, __ATOMIC_RELAXED);
+		return false;
+	}
+	file->delayed = realloc(file->delayed, capacity);
+	file->delayed_capacity = capacity;
+	return true;
+}
+
+void free_delayed_buffer(struct redsea_file* file) {
+	__atomic_sub_fetch(&delayed_bytes, file->delayed_capacity, __ATOMIC_RELAXED);
+	free(file->delayed);
+	file->delayed = NULL;
+	file->delayed_capacity = 0;
+}
+
+bool start_delayed_allocation(struct redsea_file* file, unsigned long long int needed) {
+	if (options.no_delalloc || !reserve_delayed_capacity(file, needed)) return false;
+	debug_printf("DELAYED ALLOCATION %s\n", file->name);
+	file->disk_size = file->size;
+	if (file->block != 0xFFFFFFFFFFFFFFFF) image_read(file->delayed, file->size, file->block*BLOCK_SIZE);
+	return true;
+}
+
+// write a delayed file out to one extent that fits it
+/* Give file an extent new_blocks long for contents that are about to be
+ * written over it, staying where it is if the old extent (old_blocks long)
+ * is big enough or can grow in place.
+ */
+void replace_file_extent(struct redsea_file* file, unsigned long long int old_blocks, unsigned long long int new_blocks) {
+	if (file->block == 0xFFFFFFFFFFFFFFFF) {
+		file->block = allocate_blocks(new_blocks);
+	}
+	else if (new_blocks < old_blocks) {
+		release_blocks(file->block + new_blocks, old_blocks - new_blocks);
+	}
+	else if (new_blocks > old_blocks && !claim_blocks(file->block + old_blocks, new_blocks - old_blocks)) {
+		release_blocks(file->block, old_blocks);
+		file->block = allocate_blocks(new_blocks);
+	}
+	file->reserved_blocks = 0;
+}
+
+void commit_delayed_allocation(struct redsea_file* file) {
+	if (file->delayed == NULL) return;
+	journal_begin();		// the old extent can't be handed out before the entry moves off it
+	unsigned long long int size = file->size;
+	unsigned long long int old_blocks = blocks_for(file->disk_size);
+	if (file->reserved_blocks > old_blocks) old_blocks = file->reserved_blocks;
+	replace_file_extent(file, old_blocks, blocks_for(size));
+	debug_printf("COMMITTED DELAYED FILE %s TO BLOCK %#llx\n", file->name, file->block);
+	image_write(file->delayed, size, file->block*BLOCK_SIZE);
+	free_delayed_buffer(file);
+	write_back_entry(file);
+	journal_end();
+}
+
+// drop delayed data (the file is going away), leaving the file as it is on disk
+void discard_delayed_allocation(struct redsea_file* file) {
+	if (file->delayed == NULL) return;
+	free_delayed_buffer(file);
+	file->size = file->disk_size;
+}
+
+void write_file(struct redsea_file* file, const char* buffer, size_t size, off_t offset) {
+	if (file->delayed != NULL) {
+		if (reserve_delayed_capacity(file, size + offset)) {
+			if (offset > file->size) memset(file->delayed + file->size, 0, offset - file->size);
+			memcpy(file->delayed + offset, buffer, size);
+			if (size + offset > file->size) file->size = size + offset;
+			file->mod_date = unix_to_cdate(time(NULL));
+			file->dirty = true;
+			return;
+		}
+		// too big to keep in memory, put it on disk and carry on as normal
+		commit_delayed_allocation(file);
+	}
+	if (size + offset > file->size && !resize_file_extent(file, size + offset, false)) {
+		if (start_delayed_allocation(file, size + offset)) {
+			write_file(file, buffer, size, offset);
+			return;
+		}
+		resize_file_extent(file, size + offset, true);
+	}
+	if (size + offset > file->size) {
+		// blocks picked up from a hole hold whatever was there before
+		if (offset > file->size) {
+			unsigned char* blank = calloc(offset - file->size, 1);
+			image_write(blank, offset - file->size, file->block*BLOCK_SIZE + file->size);
+			free(blank);
+		}
+	}
+	unsigned long long int block = file -> block;
+	image_write(buffer, size, block*BLOCK_SIZE + offset);
+
+	// is this check unnecessary after properly implementing truncate? I think so? I'll leave it in.
+	if ((size+offset) > file->size) {
+		file->size += (size+offset)-file->size;			// set file size
+	}
+	long long int unix_time = time(NULL);
+	unsigned long long int CDate = unix_to_cdate(unix_time);
+
+	file->mod_date = CDate;
+	file->dirty = true;
+}
+
+// commit whatever is dirty, for the timer
+void write_back_all() {
+	pthread_rwlock_rdlock(&table_lock);
+	for (unsigned long long int i = 0; i < file_count; i++) {
+		struct redsea_file* file = file_structs[i];
+		pthread_rwlock_wrlock(&file->parent->lock);
+		if (file->dirty && file->delayed == NULL) write_back_entry(file);
+		pthread_rwlock_unlock(&file->parent->lock);
+	}
+	pthread_rwlock_unlock(&table_lock);
+}
+
+// writes back every writeback_interval seconds until destroy wakes it up to stop
+pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER;
+bool writeback_stop = false;
+bool writeback_started = false;
+pthread_t writeback_thread;
+
+void* writeback_thread_main(void* arg) {
+	pthread_mutex_lock(&writeback_lock);
+	while (!writeback_stop) {
+		struct timespec wake;
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += options.writeback_interval;
+		if (pthread_cond_timedwait(&writeback_cond, &writeback_lock, &wake) != ETIMEDOUT) continue;
+		pthread_mutex_unlock(&writeback_lock);
+		write_back_all();
+		cache_flush_all();
+		pthread_mutex_lock(&writeback_lock);
+	}
+	pthread_mutex_unlock(&writeback_lock);
+	return NULL;
+}
+
+/* Compression on close
+ * with -o decompress .Z files are written expanded like they're read. The
+ * expanded contents get staged in memory (file->staged) from the first
+ * write or truncate, reads and getattr use them while they're there. On
+ * release the file is queued and the compress thread packs it with
+ * arc_compress and writes it out as one extent, so close doesn't wait on
+ * it. fsync and unmount compress right away instead.
+ * The staged buffer is guarded by the parent directory lock like the rest
+ * of the file. The compressor works on a copy without holding anything and
+ * throws the result away if the file changed in the meantime, the release
+ * after that change has queued it again.
+ */
+pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+struct redsea_file** compress_queue = NULL;
+unsigned long long int compress_queue_length = 0;
+unsigned long long int compress_queue_capacity = 0;
+bool compress_stop = false;
+bool compress_started = false;
+pthread_t compress_thread;
+unsigned long long int staged_versions = 0;
+
+struct staged_contents {
+	unsigned char* data;
+	unsigned long long int size;
+	unsigned long long int capacity;
+	unsigned long long int version;		// fresh number on every change, never reused
+};
+
+bool stages_writes(struct redsea_file* file) {
+	return options.decompress && (file->attributes & 0x400);
+}
+
+// BFieldOrU32
+void arc_put_code(unsigned char* dst, unsigned long long int pos, unsigned int code) {
+	unsigned long long int byte = pos >> 3;
+	uint32_t word = code << (pos & 7);
+	for (int i = 0; i < 3 && word != 0; i++, word >>= 8) dst[byte+i] |= word & 0xFF;
+}
+
+/* CompressBuf, returns a malloced CArcCompress for size bytes of src and
+ * its length in *arc_size. Like TempleOS it falls back to storing it as is
+ * when LZW would come out bigger.
+ */
+unsigned char* arc_compress(const unsigned char* src, unsigned long long int size, unsigned long long int* arc_size) {
+	int type = CT_7_BIT;
+	for (unsigned long long int i = 0; i < size; i++) {
+		if (src[i] & 0x80) {
+			type = CT_8_BIT;
+			break;
+		}
+	}
+	unsigned long long int dst_bits = (size + ARC_HEADER_SIZE + 1)*8;
+	unsigned char* dst = calloc(size + ARC_HEADER_SIZE + 4, 1);	// +3 so arc_put_code can spill over the end
+	unsigned long long int src_pos = 0;
+	if (size > 0) {
+		// ArcCompressBuf and ArcFinishCompression, state->src_pos counts bits written
+		struct lzw_state* state = malloc(sizeof(struct lzw_state));
+		lzw_init(state, type);
+		unsigned int basecode = src[src_pos++];
+		while (src_pos < size && state->src_pos + state->cur_bits <= dst_bits) {
+			lzw_next_entry(state);
+			unsigned int ch;
+			bool found;
+			do {
+				if (src_pos >= size) goto done;
+				ch = src[src_pos++];
+				found = false;
+				for (unsigned int entry = state->hash[basecode]; entry != 0; entry = state->chain[entry]) {
+					if (state->ch[entry] == ch) {
+						basecode = entry;
+						found = true;
+						break;
+					}
+				}
+			} while (found);
+			arc_put_code(dst, state->src_pos, basecode);
+			state->src_pos += state->cur_bits;
+
+			state->entry_used = true;
+			unsigned int entry = state->cur_entry;
+			state->basecode[entry] = basecode;
+			state->ch[entry] = ch;
+			state->chain[entry] = state->hash[basecode];
+			state->hash[basecode] = entry;
+
+			basecode = ch;
+		}
+done:
+		if (state->src_pos + state->cur_bits <= dst_bits) {
+			arc_put_code(dst, state->src_pos, basecode);
+			state->src_pos += state->next_bits;
+		}
+		*arc_size = (state->src_pos + 7) >> 3;
+		free(state);
+	}
+	if (size == 0 || src_pos != size) {
+		type = CT_NONE;
+		*arc_size = size + ARC_HEADER_SIZE + 1;		// sizeof(CArcCompress) counts the first byte of the body
+		memset(dst, 0, *arc_size);
+		memcpy(dst + ARC_HEADER_SIZE, src, size);
+	}
+	put_le64(dst, *arc_size);
+	put_le64(dst+8, size);
+	dst[16] = type;
+	return dst;
+}
+
+void staged_changed(struct redsea_file* file) {
+	file->staged->version = __atomic_add_fetch(&staged_versions, 1, __ATOMIC_RELAXED);
+}
+
+void stage_capacity(struct redsea_file* file, unsigned long long int needed) {
+	if (file->staged == NULL) file->staged = calloc(1, sizeof(struct staged_contents));
+	struct staged_contents* staged = file->staged;
+	if (needed <= staged->capacity) return;
+	unsigned long long int capacity = staged->capacity ? staged->capacity : 4096;
+	while (capacity < needed) capacity *= 2;
+	staged->data = realloc(staged->data, capacity);
+	staged->capacity = capacity;
+}
+
+// parent write locked
+void free_staged(struct redsea_file* file) {
+	if (file->staged == NULL) return;
+	free(file->staged->data);
+	free(file->staged);
+	file->staged = NULL;
+}
+
+/* Pull the first keep bytes of file's contents (expanded if it's a valid
+ * compressed file, as is if it isn't) into the staging buffer if they're
+ * not there already. Parent write locked. False if the compressed data
+ * doesn't decode.
+ */
+bool stage_file(struct redsea_file* file, unsigned long long int keep) {
+	if (file->staged != NULL) return true;
+	int type = CT_NONE;
+	unsigned long long int size = expanded_file_size(file, &type);
+	bool expanded = size != -1;
+	if (!expanded) size = file->size;
+	if (keep > size) keep = size;
+	stage_capacity(file, keep ? keep : 1);
+	size_t src_size = file->size;
+	unsigned char* src = redsea_file_content(file, &src_size, 0);
+	if (keep == 0);
+	else if (type == CT_NONE) {
+		memcpy(file->staged->data, src + (expanded ? ARC_HEADER_SIZE : 0), keep);
+	}
+	else {
+		struct lzw_state* state = malloc(sizeof(struct lzw_state));
+		lzw_init(state, type);
+		bool ok = lzw_expand(state, src, src_size, file->staged->data, keep) == keep;
+		free(state);
+		if (!ok) {
+			free_staged(file);
+			return false;
+		}
+	}
+	file->staged->size = keep;
+	staged_changed(file);
+	drop_expanded(file);
+	return true;
+}
+
+void write_staged(struct redsea_file* file, const char* buffer, size_t size, off_t offset) {
+	stage_capacity(file, offset + size);
+	struct staged_contents* staged = file->staged;
+	if (offset > staged->size) memset(staged->data + staged->size, 0, offset - staged->size);
+	memcpy(staged->data + offset, buffer, size);
+	if (offset + size > staged->size) staged->size = offset + size;
+	staged_changed(file);
+}
+
+void truncate_staged(struct redsea_file* file, unsigned long long int length) {
+	stage_capacity(file, length ? length : 1);
+	struct staged_contents* staged = file->staged;
+	if (length > staged->size) memset(staged->data + staged->size, 0, length - staged->size);
+	staged->size = length;
+	staged_changed(file);
+}
+
+/* Compress file's staged contents and put them on disk if nothing changed
+ * them meanwhile. Takes the locks itself, nothing can be held.
+ */
+void compress_staged(struct redsea_file* file) {
+	pthread_rwlock_rdlock(&table_lock);
+	struct redsea_directory* parent = file->parent;
+	pthread_rwlock_rdlock(&parent->lock);
+	if (file->staged == NULL) {
+		pthread_rwlock_unlock(&parent->lock);
+		pthread_rwlock_unlock(&table_lock);
+		return;
+	}
+	unsigned long long int version = file->staged->version;
+	unsigned long long int size = file->staged->size;
+	unsigned char* copy = malloc(size ? size : 1);
+	memcpy(copy, file->staged->data, size);
+	pthread_rwlock_unlock(&parent->lock);
+	pthread_rwlock_unlock(&table_lock);
+
+	unsigned long long int start = stats_clock();
+	unsigned long long int arc_size;
+	unsigned char* arc = arc_compress(copy, size, &arc_size);
+	free(copy);
+
+	pthread_rwlock_rdlock(&table_lock);
+	pthread_rwlock_wrlock(&parent->lock);
+	file_data_changed();
+	bool current = file->staged != NULL && file->staged->version == version;
+	if (current) {
+		journal_begin();
+		// whatever's on disk now is about to be replaced, delayed data included
+		discard_delayed_allocation(file);
+		replace_file_extent(file, file_blocks(file), blocks_for(arc_size));
+		image_write(arc, arc_size, file->block*BLOCK_SIZE);
+		file->size = arc_size;
+		file->mod_date = unix_to_cdate(time(NULL));
+		write_back_entry(file);
+		journal_end();
+		free_staged(file);
+		debug_printf("COMPRESSED %s %llu -> %llu\n", file->name, size, arc_size);
+	}
+	pthread_rwlock_unlock(&parent->lock);
+	pthread_rwlock_unlock(&table_lock);
+	free(arc);
+	stats_record(STATS_COMPRESS, start, !current);
+}
+
+void queue_compression(struct redsea_file* file) {
+	pthread_mutex_lock(&compress_lock);
+	if (!file->compress_queued) {
+		if (compress_queue_length == compress_queue_capacity) {
+			compress_queue_capacity = compress_queue_capacity ? compress_queue_capacity*2 : 16;
+			compress_queue = realloc(compress_queue, sizeof(struct redsea_file*)*compress_queue_capacity);
+		}
+		compress_queue[compress_queue_length++] = file;
+		file->compress_queued = true;
+		pthread_cond_signal(&compress_cond);
+	}
+	pthread_mutex_unlock(&compress_lock);
+}
+
+// works through the queue until destroy stops it, anything left is compressed there
+void* compress_thread_main(void* arg) {
+	pthread_mutex_lock(&compress_lock);
+	while (!compress_stop) {
+		if (compress_queue_length == 0) {
+			pthread_cond_wait(&compress_cond, &compress_lock);
+			continue;
+		}
+		struct redsea_file* file = compress_queue[0];
+		memmove(compress_queue, compress_queue+1, sizeof(struct redsea_file*)*--compress_queue_length);
+		file->compress_queued = false;
+		pthread_mutex_unlock(&compress_lock);
+		compress_staged(file);
+		pthread_mutex_lock(&compress_lock);
+	}
+	pthread_mutex_unlock(&compress_lock);
+	return NULL;
+}
+
+/*Rewrite the redsea boot area.
+ *Called upon filesystem destruction
+ */
+
+void rewrite_redsea_boot() {
+	unsigned long long int end = image_length;
+	unsigned int end_sector = end / ISO_9660_SECTOR_SIZE;			// this number is only 32 bit which puts a
+										// limitation on ISO.C files with redsea, which can
+										// theoretically support much larger filesystems.
+										// You should never have a redsea fs that large though.
+										// That's not what RedSea is for
+	unsigned long long int end_block = end / BLOCK_SIZE - 0x58;		// minus 0x58 for start block
+	debug_printf("EOF SECTOR: %#x\n", end_sector);
+	
+	unsigned char ISO_9660_buffer[8];
+	put_both32(ISO_9660_buffer, end_sector);
+	metadata_write(ISO_9660_buffer, 8, 0x8050);
+	metadata_write(ISO_9660_buffer, 8, 0x9050);
+	metadata_write_le64(end_block, 0xB000 + 16);
+}
+
+// hands out a deleted entry if there is one, otherwise the one past the end. returns its offset in the image
+unsigned long long int take_free_slot(struct redsea_directory* directory) {
+	unsigned long long int slot;
+	if (directory->free_slot_count > 0) slot = directory->free_slots[--directory->free_slot_count];
+	else slot = directory->next_slot++;
+	return directory->block*BLOCK_SIZE + slot*64;
+}
+
+unsigned long long int add_entry_to_dir(struct redsea_directory* directory, uint16_t attributes, unsigned char* name, unsigned long long int block, unsigned long long int size, unsigned long long int timestamp) {
+	unsigned long long int next_free = take_free_slot(directory);
+	journal_begin();
+
+	unsigned char entry[64];
+	write_entry(entry, attributes, (char*) name, block, size, timestamp);
+	metadata_write(entry, 64, next_free);
+	
+	// if directory
+	if ((attributes >> 4) & 1 == 1) {
+		debug_printf("ADDED DIRECTORY %s\n", name);
+		metadata_write(entry, 64, block*BLOCK_SIZE);
+		// .. is a copy of the parent's own first entry with the size cleared
+		unsigned char parent_entry[64];
+		image_read(parent_entry, 64, directory->block*BLOCK_SIZE);
+		memset(parent_entry+2, 0, MAX_NAME+1);
+		strcpy(parent_entry+2, "..");
+		memset(parent_entry+48, 0, 8);
+		metadata_write(parent_entry, 64, block*BLOCK_SIZE + 64);
+		// overwrite anything after so no tos errors occur
+		unsigned char* blank = calloc(0x180, 1);
+		metadata_write(blank, 0x180, block*BLOCK_SIZE + 128);
+		free(blank);
+	}
+	else debug_printf("ADDED FILE %s\n", name);
+	journal_end();
+
+	return next_free - directory->block*BLOCK_SIZE;
+
+}
+
+/* Compaction
+ * every relocation leaves a hole behind, and holes that nothing fits in
+ * just sit there making the image bigger. This goes through everything on
+ * the image from the bottom up and moves it down: into the lowest hole it
+ * fits in, or if the hole right before it is too small, slides it down over
+ * that hole. Afterwards all the free space is at the end and gets cut off.
+ * Runs with table_lock write locked so nothing else is going on, and it has
+ * to load the whole tree since every entry pointing at something that moves
+ * has to be rewritten.
+ */
+struct compact_item {
+	unsigned long long int block;
+	unsigned long long int blocks;
+	struct redsea_file* file;		// one of these is set
+	struct redsea_directory* directory;
+};
+char compact_report[256] = "never run\n";
+
+int compare_compact_items(const void* a, const void* b) {
+	const struct compact_item* x = a;
+	const struct compact_item* y = b;
+	if (x->block < y->block) return -1;
+	return x->block > y->block;
+}
+
+// lowest hole below limit that count blocks fit in, -1 if there isn't one
+unsigned long long int lowest_hole(unsigned long long int count, unsigned long long int limit) {
+	unsigned long long int block = -1;
+	pthread_mutex_lock(&allocator_lock);
+	for (unsigned long long int i = 0; i < free_extent_count && free_extents[i].block < limit; i++) {
+		if (free_extents[i].count >= count) {
+			block = free_extents[i].block;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&allocator_lock);
+	return block;
+}
+
+// hole ending right at block, -1 if block doesn't come straight after one
+unsigned long long int hole_before(unsigned long long int block) {
+	unsigned long long int start = -1;
+	pthread_mutex_lock(&allocator_lock);
+	unsigned long long int pos = free_extent_search(block);
+	if (pos > 0 && free_extents[pos-1].block + free_extents[pos-1].count == block) start = free_extents[pos-1].block;
+	pthread_mutex_unlock(&allocator_lock);
+	return start;
+}
+
+void compact_image() {
+	ensure_free_map();
+	journal_sync();			// frees waiting on a commit are holes too
+	for (unsigned long long int i = 0; i < directory_count; i++) {	// directory_count grows as this goes
+		if (!directory_structs[i]->loaded) load_directory(directory_structs[i]);
+	}
+	unsigned long long int old_length = image_size();
+
+	unsigned long long int item_count = 0;
+	struct compact_item* items = malloc(sizeof(struct compact_item)*(file_count + directory_count));
+	for (unsigned long long int i = 0; i < file_count; i++) {
+		struct redsea_file* file = file_structs[i];
+		commit_delayed_allocation(file);
+		if (file->block == 0xFFFFFFFFFFFFFFFF) continue;
+		items[item_count++] = (struct compact_item) {file->block, file_blocks(file), file, NULL};
+	}
+	for (unsigned long long int i = 0; i < directory_count; i++) {
+		struct redsea_directory* directory = directory_structs[i];
+		items[item_count++] = (struct compact_item) {directory->block, directory->size/BLOCK_SIZE, NULL, directory};
+	}
+	qsort(items, item_count, sizeof(struct compact_item), compare_compact_items);
+
+	unsigned long long int moved = 0;
+	unsigned long long int bytes_moved = 0;
+	for (unsigned long long int i = 0; i < item_count; i++) {
+		struct compact_item* item = &items[i];
+		unsigned long long int new_block = lowest_hole(item->blocks, item->block);
+		if (new_block != -1) {
+			claim_blocks(new_block, item->blocks);
+		}
+		else {
+			new_block = hole_before(item->block);
+			if (new_block == -1) continue;
+			// sliding a file over itself would wreck the copy the journal's entry still points at
+			unsigned long long int gap = item->block - new_block;
+			if (journal_fd != -1 && item->file != NULL && gap < item->blocks) continue;
+			// take the hole and give back the tail of the old extent it doesn't cover anymore
+			claim_blocks(new_block, gap);
+			release_blocks(new_block + item->blocks, gap);
+		}
+		journal_begin();
+		if (item->file != NULL) {
+			move_file_data(item->file, new_block);
+			bytes_moved += item->file->size;
+		}
+		else {
+			move_directory_data(item->directory, new_block);
+			bytes_moved += item->directory->size;
+		}
+		if (new_block + item->blocks <= item->block) release_blocks(item->block, item->blocks);
+		journal_end();
+		moved++;
+		if (!journal_sync()) break;	// so what was just freed can be moved into. none of it can be if the journal failed
+	}
+	free(items);
+
+	// everything past free_space_pointer is empty now. keep the image a whole number of ISO sectors
+	pthread_mutex_lock(&allocator_lock);
+	unsigned long long int new_length = free_space_pointer*BLOCK_SIZE;
+	pthread_mutex_unlock(&allocator_lock);
+	new_length = (new_length + ISO_9660_SECTOR_SIZE-1) / ISO_9660_SECTOR_SIZE * ISO_9660_SECTOR_SIZE;
+	if (new_length < old_length && journal_sync()) {
+		image_truncate(new_length);
+		rewrite_redsea_boot();
+	}
+	unsigned long long int reclaimed = old_length > image_size() ? old_length - image_size() : 0;
+	snprintf(compact_report, sizeof(compact_report), "moved: %llu\nbytes moved: %llu\nbytes reclaimed: %llu\nimage size: %llu\nholes left: %llu\n",
+		moved, bytes_moved, reclaimed, image_size(), free_extent_count);
+	debug_printf("COMPACTED: %s", compact_report);
+}
+
+/* Control files
+ * /.redsea isn't on the image, it's where the driver puts things to poke at.
+ * It doesn't show up when listing the root.
+ *  compact - write anything to it to compact the image, read it to see what
+ *            the last compaction did
+ *  stats   - counters, see format_stats. write anything to it to zero them
+ */
+bool is_control_path(const char* path) {
+	return strncmp(path, "/.redsea", 8) == 0 && (path[8] == '\0' || path[8] == '/');
+}
+
+// snprintf onto the end of what's there, once the buffer's full length stays at size-1
+void stats_printf(char* buffer, unsigned long long int size, unsigned long long int* length, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	int written = vsnprintf(buffer + *length, size - *length, format, args);
+	va_end(args);
+	if (written > 0) *length += written;
+	if (*length + 1 > size) *length = size - 1;
+}
+
+/* one line per op then the totals, all "name key=value ..." so it's easy to
+ * pull apart with awk. hist_us is the histogram buckets comma separated,
+ * see stats_record
+ */
+unsigned long long int format_stats(char* buffer, unsigned long long int size) {
+	unsigned long long int length = 0;
+	for (int i = 0; i < STATS_OPS; i++) {
+		struct op_stats* stats = &op_stats[i];
+		unsigned long long int count = __atomic_load_n(&stats->count, __ATOMIC_RELAXED);
+		stats_printf(buffer, size, &length, "%s count=%llu errors=%llu total_us=%llu max_us=%llu hist_us=",
+			stats_op_names[i], count, __atomic_load_n(&stats->errors, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats->total_ns, __ATOMIC_RELAXED) / 1000, __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED) / 1000);
+		for (int j = 0; j < STATS_BUCKETS; j++) {
+			stats_printf(buffer, size, &length, j ? ",%llu" : "%llu", __atomic_load_n(&stats->buckets[j], __ATOMIC_RELAXED));
+		}
+		stats_printf(buffer, size, &length, "\n");
+	}
+	stats_printf(buffer, size, &length, "bytes read=%llu written=%llu relocated=%llu delayed=%llu\n",
+		__atomic_load_n(&stats_bytes_read, __ATOMIC_RELAXED), __atomic_load_n(&stats_bytes_written, __ATOMIC_RELAXED),
+		__atomic_load_n(&stats_bytes_relocated, __ATOMIC_RELAXED), __atomic_load_n(&delayed_bytes, __ATOMIC_RELAXED));
+	pthread_mutex_lock(&expand_cache_lock);
+	stats_printf(buffer, size, &length, "zcache hits=%llu misses=%llu bytes=%llu limit=%llu\n",
+		__atomic_load_n(&stats_zcache_hits, __ATOMIC_RELAXED), __atomic_load_n(&stats_zcache_misses, __ATOMIC_RELAXED),
+		expand_cached_bytes, (unsigned long long int)options.zcache_mb << 20);
+	pthread_mutex_unlock(&expand_cache_lock);
+	pthread_mutex_lock(&allocator_lock);
+	stats_printf(buffer, size, &length, "allocator holes=%llu hole_blocks=%llu end_block=%llu image_bytes=%llu\n",
+		free_extent_count, free_hole_blocks, free_space_pointer, image_size());
+	pthread_mutex_unlock(&allocator_lock);
+	pthread_rwlock_rdlock(&table_lock);
+	pthread_mutex_lock(&journal_lock);
+	stats_printf(buffer, size, &length, "journal transactions=%llu commits=%llu pending_bytes=%llu\n",
+		__atomic_load_n(&stats_journal_transactions, __ATOMIC_RELAXED), __atomic_load_n(&stats_journal_commits, __ATOMIC_RELAXED),
+		journal_pending_bytes);
+	pthread_mutex_unlock(&journal_lock);
+	stats_printf(buffer, size, &length, "readahead fills=%llu hits=%llu bytes=%llu\n",
+		__atomic_load_n(&stats_readahead_fills, __ATOMIC_RELAXED), __atomic_load_n(&stats_readahead_hits, __ATOMIC_RELAXED),
+		__atomic_load_n(&stats_readahead_bytes, __ATOMIC_RELAXED));
+	stats_printf(buffer, size, &length, "io engine=%s depth=%u requests=%llu submit_calls=%llu\n",
+		io_ring_fd != -1 ? "io_uring" : "sync", options.io_depth,
+		__atomic_load_n(&stats_io_requests, __ATOMIC_RELAXED), __atomic_load_n(&stats_io_calls, __ATOMIC_RELAXED));
+	stats_printf(buffer, size, &length, "cache hits=%llu misses=%llu writebacks=%llu dirty_chunks=%llu limit=%llu\n",
+		__atomic_load_n(&stats_cache_hits, __ATOMIC_RELAXED), __atomic_load_n(&stats_cache_misses, __ATOMIC_RELAXED),
+		__atomic_load_n(&stats_cache_writebacks, __ATOMIC_RELAXED), __atomic_load_n(&cache_dirty_chunks, __ATOMIC_RELAXED),
+		cache_shards != NULL ? cache_shard_limit*CACHE_SHARDS*CACHE_CHUNK : 0);
+	stats_printf(buffer, size, &length, "tables files=%d directories=%d arena_bytes=%llu children_bytes=%llu\n",
+		file_count, directory_count, arena_bytes, children_bytes);
+	pthread_rwlock_unlock(&table_lock);
+	return length;
+}
+
+// contents of a control file, -1 if there's no such file
+#define CONTROL_FILE_MAX 8192
+long long int control_contents(const char* path, char* buffer) {
+	if (strcmp(path, "/.redsea/stats") == 0) return format_stats(buffer, CONTROL_FILE_MAX);
+	if (strcmp(path, "/.redsea/compact") == 0) {
+		pthread_rwlock_rdlock(&table_lock);
+		snprintf(buffer, CONTROL_FILE_MAX, "%s", compact_report);
+		pthread_rwlock_unlock(&table_lock);
+		return strlen(buffer);
+	}
+	return -1;
+}
+
+static int control_attributes(const char* path, struct stat* st) {
+	char buffer[CONTROL_FILE_MAX];
+	long long int length;
+	if (strcmp(path, "/.redsea") == 0) {
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+	}
+	else if ((length = control_contents(path, buffer)) != -1) {
+		st->st_mode = S_IFREG | 0644;
+		st->st_nlink = 1;
+		st->st_size = length;
+	}
+	else {
+		errno = ENOENT;
+		return -errno;
+	}
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	return 0;
+}
 
-	rewind(image);
-	if (strcmp(directory->name, ".") != 0) {
-		fseek(image, directory->parent->block*BLOCK_SIZE + directory->seek_to, SEEK_SET);
-		fseek(image, 40, SEEK_CUR);				// find block
+static int control_read(const char* path, char* buffer, size_t size, off_t offset) {
+	char contents[CONTROL_FILE_MAX];
+	long long int length = control_contents(path, contents);
+	if (length == -1) {
+		errno = EISDIR;
+		return -errno;
 	}
-	unsigned char nb_char[8] = {new_block & 0xff, (new_block >> 8) & 0xff, (new_block >> 16) & 0xff, (new_block>>24) & 0xff,
-		(new_block>>32) & 0xff, (new_block >> 40) & 0xff, (new_block >> 48) & 0xff, (new_block >> 56) & 0xff};
-	unsigned char size_char[8] = {size & 0xff, (size >> 8) & 0xff, (size >> 16) & 0xff, (size >> 24) & 0xff, (size >> 32) & 0xff,
-		(size >> 40) & 0xff, (size >> 48) & 0xff, (size >> 56) & 0xff};
-	if (strcmp(directory->name, ".") != 0) {
-		fwrite(nb_char, 8, 1, image);
-		fwrite(size_char, 8, 1, image);
-	}
-
-	rewind(image); // SEEK_SET just set the pointer. I don't know why I use
-		       // rewind so much.
-	fseek(image, new_block*BLOCK_SIZE, SEEK_SET);
-       	fseek(image, 40, SEEK_CUR);
-	fwrite(nb_char, 8, 1, image);
-	fwrite(size_char, 8, 1, image);
-	for (int i = 0; i < directory -> num_children; i++) {
-		rewind(image);
-		fseek(image, directory->block*BLOCK_SIZE, SEEK_SET);
-		uint16_t filetype;
-		fseek(image, 128 + i*64, SEEK_CUR);
-		fread(&filetype, 2, 1, image);
-		if ((filetype >> 4) & 1 == 1) {		// If file is a directory
-			fseek(image, 38, SEEK_CUR);
-			unsigned long long int subdir_block;
-			fread(&subdir_block, 8, 1, image);
-			rewind(image);
-			fseek(image, subdir_block*BLOCK_SIZE, SEEK_SET);
-			fseek(image, 104, SEEK_CUR);
-			fwrite(nb_char, 8, 1, image);
-			unsigned char* blank = calloc(8, 1);
-			fwrite(blank, 8, 1, image);
-			free(blank);
-		}
+	if (offset >= length) size = 0;
+	else if (size > length - offset) size = length - offset;
+	memcpy(buffer, contents + offset, size);
+	return size;
+}
 
+static int control_write(const char* path, size_t size) {
+	if (strcmp(path, "/.redsea/compact") == 0) {
+		pthread_rwlock_wrlock(&table_lock);
+		compact_image();
+		pthread_rwlock_unlock(&table_lock);
 	}
+	else if (strcmp(path, "/.redsea/stats") == 0) {
+		// not atomic with ops finishing at the same time, a count can be off by the ones in flight
+		for (int i = 0; i < STATS_OPS; i++) {
+			struct op_stats* stats = &op_stats[i];
+			__atomic_store_n(&stats->count, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&stats->errors, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&stats->total_ns, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&stats->max_ns, 0, __ATOMIC_RELAXED);
+			for (int j = 0; j < STATS_BUCKETS; j++) __atomic_store_n(&stats->buckets[j], 0, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&stats_bytes_read, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_bytes_written, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_bytes_relocated, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_zcache_hits, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_zcache_misses, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_cache_hits, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_cache_misses, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_cache_writebacks, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_journal_transactions, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_journal_commits, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_readahead_fills, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_readahead_hits, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_readahead_bytes, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_io_requests, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_io_calls, 0, __ATOMIC_RELAXED);
+	}
+	else {
+		errno = EISDIR;
+		return -errno;
+	}
+	return size;
+}
 
-	/*Root directory pointer also seems to follow both endian. poses a problem for resizing
-	 *root directory past block 0xFFFFFFFF 
-	 */
-	unsigned char rdb_char[8] = {nb_char[0], nb_char[1], nb_char[2], nb_char[3], nb_char[3], nb_char[2], nb_char[1], nb_char[0]};
-	printf("%s !!!!!!! \n", directory->name);
-	if (strcmp(directory->name, ".") == 0) {
-		printf("enter rdb rewrite!!!! \n");
-		rewind(image);
-		fseek(image, 0x8098, SEEK_SET);
-		fwrite(rdb_char, 8, 1, image);
-		fseek(image, 0xff8, SEEK_CUR);
-		fwrite(rdb_char, 8, 1, image);
-		fseek(image, 0x1f78, SEEK_CUR);
-		fwrite(nb_char, 8, 1, image);
-		rewind(image);
-		fseek(image, new_block*BLOCK_SIZE, SEEK_SET);
-		fseek(image, 104, SEEK_CUR);
-		fwrite(nb_char, 8, 1, image);
-	}
-	// should be always true? 
-	if ((new_block*BLOCK_SIZE + size + BLOCK_SIZE-1) / BLOCK_SIZE > free_space_pointer) {
-			free_space_pointer = (new_block*BLOCK_SIZE+size+BLOCK_SIZE-1)/BLOCK_SIZE+1;
-	}	
+// caller holds table_lock
+static void redsea_file_attributes(struct redsea_file* file, struct stat* st) {
+	pthread_rwlock_rdlock(&file->parent->lock);
+	unsigned long long int expanded_size = expanded_file_size(file, NULL);
+	if (file->staged != NULL) st->st_size = file->staged->size;
+	else st->st_size = expanded_size != -1 ? expanded_size : file->size;
+	st->st_mtime = cdate_to_unix(file->mod_date);
+	pthread_rwlock_unlock(&file->parent->lock);
+	st->st_mode = S_IFREG | 0644;
+	st->st_nlink = 2;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
 }
 
-void write_file(struct redsea_file* file, const char* buffer, size_t size, off_t offset) {
-	unsigned long long int end_after = (((size+offset)-file->size) + file->block*BLOCK_SIZE + file->size + BLOCK_SIZE-1) / BLOCK_SIZE;
-	unsigned long long int end_before = (file->size + file->block*BLOCK_SIZE + BLOCK_SIZE-1) / BLOCK_SIZE;
-	if (end_after > end_before && (end_before < free_space_pointer-1)) {
-		printf("MOVED TO END OF IMAGE !!! \n");
-		move_file_to_end(file);
-	}
-	else printf("NOT MOVED TO END OF IMAGE !!! \n");
-	printf("%#x %#x\n", (((size + offset)-file->size) + file->block*BLOCK_SIZE + file->size + BLOCK_SIZE-1) / BLOCK_SIZE, free_space_pointer);
-	unsigned long long int block = file -> block;
-	rewind(image);
-	fseek(image, block*BLOCK_SIZE, SEEK_SET);
-	fseek(image, offset, SEEK_CUR);
-	fwrite(buffer, size, 1, image);
+static void redsea_directory_attributes(struct redsea_directory* directory, struct stat* st) {
+	st->st_size = directory->size;
+	st->st_mtime = cdate_to_unix(directory->mod_date);
+	st->st_mode = S_IFDIR | 0755;
+	st->st_nlink = 2;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+}
 
-	// is this check unnecessary after properly implementing truncate? I think so? I'll leave it in.
-	if ((size+offset) > file->size) {
-		file->size += (size+offset)-file->size;			// set file size
+static void fuse_rs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	struct stat st;
+	memset(&st, 0, sizeof(struct stat));
+	st.st_ino = ino;
+	const char* control = control_inode_path(ino);
+	if (control != NULL) {
+		int ret = control_attributes(control, &st);
+		if (ret < 0) fuse_reply_err(req, -ret);
+		else fuse_reply_attr(req, &st, 0);			// sizes change whenever
+		return;
 	}
-	long long int unix_time = time(NULL);
-	unsigned long long int CDate = unix_to_cdate(unix_time);
-
-	file->mod_date = CDate;
+	unsigned long long int start = stats_clock();
+	struct redsea_file* file;
+	struct redsea_directory* directory;
+	pthread_rwlock_rdlock(&table_lock);
+	bool found = inode_object(ino, &file, &directory);
+	if (file != NULL) redsea_file_attributes(file, &st);
+	else if (directory != NULL) redsea_directory_attributes(directory, &st);
+	pthread_rwlock_unlock(&table_lock);
+	stats_record(STATS_GETATTR, start, !found);
+	if (!found) fuse_reply_err(req, ENOENT);
+	else fuse_reply_attr(req, &st, options.attr_timeout);
+}
 
-	unsigned char size_char[8] = {file->size & 0xff, (file->size >> 8) & 0xff, (file->size >> 16) & 0xff, (file->size>>24) & 0xff,
-		(file->size>>32) & 0xff, (file->size >> 40) & 0xff, (file->size >> 48) & 0xff, (file->size >> 56) & 0xff};
-	unsigned char cdate_char[8] = {CDate & 0xff, (CDate >> 8) & 0xff, (CDate >> 16) & 0xff, (CDate >> 24) & 0xff, (CDate >> 32) & 0xff,
-		(CDate >> 40) & 0xff, (CDate >> 48) & 0xff, (CDate >> 56) & 0xff};
-	rewind(image);
-	fseek(image, file->parent->block*BLOCK_SIZE, SEEK_SET);
-	fseek(image, file->seek_to+48, SEEK_CUR);
-	fwrite(size_char, 8, 1, image);
-	fwrite(cdate_char, 8, 1, image);
-	fseek(image, 0, SEEK_END);
-	
-	if ((block*BLOCK_SIZE + file->size + BLOCK_SIZE-1) / BLOCK_SIZE >= free_space_pointer) {
-		free_space_pointer = (block*BLOCK_SIZE+file->size-BLOCK_SIZE-1)/BLOCK_SIZE+1;
+/* The directory ino refers to with its children read in. Returns with
+ * table_lock read locked, or NULL and unlocked with err set
+ */
+static struct redsea_directory* loaded_directory(fuse_ino_t ino, int* err) {
+	struct redsea_file* file;
+	struct redsea_directory* directory;
+	pthread_rwlock_rdlock(&table_lock);
+	for (int pass = 0; pass < 2; pass++) {
+		if (!inode_object(ino, &file, &directory)) {
+			pthread_rwlock_unlock(&table_lock);
+			*err = ENOENT;
+			return NULL;
+		}
+		if (directory == NULL) {
+			pthread_rwlock_unlock(&table_lock);
+			*err = ENOTDIR;
+			return NULL;
+		}
+		if (directory->loaded) return directory;
+		pthread_rwlock_unlock(&table_lock);
+		pthread_rwlock_wrlock(&table_lock);
+		// it might have been deleted while nothing was locked
+		if (inode_object(ino, &file, &directory) && directory != NULL && !directory->loaded) load_directory(directory);
+		pthread_rwlock_unlock(&table_lock);
+		pthread_rwlock_rdlock(&table_lock);
 	}
+	pthread_rwlock_unlock(&table_lock);
+	*err = EIO;
+	return NULL;
+}
 
+// the entry the kernel gets for a file or directory (the other one NULL), caller holds table_lock
+static void fill_entry(struct fuse_entry_param* e, struct redsea_file* file, struct redsea_directory* directory, bool reference) {
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = inode_for(file, directory, reference, &e->generation);
+	if (file != NULL) redsea_file_attributes(file, &e->attr);
+	else redsea_directory_attributes(directory, &e->attr);
+	e->attr.st_ino = e->ino;
+	e->attr_timeout = options.attr_timeout;
+	e->entry_timeout = options.entry_timeout;
 }
 
-/*Rewrite the redsea boot area.
- *Called upon filesystem destruction
+/* Fill in e for name in directory parent, 0 or an errno. reference counts
+ * it as a lookup the kernel now holds
  */
-
-void rewrite_redsea_boot() {
-	fseek(image, 0, SEEK_END);
-	unsigned long long int end = ftell(image);
-	unsigned int end_sector = end / ISO_9660_SECTOR_SIZE;			// this number is only 32 bit which puts a
-										// limitation on ISO.C files with redsea, which can
-										// theoretically support much larger filesystems.
-										// You should never have a redsea fs that large though.
-										// That's not what RedSea is for
-	unsigned long long int end_block = end / BLOCK_SIZE - 0x58;		// minus 0x58 for start block
-	printf("EOF SECTOR: %#x\n", end);
-	
-	// ISO 9660 is both little AND big endian 
-	unsigned char ISO_9660_buffer[8] = {end_sector & 0xff, (end_sector >> 8) & 0xff, (end_sector >> 16) & 0xff, 
-		(end_sector >> 24) & 0xff, (end_sector >> 24) & 0xff, (end_sector >> 16) & 0xff, (end_sector >> 8) & 0xff, end_sector & 0xff};
-	rewind(image);
-	fseek(image, 0x8050, SEEK_SET);
-	fwrite(ISO_9660_buffer, 8, 1, image);
-	fseek(image, 0xff8, SEEK_CUR);		// to 0x9050
-	fwrite(ISO_9660_buffer, 8, 1, image);
-	unsigned char rs_buffer[8] = {end_block & 0xff, (end_block >> 8) & 0xff, (end_block >> 16) & 0xff, 
-		(end_block >> 24) & 0xff, (end_block >> 32) & 0xff, (end_block >> 40) & 0xff, (end_block >> 48) & 0xff, (end_block >> 56) & 0xff};
-	fseek(image, 0x1fa8, SEEK_CUR);		// to 0xB000
-	fseek(image, 16, SEEK_CUR);
-	fwrite(rs_buffer, 8, 1, image);
-}
-
-unsigned long long int find_free_dir_entry(struct redsea_directory* directory) {
-	unsigned long long int free_pos = directory->block*BLOCK_SIZE;
-	rewind(image);
-	fseek(image, free_pos, SEEK_SET);
-	fseek(image, 128, SEEK_CUR);
-	for (int i = 0; i < directory->num_children; i++) {
-		uint16_t filetype;
-		fread(&filetype, 2, 1, image);
-		if ((filetype >> 8) & 1 == 1) {			// if file is deleted it is free
-			fseek(image, -2, SEEK_CUR);
-			break;
+static int redsea_lookup(fuse_ino_t parent, const char* name, struct fuse_entry_param* e, bool reference) {
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	const char* control = control_inode_path(parent);
+	if (parent == FUSE_ROOT_ID || control != NULL) {
+		char path[64];
+		snprintf(path, sizeof(path), "%s/%s", control != NULL ? control : "", name);
+		for (fuse_ino_t ino = CONTROL_DIR_INO; ino < FIRST_FREE_INO; ino++) {
+			if (strcmp(path, control_paths[ino]) == 0) {
+				e->ino = ino;
+				e->attr.st_ino = ino;
+				e->entry_timeout = options.entry_timeout;
+				return -control_attributes(path, &e->attr);
+			}
 		}
-		fseek(image, 62, SEEK_CUR);
+		if (control != NULL) return ENOENT;
 	}
-	free_pos = ftell(image);
-	return free_pos;
+	int err;
+	struct redsea_directory* directory = loaded_directory(parent, &err);
+	if (directory == NULL) return err;
+	uintptr_t child = child_lookup(directory, name);
+	if (child != 0) fill_entry(e, child_file(child), child_directory(child), reference);
+	pthread_rwlock_unlock(&table_lock);
+	return e->ino == 0 ? ENOENT : 0;
 }
 
-unsigned long long int add_entry_to_dir(struct redsea_directory* directory, uint16_t attributes, unsigned char* name, unsigned long long int block, unsigned long long int size, unsigned long long int timestamp) {
-	unsigned long long int next_free = find_free_dir_entry(directory);
-
-	// I should really just write a function to do this work for me..	
-	unsigned char att_buf[2] = {attributes & 0xff, (attributes >> 8) & 0xff};
-	unsigned char block_buf[8] = {block & 0xff, (block >> 8) & 0xff, (block >> 16) & 0xff, (block >> 24) & 0xff, (block >> 32) & 0xff, (block >> 40) & 0xff,
-		(block >> 48) & 0xff, (block >> 56) & 0xff};
-	unsigned char size_buf[8] = {size & 0xff, (size >> 8) & 0xff, (size >> 16) & 0xff, (size >> 24) & 0xff, (size >> 32) & 0xff, (size >> 40) & 0xff,
-		(size >> 48) & 0xff, (size  >> 56) & 0xff};
-	unsigned char timestamp_buf[8] = {timestamp & 0xff, (timestamp >> 8) & 0xff, (timestamp >> 16) & 0xff, (timestamp >> 24) & 0xff, (timestamp >> 32) & 0xff, (timestamp >> 40) & 0xff,
-		(timestamp >> 48) & 0xff, (timestamp >> 56) & 0xff};
-	rewind(image);
-	fseek(image, next_free, SEEK_SET);
-	fwrite(att_buf, 2, 1, image);
-	unsigned char* name_buf = calloc(38, 1);
-	strcpy(name_buf, name);
-	fwrite(name_buf, 38, 1, image);
-	fwrite(block_buf, 8, 1, image);
-	fwrite(size_buf, 8, 1, image);
-	fwrite(timestamp_buf, 8, 1, image);
-	
-	// if directory
-	if ((attributes >> 4) & 1 == 1) {
-		printf("DIR!!!\n");
-		rewind(image);
-		fseek(image, block*BLOCK_SIZE, SEEK_SET);
-		fwrite(att_buf, 2, 1, image);
-		fwrite(name_buf, 38, 1, image);
-		fwrite(block_buf, 8, 1, image);
-		fwrite(size_buf, 8, 1, image);
-		fwrite(timestamp_buf, 8, 1, image);
-		rewind(image);
-		fseek(image, directory->block*BLOCK_SIZE, SEEK_SET);
-		unsigned char* parent_buf = calloc(64, 1);
-		fread(parent_buf, 64, 1, image);
-		rewind(image);
-		fseek(image, block*BLOCK_SIZE, SEEK_SET);
-		fseek(image, 64, SEEK_CUR);
-		fwrite(parent_buf, 64, 1, image);
-		fseek(image, -62, SEEK_CUR);
-		unsigned char* par_name_buf = calloc(38,1);
-		strcpy(par_name_buf, "..");
-		fwrite(par_name_buf, 38, 1, image);
-		fseek(image, 8, SEEK_CUR);
-		unsigned char* blank = calloc(8, 1);
-		fwrite(blank, 8, 1, image);
-		free(blank);
-		// overwrite anything after so no tos errors occur
-		blank = calloc(0x180, 1);
-		fseek(image, 8, SEEK_CUR);
-		fwrite(blank, 0x180, 1, image);
-		free(parent_buf);
-		free(par_name_buf);
-		free(blank);
-	}
-	else {
-		printf("FILE!!!\n");
+static void fuse_rs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+	struct fuse_entry_param e;
+	unsigned long long int start = stats_clock();
+	int err = redsea_lookup(parent, name, &e, true);
+	stats_record(STATS_LOOKUP, start, err != 0);
+	if (err == ENOENT) {
+		// ino 0 lets the kernel remember it's not there
+		e.ino = 0;
+		e.entry_timeout = options.entry_timeout;
+		fuse_reply_entry(req, &e);
 	}
-
-	free(name_buf);
-
-	return next_free - directory->block*BLOCK_SIZE;
-
+	else if (err != 0) fuse_reply_err(req, err);
+	else fuse_reply_entry(req, &e);
 }
 
-static int fuse_rs_file_attributes(const char *path, struct stat *st) {
+static void fuse_rs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+	inode_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
 
-	if (strncmp(path, "/.Trash", 7) == 0) {
-		errno = ENOENT;
-		return -errno;
+static void fuse_rs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets) {
+	for (size_t i = 0; i < count; i++) inode_forget(forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
 
-	}
+/* Listing
+ * opendir takes a copy of the names so a listing that takes several
+ * readdirs doesn't skip or repeat anything when the directory changes in
+ * between. Offsets are positions in it, 0 and 1 are . and ..
+ */
+struct directory_listing {
+	unsigned long long int count;
+	char** names;
+};
 
-	else if (strcmp(path, "/") == 0 || is_directory(path)) {
-		unsigned long long int did = directory_position(path);			// did is Directory ID
-		if (did == -1) return -1;
-		st->st_size = directory_structs[did]->size;
-		st->st_mtime = cdate_to_unix(directory_structs[did]->mod_date);
-		st->st_mode = S_IFDIR | 0755;
-		st->st_nlink = 2;
-		
+static void fuse_rs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	struct directory_listing* listing = malloc(sizeof(struct directory_listing));
+	if (ino == CONTROL_DIR_INO) {
+		listing->count = 2;
+		listing->names = malloc(sizeof(char*)*2);
+		listing->names[0] = strdup("compact");
+		listing->names[1] = strdup("stats");
 	}
 	else {
-		unsigned long long int fid = file_position(path);			// fid is File ID
-		if (fid == -1) {
-			errno = ENOENT;
-			return -errno;	
+		int err;
+		struct redsea_directory* directory = loaded_directory(ino, &err);
+		if (directory == NULL) {
+			free(listing);
+			fuse_reply_err(req, err);
+			return;
 		}
-		else {
-			st->st_size = file_structs[fid]->size;
-			st->st_mtime = cdate_to_unix(file_structs[fid]->mod_date);
-			st-> st_mode = S_IFREG | 0644;
-			st-> st_nlink = 2;
+		listing->count = 0;
+		listing->names = malloc(sizeof(char*)*(directory->num_children + 1));
+		for (unsigned int i = 0; i < directory->children_capacity; i++) {
+			uintptr_t child = directory->children[i];
+			if (child != 0 && child != CHILD_TOMBSTONE) listing->names[listing->count++] = strdup(child_name(child));
 		}
+		pthread_rwlock_unlock(&table_lock);
 	}
-	//st->st_size = 512;
-	st->st_uid = getuid();
-	st->st_gid = getgid();
-	return 0;
+	fi->fh = (uintptr_t) listing;
+	fuse_reply_open(req, fi);
+}
+
+static void fuse_rs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	struct directory_listing* listing = (struct directory_listing*)(uintptr_t) fi->fh;
+	for (unsigned long long int i = 0; i < listing->count; i++) free(listing->names[i]);
+	free(listing->names);
+	free(listing);
+	fuse_reply_err(req, 0);
 }
 
-static int fuse_rs_read_directory(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	filler(buffer, ".", NULL, 0);
-	filler(buffer, "..", NULL, 0);
-	unsigned long long int did = directory_position(path);				// did is Directory ID
-	unsigned long long int num_children = directory_structs[did]->num_children;
-	if (did==-1) return -1;
-	for (int j = 0; j<num_children; j++) {
-		filler(buffer, directory_structs[did]->children[j], NULL, 0);
+// readdir and readdirplus, plus hands the kernel an entry for each name like lookup would
+static void redsea_read_directory(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi, bool plus) {
+	unsigned long long int start = stats_clock();
+	struct directory_listing* listing = (struct directory_listing*)(uintptr_t) fi->fh;
+	char* buffer = malloc(size);
+	size_t used = 0;
+	for (unsigned long long int i = offset; i < listing->count + 2; i++) {
+		const char* name = i == 0 ? "." : i == 1 ? ".." : listing->names[i-2];
+		struct fuse_entry_param e;
+		if (i < 2) {
+			memset(&e, 0, sizeof(struct fuse_entry_param));
+			e.attr.st_ino = ino;
+			e.attr.st_mode = S_IFDIR;
+		}
+		else if (redsea_lookup(ino, name, &e, plus) != 0) continue;		// deleted since opendir
+		size_t length;
+		if (plus) length = fuse_add_direntry_plus(req, buffer + used, size - used, name, &e, i + 1);
+		else length = fuse_add_direntry(req, buffer + used, size - used, name, &e.attr, i + 1);
+		if (length > size - used) {
+			// didn't fit, the kernel never saw it
+			if (plus && e.ino != 0) inode_forget(e.ino, 1);
+			break;
+		}
+		used += length;
 	}
-	printf("FREE_POS: %#x\n", find_free_dir_entry(directory_structs[did]));
-	return 0;
+	fuse_reply_buf(req, buffer, used);
+	free(buffer);
+	stats_record(STATS_READDIR, start, false);
 }
 
-static int fuse_rs_read_file(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	unsigned long long int fid = file_position(path);
-	if (fid == -1) return -1;
-	unsigned char* file_contents;
+static void fuse_rs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+	redsea_read_directory(req, ino, size, offset, fi, false);
+}
+
+static void fuse_rs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+	redsea_read_directory(req, ino, size, offset, fi, true);
+}
+
+/* The file ino refers to. Caller holds table_lock, NULL with err set if
+ * it's not a file (anymore)
+ */
+static struct redsea_file* inode_file(fuse_ino_t ino, int* err) {
+	struct redsea_file* file;
+	struct redsea_directory* directory;
+	if (!inode_object(ino, &file, &directory)) *err = ENOENT;
+	else if (file == NULL) *err = EISDIR;
+	return file;
+}
+
+/* Splicing
+ * a plain file is one contiguous range of the image, so reads hand libfuse
+ * the image fd and an offset and the data gets spliced from the image
+ * straight into /dev/fuse, and writes that land inside the file's extent
+ * get spliced from the request pipe straight into the image. Without
+ * splice (nosplice, or a kernel that can't) reads still reply straight out
+ * of the mapping. -o direct turns splicing off since it goes through the
+ * page cache, reads are bounced through an O_DIRECT read instead. The reply
+ * is sent with the directory read locked so the file can't be moved out
+ * from under it by compaction or another file growing. Staged, expanded
+ * and delayed files are in memory already and take the normal path.
+ */
+bool splice_enabled = false;		// set in init once the kernel agreed
 
-	file_contents = redsea_file_content(file_structs[fid], size, offset);
-	memcpy(buffer, file_contents, size);
-	free(file_contents);
+// replies itself unless it fails
+static int redsea_read_file(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct open_file* open) {
+	int err;
+	pthread_rwlock_rdlock(&table_lock);
+	struct redsea_file* file = inode_file(ino, &err);
+	if (file == NULL) {
+		pthread_rwlock_unlock(&table_lock);
+		return -err;
+	}
+
+	pthread_rwlock_rdlock(&file->parent->lock);
+	int type;
+	unsigned long long int expanded_size = file->staged == NULL ? expanded_file_size(file, &type) : -1;
+	if (file->staged != NULL) {
+		if (offset >= file->staged->size) size = 0;
+		else if (offset + size > file->staged->size) size = file->staged->size - offset;
+		fuse_reply_buf(req, (char*)file->staged->data + offset, size);
+	}
+	else if (expanded_size != -1) {
+		char* buffer = malloc(size ? size : 1);
+		int ret = expanded_read(file, expanded_size, type, buffer, size, offset);
+		if (ret >= 0) fuse_reply_buf(req, buffer, ret);
+		free(buffer);
+		size = ret;
+	}
+	else if (splice_enabled && file->delayed == NULL) {
+		if (offset >= file->size) size = 0;
+		else if (offset + size > file->size) size = file->size - offset;
+		readahead_buffered(open, file, offset, size);
+		struct fuse_bufvec data = FUSE_BUFVEC_INIT(size);
+		data.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		data.buf[0].fd = image_fd;
+		data.buf[0].pos = file->block*BLOCK_SIZE + offset;
+		fuse_reply_data(req, &data, FUSE_BUF_SPLICE_MOVE);
+	}
+	else if (direct_fd != -1 && file->delayed == NULL) {
+		if (offset >= file->size) size = 0;
+		else if (offset + size > file->size) size = file->size - offset;
+		char* buffer = malloc(size ? size : 1);
+		readahead_direct(open, file, buffer, size, offset);
+		fuse_reply_buf(req, buffer, size);
+		free(buffer);
+	}
+	else {
+		unsigned char* file_contents = redsea_file_content(file, &size, offset);
+		if (file->delayed == NULL) readahead_buffered(open, file, offset, size);
+		fuse_reply_buf(req, file_contents, size);
+	}
+	pthread_rwlock_unlock(&file->parent->lock);
+	pthread_rwlock_unlock(&table_lock);
 
 	return size;	
 }
 
-static int fuse_rs_unlink_file(const char* path) {
+static void fuse_rs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+	const char* control = control_inode_path(ino);
+	if (control != NULL) {
+		char* buffer = malloc(size ? size : 1);
+		int ret = control_read(control, buffer, size, offset);
+		if (ret < 0) fuse_reply_err(req, -ret);
+		else fuse_reply_buf(req, buffer, ret);
+		free(buffer);
+		return;
+	}
+	unsigned long long int start = stats_clock();
+	int ret = redsea_read_file(req, ino, size, offset, (struct open_file*)(uintptr_t) fi->fh);
+	if (ret < 0) fuse_reply_err(req, -ret);
+	else stats_add(&stats_bytes_read, ret);
+	stats_record(STATS_READ, start, ret < 0);
+}
+
+static int redsea_unlink_file(const char* path) {
 	unsigned long long int fid = file_position(path);
-	printf("FID: %lld !!!!!!!\n");
 	if (fid == -1) {
-		if (directory_position(path) != -1) errno = EISDIR;
+		errno = directory_position(path) != -1 ? EISDIR : ENOENT;
 		return -errno;
 	}
 	struct redsea_file* file = file_structs[fid];
@@ -669,12 +4178,13 @@ static int fuse_rs_unlink_file(const char* path) {
 	struct redsea_directory* parent = file -> parent;
 	unsigned long long int seek_to = file -> seek_to;	
 	if (redsea_remove_common(parent, seek_to, name) == -1) return -1;
+	discard_delayed_allocation(file);
+	drop_expanded(file);
+	free_staged(file);
+	release_blocks(file->block, file_blocks(file));
 
-	for (unsigned long long int i = fid; i<file_count; i++) {
-		file_structs[i]=file_structs[i+1];
-		file_paths[i]=file_paths[i+1];
-	}
-	file_count--;
+	inode_deleted(&file->ino);
+	remove_file_position(fid);
 
 	return 0;
 }
@@ -684,7 +4194,7 @@ static int fuse_rs_unlink_file(const char* path) {
  * as deleted. TempleOS still recognizes it though, so it
  * should be fine.
  */
-static int fuse_rs_rmdir(const char* path) {
+static int redsea_rmdir(const char* path) {
 	unsigned long long int did = directory_position(path);
 	if (did == -1) {
 		errno = ENOTDIR;
@@ -700,74 +4210,434 @@ static int fuse_rs_rmdir(const char* path) {
 	unsigned long long int seek_to = directory -> seek_to;
 
 	if (redsea_remove_common(parent, seek_to, name) == -1) return -1;
+	release_blocks(directory->block, directory->size/BLOCK_SIZE);
 
-	for (unsigned long long int i = did; i<directory_count; i++) {
-		directory_structs[i]=directory_structs[i+1];
-		directory_paths[i]=directory_paths[i+1];
-	}
-	directory_count--;
+	inode_deleted(&directory->ino);
+	remove_directory_position(did);
 
 	return 0;
 
 }
 
-// Both of the below functions just return 0. Unneccesary for redsea
-static int fuse_rs_open_file(const char* path, struct fuse_file_info* fi) {
-	return 0;
+// caller holds the directory write locked
+static int write_locked(struct redsea_file* file, const char* buffer, size_t size, off_t offset) {
+	if (stages_writes(file)) {
+		if (!stage_file(file, -1)) {
+			errno = EIO;
+			return -errno;
+		}
+		write_staged(file, buffer, size, offset);
+	}
+	else write_file(file, buffer, size, offset);
+	return size;
+}
+
+/* In place if the file's extent has room (or can grow into the blocks
+ * after it), otherwise it's copied out of the request and goes through
+ * write_file like always, see Splicing
+ */
+static int redsea_write_buf(fuse_ino_t ino, struct fuse_bufvec* data, off_t offset) {
+	int err;
+	size_t size = fuse_buf_size(data);
+	pthread_rwlock_rdlock(&table_lock);
+	struct redsea_file* file = inode_file(ino, &err);
+	if (file == NULL) {
+		pthread_rwlock_unlock(&table_lock);
+		return -err;
+	}
+	pthread_rwlock_wrlock(&file->parent->lock);
+	file_data_changed();
+	int ret;
+	if (stages_writes(file) || file->delayed != NULL || (offset + size > file->size && !resize_file_extent(file, offset + size, false))) {
+		char* buffer = malloc(size ? size : 1);
+		struct fuse_bufvec copy = FUSE_BUFVEC_INIT(size);
+		copy.buf[0].mem = buffer;
+		ret = fuse_buf_copy(&copy, data, 0);
+		if (ret > 0) ret = write_locked(file, buffer, ret, offset);
+		free(buffer);
+	}
+	else {
+		// blocks picked up from a hole hold whatever was there before
+		if (offset > file->size) {
+			unsigned char* blank = calloc(offset - file->size, 1);
+			image_write(blank, offset - file->size, file->block*BLOCK_SIZE + file->size);
+			free(blank);
+		}
+		unsigned long long int position = file->block*BLOCK_SIZE + offset;
+		if (direct_fd != -1) {
+			// it has to go through Direct I/O (or the Block cache), copying fd to fd would be buffered
+			char* buffer = malloc(size ? size : 1);
+			struct fuse_bufvec copy = FUSE_BUFVEC_INIT(size);
+			copy.buf[0].mem = buffer;
+			ret = fuse_buf_copy(&copy, data, 0);
+			if (ret > 0) image_write(buffer, ret, position);
+			free(buffer);
+		}
+		else {
+			struct fuse_bufvec image = FUSE_BUFVEC_INIT(size);
+			image.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			image.buf[0].fd = image_fd;
+			image.buf[0].pos = position;
+			ret = fuse_buf_copy(&image, data, FUSE_BUF_SPLICE_MOVE);
+			if (ret > 0 && position + ret > image_size()) image_remap();
+		}
+		if (ret > 0) {
+			if (offset + ret > file->size) file->size = offset + ret;
+			file->mod_date = unix_to_cdate(time(NULL));
+			file->dirty = true;
+		}
+	}
+	pthread_rwlock_unlock(&file->parent->lock);
+	pthread_rwlock_unlock(&table_lock);
+	return ret;
+}
+
+static void fuse_rs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* data, off_t offset, struct fuse_file_info* fi) {
+	int ret;
+	const char* control = control_inode_path(ino);
+	if (control != NULL) ret = control_write(control, fuse_buf_size(data));
+	else {
+		unsigned long long int start = stats_clock();
+		ret = redsea_write_buf(ino, data, offset);
+		if (ret > 0) stats_add(&stats_bytes_written, ret);
+		stats_record(STATS_WRITE, start, ret < 0);
+	}
+	if (ret < 0) fuse_reply_err(req, -ret);
+	else fuse_reply_write(req, ret);
 }
 
-static int fuse_rs_open_dir(const char* path, struct fuse_file_info* fi) {
+/* write out delayed data and the entry for ino. flush, release and fsync
+ * all end up here. Returns the file if it has staged contents that still
+ * need compressing, NULL otherwise
+ */
+static struct redsea_file* redsea_commit(fuse_ino_t ino) {
+	int err;
+	pthread_rwlock_rdlock(&table_lock);
+	struct redsea_file* file = inode_file(ino, &err);
+	if (file == NULL) {
+		pthread_rwlock_unlock(&table_lock);
+		return NULL;
+	}
+	pthread_rwlock_wrlock(&file->parent->lock);
+	commit_delayed_allocation(file);
+	if (file->dirty) write_back_entry(file);
+	bool staged = file->staged != NULL;
+	pthread_rwlock_unlock(&file->parent->lock);
+	pthread_rwlock_unlock(&table_lock);
+	return staged ? file : NULL;
+}
+
+/* write back the Block cache chunks holding ino's data and its entry. only
+ * what this file touched, the rest of the cache is left to fsync and the
+ * writeback thread so a close doesn't cost more the more is cached
+ */
+static void redsea_flush_cache(fuse_ino_t ino) {
+	if (cache_shards == NULL || __atomic_load_n(&cache_dirty_chunks, __ATOMIC_ACQUIRE) == 0) return;
+	int err;
+	pthread_rwlock_rdlock(&table_lock);
+	struct redsea_file* file = inode_file(ino, &err);
+	if (file != NULL) {
+		pthread_rwlock_rdlock(&file->parent->lock);
+		if (file->block != 0xFFFFFFFFFFFFFFFF) cache_flush_range(file->block*BLOCK_SIZE, file_blocks(file)*BLOCK_SIZE);
+		cache_flush_range(file->parent->block*BLOCK_SIZE + file->seek_to, 64);
+		pthread_rwlock_unlock(&file->parent->lock);
+	}
+	pthread_rwlock_unlock(&table_lock);
+}
+
+static void fuse_rs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	if (control_inode_path(ino) == NULL) {
+		redsea_commit(ino);
+		redsea_flush_cache(ino);
+	}
+	fuse_reply_err(req, 0);
+}
+
+static void fuse_rs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	if (control_inode_path(ino) == NULL) {
+		struct redsea_file* staged = redsea_commit(ino);
+		if (staged != NULL) queue_compression(staged);
+		open_file_free((struct open_file*)(uintptr_t) fi->fh);
+	}
+	fuse_reply_err(req, 0);
+}
+
+// entries live in the same image as the data so there's no metadata only case, datasync just skips the inode times
+static void fuse_rs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi) {
+	if (control_inode_path(ino) == NULL) {
+		struct redsea_file* staged = redsea_commit(ino);
+		if (staged != NULL) compress_staged(staged);
+	}
+	int err = journal_sync() ? 0 : EIO;
+	if (image_sync(datasync) != 0) err = errno;
+	fuse_reply_err(req, err);
+}
+
+// directory entries are written as they change, only the image (and the journal) needs syncing
+static void fuse_rs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi) {
+	int err = journal_sync() ? 0 : EIO;
+	if (image_sync(datasync) != 0) err = errno;
+	fuse_reply_err(req, err);
+}
+
+/* fallocate
+ * reserves a contiguous extent big enough for offset+length up front so
+ * the writes that follow land in place and never move the file. With
+ * FALLOC_FL_KEEP_SIZE the size stays put, otherwise it grows (zero filled)
+ * like posix_fallocate. The reservation only lives in memory, RedSea has
+ * nowhere to keep it so after a remount the blocks past the size are free
+ * again. Punching holes and the like makes no sense for contiguous files.
+ */
+static int redsea_fallocate(fuse_ino_t ino, int mode, off_t offset, off_t length) {
+	if (mode & ~FALLOC_FL_KEEP_SIZE) {
+		errno = EOPNOTSUPP;
+		return -errno;
+	}
+	if (offset < 0 || length <= 0) {
+		errno = EINVAL;
+		return -errno;
+	}
+	int err;
+	pthread_rwlock_rdlock(&table_lock);
+	struct redsea_file* file = inode_file(ino, &err);
+	if (file == NULL) {
+		pthread_rwlock_unlock(&table_lock);
+		return -err;
+	}
+	pthread_rwlock_wrlock(&file->parent->lock);
+	file_data_changed();
+	unsigned long long int end = offset + length;
+	if (stages_writes(file)) {
+		// the compressed size isn't known until it's compressed, nothing to reserve
+		bool ok = stage_file(file, -1);
+		if (ok && !(mode & FALLOC_FL_KEEP_SIZE) && end > file->staged->size) truncate_staged(file, end);
+		pthread_rwlock_unlock(&file->parent->lock);
+		pthread_rwlock_unlock(&table_lock);
+		if (!ok) errno = EIO;
+		return ok ? 0 : -errno;
+	}
+	commit_delayed_allocation(file);
+	grow_file_blocks(file, blocks_for(end), true);
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > file->size) {
+		unsigned char* blank = calloc(end - file->size, 1);
+		image_write(blank, end - file->size, file->block*BLOCK_SIZE + file->size);
+		free(blank);
+		file->size = end;
+		write_back_entry(file);
+	}
+	pthread_rwlock_unlock(&file->parent->lock);
+	pthread_rwlock_unlock(&table_lock);
 	return 0;
 }
 
-static int fuse_rs_write(const char* path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) {
-	unsigned long long int fid = file_position(path);
-	if (fid == -1) return -1;
-	write_file(file_structs[fid], buffer, size, offset);
-	return size;
+static void fuse_rs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info* fi) {
+	int ret = control_inode_path(ino) != NULL ? -EPERM : redsea_fallocate(ino, mode, offset, length);
+	fuse_reply_err(req, -ret);
 }
 
-static int fuse_rs_truncate(const char* path, off_t length) {
+static int redsea_truncate(fuse_ino_t ino, off_t length) {
 
 	/* It seems that I forgot the proper reasons for truncate to exist when I
 	 * release this last time. :(
 	 * Corrupted files shouldn't be an issue anymore
 	 */	
-	unsigned long long int fid = file_position(path);
-	struct redsea_file* file = file_structs[fid];
+	int err;
+	pthread_rwlock_rdlock(&table_lock);
+	struct redsea_file* file = inode_file(ino, &err);
+	if (file == NULL) {
+		pthread_rwlock_unlock(&table_lock);
+		return -err;
+	}
 	
+	pthread_rwlock_wrlock(&file->parent->lock);
+	file_data_changed();
+	if (stages_writes(file)) {
+		bool ok = stage_file(file, length);
+		if (ok) truncate_staged(file, length);
+		pthread_rwlock_unlock(&file->parent->lock);
+		pthread_rwlock_unlock(&table_lock);
+		if (!ok) errno = EIO;
+		return ok ? 0 : -errno;
+	}
+	journal_begin();		// the freed tail and the new size go together
+	commit_delayed_allocation(file);
+	unsigned long long int old_size = file->size;
+	resize_file_extent(file, length, true);
 	file->size = length;
+	if (length > old_size) {
+		unsigned char* blank = calloc(length - old_size, 1);
+		image_write(blank, length - old_size, file->block*BLOCK_SIZE + old_size);
+		free(blank);
+	}
 	
-	unsigned char size_char[8] = {length & 0xff, (length >> 8) & 0xff, (length >> 16) & 0xff, (length >> 24) & 0xff,
-		(length >> 32) & 0xff, (length >> 40) & 0xff, (length >> 48) & 0xff, (length >> 56) & 0xff};
-
-	rewind(image);
-	fseek(image, file->parent->block*BLOCK_SIZE, SEEK_SET);
-	fseek(image, file->seek_to, SEEK_CUR);
-	fseek(image, 48, SEEK_CUR);
-	fwrite(size_char, 8, 1, image);
+	write_back_entry(file);
+	journal_end();
+	pthread_rwlock_unlock(&file->parent->lock);
+	pthread_rwlock_unlock(&table_lock);
 	
-	return length;
+	return 0;
+}
+
+static void fuse_rs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	if (control_inode_path(ino) != NULL) {
+		fi->direct_io = 1;		// contents change without the size being asked for again
+		fuse_reply_open(req, fi);
+		return;
+	}
+	int err = 0;
+	pthread_rwlock_rdlock(&table_lock);
+	struct redsea_file* file = inode_file(ino, &err);
+	pthread_rwlock_unlock(&table_lock);
+	if (file != NULL && (fi->flags & O_TRUNC)) {
+		// the kernel leaves O_TRUNC to us instead of sending a setattr
+		int ret = redsea_truncate(ino, 0);
+		if (ret < 0) err = -ret;
+	}
+	if (err != 0) {
+		fuse_reply_err(req, err);
+		return;
+	}
+	fi->keep_cache = 1;			// everything that changes a file comes through here anyway
+	fi->fh = (uintptr_t) open_file_new();
+	fuse_reply_open(req, fi);
+}
+
+// RedSea only has a size and a date, the rest (mode, owner) is accepted and stays what it was
+static int redsea_set_mtime(fuse_ino_t ino, long long int unix_time) {
+	struct redsea_file* file;
+	struct redsea_directory* directory;
+	pthread_rwlock_rdlock(&table_lock);
+	if (!inode_object(ino, &file, &directory)) {
+		pthread_rwlock_unlock(&table_lock);
+		return -ENOENT;
+	}
+	if (file != NULL) {
+		pthread_rwlock_wrlock(&file->parent->lock);
+		file->mod_date = unix_to_cdate(unix_time);
+		write_back_entry(file);
+		pthread_rwlock_unlock(&file->parent->lock);
+	}
+	pthread_rwlock_unlock(&table_lock);
+	return 0;
 }
 
-static void fuse_rs_destroy() {
-	rewind(image);
-	fseek(image, 0, SEEK_END);
-	int padding = 2048-ftell(image)%2048;
-	printf("END PADDING: %#x \n", padding);
+static void fuse_rs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi) {
+	int ret = 0;
+	// echo > /.redsea/compact truncates first, that's fine
+	if (control_inode_path(ino) == NULL) {
+		if (to_set & FUSE_SET_ATTR_SIZE) ret = redsea_truncate(ino, attr->st_size);
+		if (ret == 0 && (to_set & FUSE_SET_ATTR_MTIME_NOW)) ret = redsea_set_mtime(ino, time(NULL));
+		else if (ret == 0 && (to_set & FUSE_SET_ATTR_MTIME)) ret = redsea_set_mtime(ino, attr->st_mtime);
+	}
+	if (ret < 0) fuse_reply_err(req, -ret);
+	else fuse_rs_getattr(req, ino, fi);
+}
+
+// space is reported in RedSea blocks. the image can always grow so only holes and the padding at the end count as free,
+// plus whatever the journal is still holding on to until its commit
+static void fuse_rs_statfs(fuse_req_t req, fuse_ino_t ino) {
+	struct statvfs st;
+	memset(&st, 0, sizeof(struct statvfs));
+	ensure_free_map();
+	unsigned long long int image_blocks = image_size() / BLOCK_SIZE;
+	pthread_mutex_lock(&allocator_lock);
+	unsigned long long int free_blocks = free_hole_blocks + __atomic_load_n(&journal_releasing, __ATOMIC_RELAXED);
+	if (image_blocks > free_space_pointer) free_blocks += image_blocks - free_space_pointer;
+	else image_blocks = free_space_pointer;
+	pthread_mutex_unlock(&allocator_lock);
+	st.f_bsize = BLOCK_SIZE;
+	st.f_frsize = BLOCK_SIZE;
+	st.f_blocks = image_blocks;
+	st.f_bfree = free_blocks;
+	st.f_bavail = free_blocks;
+	pthread_rwlock_rdlock(&table_lock);
+	st.f_files = file_count + directory_count;
+	pthread_rwlock_unlock(&table_lock);
+	st.f_namemax = MAX_NAME;
+	fuse_reply_statfs(req, &st);
+}
+
+/* the free map gets built in the background once fuse is up (and has forked if it's going to).
+ * readdirplus is always used, a listing is nearly always followed by
+ * stat-ing everything in it and RedSea has it all in the entry anyway
+ */
+static void fuse_rs_init(void* userdata, struct fuse_conn_info* conn) {
+	if (options.max_write != 0) conn->max_write = options.max_write;
+	if (options.max_read != 0) conn->max_read = options.max_read;
+	if (conn->capable & FUSE_CAP_READDIRPLUS) conn->want |= FUSE_CAP_READDIRPLUS;
+	conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+	if (!options.no_splice && direct_fd == -1) {
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+		splice_enabled = (conn->want & FUSE_CAP_SPLICE_WRITE) != 0;
+	}
+	// libfuse turns splice read on by itself because there's a write_buf
+	else conn->want &= ~(FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	if (!options.sync_io) image_io_setup();
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, free_map_thread, NULL) == 0) pthread_detach(thread);
+	if (options.writeback_interval > 0) {
+		writeback_started = pthread_create(&writeback_thread, NULL, writeback_thread_main, NULL) == 0;
+	}
+	if (options.decompress) {
+		compress_started = pthread_create(&compress_thread, NULL, compress_thread_main, NULL) == 0;
+	}
+	if (journal_fd != -1) {
+		journal_started = pthread_create(&journal_thread, NULL, journal_thread_main, NULL) == 0;
+	}
+}
+
+static void fuse_rs_destroy(void* userdata) {
+	ensure_free_map();			// the scan might still be running, it can't be reading the image when it goes away
+	if (writeback_started) {
+		pthread_mutex_lock(&writeback_lock);
+		writeback_stop = true;
+		pthread_cond_signal(&writeback_cond);
+		pthread_mutex_unlock(&writeback_lock);
+		pthread_join(writeback_thread, NULL);
+	}
+	if (compress_started) {
+		pthread_mutex_lock(&compress_lock);
+		compress_stop = true;
+		pthread_cond_signal(&compress_cond);
+		pthread_mutex_unlock(&compress_lock);
+		pthread_join(compress_thread, NULL);
+	}
+	// whatever's still staged, queued or not
+	for (int i = 0; i < file_count; i++) {
+		if (file_structs[i]->staged != NULL) compress_staged(file_structs[i]);
+	}
+	for (int i = 0; i < file_count; i++) {
+		struct redsea_file* file = file_structs[i];
+		commit_delayed_allocation(file);
+		if (file->dirty) write_back_entry(file);
+		// fallocate reservations only live in memory, the next mount wouldn't know about them
+		unsigned long long int blocks = blocks_for(file->size);
+		if (file->block != 0xFFFFFFFFFFFFFFFF && file->reserved_blocks > blocks) {
+			release_blocks(file->block + blocks, file->reserved_blocks - blocks);
+			file->reserved_blocks = 0;
+		}
+	}
+	journal_sync();			// a directory that moved to the end might not be there yet
+	int padding = 2048-image_length%2048;
+	debug_printf("END PADDING: %#x\n", padding);
 	if (padding != 2048 && padding != 0) {
 		unsigned char* buf = calloc(padding, 1);
-		fwrite(buf, 1, padding, image);
+		image_write(buf, padding, image_length);
+		free(buf);
 	}
 	rewrite_redsea_boot();
-	fclose(image);
+	journal_close();
+	image_io_shutdown();
+	image_sync(false);
+	if (options.index_path != NULL) save_index(options.index_path);
+	image_unmap();
+	if (direct_fd != -1) close(direct_fd);
+	close(image_fd);
 }
 
-static int fuse_rs_create(const char* path, mode_t perms, struct fuse_file_info* fi) {
+static int redsea_create(const char* path, mode_t perms, struct fuse_file_info* fi) {
 	// check if it already exists
-	printf("!!! ENTER RS CREATE !!!\n");
 	unsigned long long int fid = file_position(path);
-	printf("FID: %#x\n", fid);
 	if (fid != -1) {
 		errno = EEXIST;
 		return -errno; 	
@@ -776,10 +4646,8 @@ static int fuse_rs_create(const char* path, mode_t perms, struct fuse_file_info*
 	char* last_slash = strrchr(path, '/');
 
 	int dirlen = last_slash - path;
-	char* directory_path = calloc(dirlen+1,1);
+	char* directory_path = calloc(dirlen+2,1);		// +2 so "/" fits for the root
 	strncpy(directory_path, path, dirlen);
-	
-	fprintf(stderr, "%s\n", directory_path);
 
 	if (strcmp(directory_path, "") == 0) {
 		strncpy(directory_path, "/", 1);
@@ -788,8 +4656,6 @@ static int fuse_rs_create(const char* path, mode_t perms, struct fuse_file_info*
 	unsigned long long int did = directory_position(directory_path);
 
 	if (did == -1) {
-		printf("%s\n", directory_path);
-		printf("ENOENT !!!! \n");
 		errno = ENOENT;
 		return -errno;
 	}
@@ -797,11 +4663,11 @@ static int fuse_rs_create(const char* path, mode_t perms, struct fuse_file_info*
 	struct redsea_directory* parent = directory_structs[did];
 
 	if (parent->num_children+2 >= parent->size/64) {
-		move_directory_to_end(parent);	
+		grow_directory(parent);
 	}
 
 	// if name too long
-	if (strlen(last_slash+1) > 38) {
+	if (strlen(last_slash+1) > MAX_NAME) {
 		errno = ENAMETOOLONG;
 		return -errno;
 	}
@@ -810,9 +4676,8 @@ static int fuse_rs_create(const char* path, mode_t perms, struct fuse_file_info*
 	long long int unix_time = time(NULL);
 	unsigned long long int CDate = unix_to_cdate(unix_time);
 	unsigned long long int size = 0;
-	unsigned long long int block = free_space_pointer;
-	free_space_pointer++;
-	unsigned char* name = calloc(38,1);
+	unsigned long long int block = allocate_blocks(1);
+	unsigned char* name = calloc(MAX_NAME+1, 1);
 	strcpy(name, last_slash+1);
 
 	// if compressed
@@ -823,27 +4688,19 @@ static int fuse_rs_create(const char* path, mode_t perms, struct fuse_file_info*
 	
 	unsigned long long int seek_to = add_entry_to_dir(parent, filetype, name, block, size, CDate);
 	
-	if (file_count+1 > max_file_count) expand_file_array();
-	
-	struct redsea_file* new_file = malloc(sizeof(struct redsea_file));
+	struct redsea_file* new_file = arena_alloc(sizeof(struct redsea_file));
 	new_file -> seek_to = seek_to;
 	strcpy(new_file->name, name);
 	new_file -> size = size;
 	new_file -> block = block;
 	new_file -> mod_date = CDate;
 	new_file -> parent = parent;
+	new_file -> attributes = filetype;
+	// staged from the start so even an empty one gets a header when it's closed
+	if (stages_writes(new_file)) stage_capacity(new_file, 1);
 
-	parent->children[parent->num_children] = malloc(strlen(name)+1);
-	strcpy(parent->children[parent->num_children], name);
-	parent->num_children = parent->num_children+1;
-
-	unsigned char* pathcp = malloc(strlen(path)+1);
-	strcpy(pathcp, path);
-	printf("%s\n", pathcp);
-	file_paths[file_count] = pathcp;
-	file_structs[file_count] = new_file;
-
-	file_count++;
+	add_file_position(new_file);
+	child_insert(parent, new_file, NULL);
 
 	free(name);
 
@@ -857,7 +4714,7 @@ static int fuse_rs_create(const char* path, mode_t perms, struct fuse_file_info*
  * probably make this have some sort of common function.
  */
 
-static int fuse_rs_mkdir(const char* path, mode_t perms) {
+static int redsea_mkdir(const char* path, mode_t perms) {
 	unsigned long long int did = directory_position(path);
 
 	if (strncmp(path, "/.Trash", 7) == 0) {
@@ -873,7 +4730,7 @@ static int fuse_rs_mkdir(const char* path, mode_t perms) {
 	char* last_slash = strrchr(path, '/');
 
 	int parlen = last_slash - path;
-	char* parent_path = calloc(parlen+1, 1);
+	char* parent_path = calloc(parlen+2, 1);		// +2 so "/" fits for the root
 	strncpy(parent_path, path, parlen);
 
 	if (strcmp(parent_path, "") == 0) {
@@ -890,10 +4747,10 @@ static int fuse_rs_mkdir(const char* path, mode_t perms) {
 	struct redsea_directory* parent = directory_structs[pdid];
 
 	if (parent->num_children+2 >= parent->size/64) {
-		move_directory_to_end(parent);	
+		grow_directory(parent);
 	}
 
-	if (strlen(last_slash+1) > 38) {
+	if (strlen(last_slash+1) > MAX_NAME) {
 		errno = ENAMETOOLONG;
 		return -errno;
 	}
@@ -902,9 +4759,8 @@ static int fuse_rs_mkdir(const char* path, mode_t perms) {
 	long long int unix_time = time(NULL);
 	unsigned long long int CDate = unix_to_cdate(unix_time);
 	unsigned long long int size = 512;
-	unsigned long long int block = free_space_pointer;
-	free_space_pointer++;
-	unsigned char* name = calloc(38, 1);
+	unsigned long long int block = allocate_blocks(1);
+	unsigned char* name = calloc(MAX_NAME+1, 1);
 	strcpy(name, last_slash+1);
 
 	filetype += 0x800;	// contiguous
@@ -912,41 +4768,28 @@ static int fuse_rs_mkdir(const char* path, mode_t perms) {
 	
 	unsigned long long int seek_to = add_entry_to_dir(parent, filetype, name, block, size, CDate);
 
-	if (directory_count+1 > max_directory_count) expand_directory_array();
-
-	struct redsea_directory* new_dir = malloc(sizeof(struct redsea_directory));
+	struct redsea_directory* new_dir = arena_alloc(sizeof(struct redsea_directory));
 	new_dir -> seek_to = seek_to;
 	strcpy(new_dir->name, name);
 	new_dir -> size = size;
 	new_dir -> block = block;
 	new_dir -> mod_date = CDate;
 	new_dir -> parent = parent;
-	new_dir -> children = malloc(sizeof(char*)*(size/64));
-	new_dir -> num_children = 0;
-
-	parent->children[parent->num_children] = malloc(strlen(name)+1);
-	strcpy(parent->children[parent->num_children], name);
-	parent->num_children = parent->num_children+1;
-
-	unsigned char* pathcp = malloc(strlen(path)+1);
-	strcpy(pathcp, path);
-	printf("%s\n", pathcp);
-	directory_paths[directory_count] = pathcp;
-	directory_structs[directory_count] = new_dir;
+	new_dir -> loaded = true;
+	new_dir -> next_slot = 2;			// just . and ..
+	pthread_rwlock_init(&new_dir->lock, NULL);
 
-	directory_count++;
+	add_directory_position(new_dir);
+	child_insert(parent, NULL, new_dir);
 
 	free(name);
 	return 0;
 }
 
-static int fuse_rs_rename(const char* path, const char* newpath) {
-	printf("TEST \n");
-
+static int redsea_rename(const char* path, const char* newpath) {
 	unsigned long long int fid = file_position(path);
 	unsigned long long int did = directory_position(path);
 	if (fid == -1 && did == -1) {
-		printf("error????? \n");
 		errno = ENOENT;
 		return -errno;
 	}
@@ -956,117 +4799,318 @@ static int fuse_rs_rename(const char* path, const char* newpath) {
 	unsigned long long int seek_to;
 
 	unsigned char* last_slash = strrchr(newpath, '/');
-	unsigned char* new_name = calloc(38, 1);
-	unsigned char* pathcp = malloc(strlen(newpath)+1);
-	unsigned char* old_name = calloc(38, 1);
-	strcpy(pathcp, newpath);
-
-	if (strlen(last_slash+1) > 38) {
+	if (strlen(last_slash+1) > MAX_NAME) {
 		errno = ENAMETOOLONG;
 		return -errno;
 	}
+	unsigned char* new_name = calloc(MAX_NAME+1, 1);
 	strcpy(new_name, last_slash+1);
 
-	printf("NEW NAME: %s !!!!!\n", new_name);
+	// child_insert needs the name to be free, fuse_rs_rename removes whatever had it first
+	if (resolve_path(newpath) != 0) {
+		free(new_name);
+		errno = EEXIST;
+		return -errno;
+	}
 
+	// out of the parent's table under the old name, back in under the new one.
+	// everything under a directory finds it through it so nothing else changes
 	if (did != -1) {
-		strcpy(old_name, directory_structs[did]->name);
-		strcpy(directory_structs[did] -> name, new_name);
-		parent = directory_structs[did] -> parent;
-		seek_to = directory_structs[did] -> seek_to;
-		directory_paths[did] = pathcp;
+		struct redsea_directory* directory = directory_structs[did];
+		parent = directory -> parent;
+		seek_to = directory -> seek_to;
+		child_remove(parent, directory->name);
+		strcpy(directory -> name, new_name);
+		child_insert(parent, NULL, directory);
 	}
 	else {
-		strcpy(old_name, file_structs[fid]->name);
-		strcpy(file_structs[fid] -> name, new_name);
-		parent = file_structs[fid] -> parent;
-		seek_to = file_structs[fid] -> seek_to;
-		file_paths[fid] = pathcp;
+		struct redsea_file* file = file_structs[fid];
+		parent = file -> parent;
+		seek_to = file -> seek_to;
+		child_remove(parent, file->name);
+		strcpy(file -> name, new_name);
+		child_insert(parent, file, NULL);
 	}
-	
-	unsigned long long int pid;
 
-	for (int i = 0; i < parent->num_children; i++) {
-		if (strcmp(old_name, parent->children[i]) == 0) {
-			pid = i;
-			break;
-		}
+	journal_begin();
+	metadata_write(new_name, MAX_NAME+1, parent->block*BLOCK_SIZE + seek_to + 2);
+	// a directory's own first entry has its name too
+	if (did != -1) metadata_write(new_name, MAX_NAME+1, directory_structs[did]->block*BLOCK_SIZE + 2);
+	journal_end();
+
+	free(new_name);
+	return 0;
+}
+
+/* create/mkdir/unlink/rmdir/rename reshape the tree, they run with
+ * the table write locked which keeps every other operation out.
+ * unlink and rmdir wait for the free map before they mark anything deleted.
+ * Underneath they still go by path, entry_path builds it from the parent.
+ */
+
+// path of name in directory parent, malloced. table_lock held, NULL with err set
+static char* entry_path(fuse_ino_t parent, const char* name, int* err) {
+	struct redsea_file* file;
+	struct redsea_directory* directory;
+	if (control_inode_path(parent) != NULL) {
+		*err = EPERM;
+		return NULL;
+	}
+	if (!inode_object(parent, &file, &directory)) {
+		*err = ENOENT;
+		return NULL;
+	}
+	if (directory == NULL) {
+		*err = ENOTDIR;
+		return NULL;
 	}
-	printf("PID: %d\n", pid);
+	char* path = child_path(directory, name);
+	if (is_control_path(path)) {
+		free(path);
+		*err = EPERM;
+		return NULL;
+	}
+	return path;
+}
 
-	parent->children[pid] = malloc(strlen(new_name)+1);
-	strcpy(parent->children[pid], new_name);
+static void fuse_rs_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+	unsigned long long int start = stats_clock();
+	ensure_free_map();
+	pthread_rwlock_wrlock(&table_lock);
+	int err;
+	char* path = entry_path(parent, name, &err);
+	if (path != NULL) {
+		load_path_locked(path, false);
+		err = -redsea_unlink_file(path);
+		free(path);
+	}
+	pthread_rwlock_unlock(&table_lock);
+	stats_record(STATS_UNLINK, start, err != 0);
+	fuse_reply_err(req, err);
+}
 
-	printf("SF??\n");
-	rewind(image);
-	fseek(image, parent->block*BLOCK_SIZE, SEEK_SET);
-	fseek(image, seek_to, SEEK_CUR);
-	fseek(image, 2, SEEK_CUR);
-	fwrite(new_name, 38, 1, image); 
-	
-	return 0;
+static void fuse_rs_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
+	unsigned long long int start = stats_clock();
+	ensure_free_map();
+	pthread_rwlock_wrlock(&table_lock);
+	int err;
+	char* path = entry_path(parent, name, &err);
+	if (path != NULL) {
+		load_path_locked(path, true);
+		err = -redsea_rmdir(path);
+		free(path);
+	}
+	pthread_rwlock_unlock(&table_lock);
+	stats_record(STATS_RMDIR, start, err != 0);
+	fuse_reply_err(req, err);
 }
 
-static struct fuse_operations redsea_ops = {
-	.getattr = fuse_rs_file_attributes,
-	.readdir = fuse_rs_read_directory,
-	.read = fuse_rs_read_file,					
-	.unlink = fuse_rs_unlink_file,
-	.rmdir = fuse_rs_rmdir,
-	.write = fuse_rs_write,
-	.truncate = fuse_rs_truncate,
-	.open = fuse_rs_open_file,				// open and opendir should just return 0 afaik. no need
-	.opendir = fuse_rs_open_dir,				// for stuff like that in RedSea
+static void fuse_rs_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, struct fuse_file_info* fi) {
+	unsigned long long int start = stats_clock();
+	struct fuse_entry_param e;
+	pthread_rwlock_wrlock(&table_lock);
+	int err;
+	char* path = entry_path(parent, name, &err);
+	if (path != NULL) {
+		load_path_locked(path, false);
+		err = -redsea_create(path, mode, fi);
+		if (err == 0) fill_entry(&e, file_structs[file_position(path)], NULL, true);
+		free(path);
+	}
+	pthread_rwlock_unlock(&table_lock);
+	stats_record(STATS_CREATE, start, err != 0);
+	if (err != 0) fuse_reply_err(req, err);
+	else {
+		fi->fh = (uintptr_t) open_file_new();
+		fuse_reply_create(req, &e, fi);
+	}
+}
+
+static void fuse_rs_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode) {
+	unsigned long long int start = stats_clock();
+	struct fuse_entry_param e;
+	pthread_rwlock_wrlock(&table_lock);
+	int err;
+	char* path = entry_path(parent, name, &err);
+	if (path != NULL) {
+		load_path_locked(path, false);
+		err = -redsea_mkdir(path, mode);
+		if (err == 0) fill_entry(&e, NULL, directory_structs[directory_position(path)], true);
+		free(path);
+	}
+	pthread_rwlock_unlock(&table_lock);
+	stats_record(STATS_MKDIR, start, err != 0);
+	if (err != 0) fuse_reply_err(req, err);
+	else fuse_reply_entry(req, &e);
+}
+
+// only renames in place, moving between directories gets EXDEV so mv falls back to copying.
+// whatever already has the new name is replaced, the way unlink or rmdir would remove it
+static void fuse_rs_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname, unsigned int flags) {
+	if (flags != 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if (newparent != parent) {
+		fuse_reply_err(req, EXDEV);
+		return;
+	}
+	unsigned long long int start = stats_clock();
+	ensure_free_map();
+	pthread_rwlock_wrlock(&table_lock);
+	int err;
+	char* path = entry_path(parent, name, &err);
+	char* newpath = path != NULL ? entry_path(newparent, newname, &err) : NULL;
+	if (newpath != NULL) {
+		load_path_locked(path, false);
+		load_path_locked(newpath, true);		// a directory being replaced has to be loaded to tell if it's empty
+		uintptr_t from = resolve_path(path);
+		uintptr_t to = resolve_path(newpath);
+		err = 0;
+		journal_begin();
+		if (from == 0) err = ENOENT;
+		else if (to != 0 && to != from) {
+			if (child_directory(from) != NULL && child_file(to) != NULL) err = ENOTDIR;
+			else if (child_file(from) != NULL && child_directory(to) != NULL) err = EISDIR;
+			else if (child_directory(to) != NULL) err = -redsea_rmdir(newpath);
+			else err = -redsea_unlink_file(newpath);
+		}
+		if (err == 0 && to != from) err = -redsea_rename(path, newpath);
+		journal_end();
+	}
+	free(path);
+	free(newpath);
+	pthread_rwlock_unlock(&table_lock);
+	stats_record(STATS_RENAME, start, err != 0);
+	fuse_reply_err(req, err);
+}
+
+static struct fuse_lowlevel_ops redsea_ops = {
+	.init = fuse_rs_init,
 	.destroy = fuse_rs_destroy,
+	.lookup = fuse_rs_lookup,
+	.forget = fuse_rs_forget,
+	.forget_multi = fuse_rs_forget_multi,
+	.getattr = fuse_rs_getattr,
+	.setattr = fuse_rs_setattr,
+	.opendir = fuse_rs_opendir,
+	.readdir = fuse_rs_readdir,
+	.readdirplus = fuse_rs_readdirplus,
+	.releasedir = fuse_rs_releasedir,
+	.fsyncdir = fuse_rs_fsyncdir,
+	.open = fuse_rs_open,
+	.read = fuse_rs_read,
+	.write_buf = fuse_rs_write_buf,
+	.flush = fuse_rs_flush,
+	.release = fuse_rs_release,
+	.fsync = fuse_rs_fsync,
+	.fallocate = fuse_rs_fallocate,
 	.create = fuse_rs_create,
 	.mkdir = fuse_rs_mkdir,
+	.unlink = fuse_rs_unlink,
+	.rmdir = fuse_rs_rmdir,
 	.rename = fuse_rs_rename,
-	
+	.statfs = fuse_rs_statfs,
 };
 
 char *devfile = NULL;
 
+// the first plain argument is the image, everything else goes on to fuse
+static int redsea_opt_proc(void* data, const char* arg, int key, struct fuse_args* outargs) {
+	if (key == FUSE_OPT_KEY_NONOPT && devfile == NULL) {
+		devfile = strdup(arg);
+		return 0;
+	}
+	return 1;
+}
+
 int main(int argc, char **argv) {
-	directory_paths = malloc(sizeof(char*)*max_directory_count);
 	directory_structs = malloc(sizeof(struct redsea_directory*)*max_directory_count);
-	file_paths = malloc(sizeof(char*)*max_file_count);
-	file_structs = malloc(sizeof(struct redsea_file*)*max_directory_count);
-	int i;
-	for (i = 1; i<argc && argv[i][0] == '-'; i++);
-	if (i < argc) {
-		devfile = argv[i];
-		printf("%s\n", devfile);
-		memcpy(&argv[i], &argv[i+1], (argc-i) * sizeof(argv[0]));
-		argc--;
-	
-		image = fopen(devfile, "rb+");				// open disk image
-		unsigned int bcp = boot_catalog_pointer(image);
-		if (redsea_identity_check(bcp, image)) printf("good\n");
-		else printf("bad. not redsea?\n");
-		printf("%#x\n", bcp);
-		unsigned int rdb = root_directory_block(0x58, image);	// first param should always be 0x58, but maybe I don't know the specification well enough
-		fseek(image, (rdb*BLOCK_SIZE)+48, SEEK_SET);
-		unsigned long long int size;
-		fread(&size, 8, 1, image);				// get root directory size before reading. probably inefficient	
-		printf("size: %#lx\n", size);
-		struct redsea_directory* root_directory = malloc(sizeof(struct redsea_directory));
-		strcpy(root_directory->name, ".");
-		root_directory->seek_to = 0;
-		root_directory->size = size;
-		root_directory->block = rdb;
-		root_directory->mod_date = 0;
-		root_directory->num_children = 0;
-		root_directory->children = malloc(sizeof(char*)*(size/64));
-		root_directory->parent = NULL;
-		directory_paths[0] = "/";
-		directory_structs[0] = root_directory;
-
-		free_space_pointer = rdb;
-
-		//redsea_read_files(rdb, size, image, ".", "");
-		redsea_read_files(root_directory, "");
+	file_structs = malloc(sizeof(struct redsea_file*)*max_file_count);
+	inode_capacity = 64;
+	inodes = calloc(inode_capacity, sizeof(struct redsea_inode));
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	options.writeback_interval = 5;
+	options.zcache_mb = 32;
+	options.entry_timeout = 1.0;
+	options.attr_timeout = 1.0;
+	options.max_write = 1 << 20;
+	options.io_depth = 16;
+	if (fuse_opt_parse(&args, &options, redsea_opts, redsea_opt_proc) == -1) {
+		fprintf(stderr, "usage: %s image mountpoint [options]\n", argv[0]);
+		return 1;
 	}
-	
-	return fuse_main(argc, argv, &redsea_ops, NULL);
-	
+	if (options.io_depth < 1) options.io_depth = 1;
+	if (options.io_depth > IO_RING_ENTRIES) options.io_depth = IO_RING_ENTRIES;
+	// the kernel only takes max_read as a mount option and libfuse wants init to say the same
+	if (options.max_read != 0) {
+		char max_read[32];
+		snprintf(max_read, sizeof(max_read), "-omax_read=%u", options.max_read);
+		fuse_opt_add_arg(&args, max_read);
+	}
+	struct fuse_cmdline_opts opts;
+	if (fuse_parse_cmdline(&args, &opts) != 0) return 1;
+	debug_output = opts.debug;
+	if (opts.show_help) {
+		printf("usage: %s image mountpoint [options]\n\n", argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		return 0;
+	}
+	if (opts.show_version) {
+		fuse_lowlevel_version();
+		return 0;
+	}
+	if (devfile == NULL || opts.mountpoint == NULL) {
+		fprintf(stderr, "usage: %s image mountpoint [options]\n", argv[0]);
+		return 1;
+	}
+	debug_printf("%s\n", devfile);
+
+	image_fd = open(devfile, O_RDWR);			// open disk image
+	if (image_fd == -1) {
+		perror(devfile);
+		return 1;
+	}
+	if (options.direct) open_direct(devfile);
+	if (direct_fd != -1 && options.cache_mb != 0) cache_init();
+	image_remap();
+	if (options.journal_path != NULL && !journal_open(options.journal_path)) return 1;
+	unsigned int bcp = boot_catalog_pointer();
+	if (!redsea_identity_check(bcp)) fprintf(stderr, "%s doesn't look like a RedSea image\n", devfile);
+	debug_printf("%#x\n", bcp);
+	unsigned int rdb = root_directory_block(0x58);	// first param should always be 0x58, but maybe I don't know the specification well enough
+	unsigned long long int size = image_le64((rdb*BLOCK_SIZE)+48);	// get root directory size before reading
+	debug_printf("size: %#llx\n", size);
+	struct redsea_directory* root_directory = arena_alloc(sizeof(struct redsea_directory));
+	strcpy(root_directory->name, ".");
+	root_directory->size = size;
+	root_directory->block = rdb;
+	root_directory->loaded = false;				// nothing gets read until it's looked at
+	root_directory->next_slot = 2;
+	root_directory->ino = FUSE_ROOT_ID;
+	inodes[FUSE_ROOT_ID].directory = root_directory;
+	pthread_rwlock_init(&root_directory->lock, NULL);
+	directory_structs[0] = root_directory;			// position 0, directory_count starts at 1
+	// has to happen before anything is written or the mtime won't match
+	if (options.index_path != NULL && load_index(options.index_path)) {
+		pthread_once(&free_map_once, free_map_loaded);
+	}
+
+	struct fuse_session* se = fuse_session_new(&args, &redsea_ops, sizeof(redsea_ops), NULL);
+	if (se == NULL) return 1;
+	int ret = 1;
+	if (fuse_set_signal_handlers(se) == 0) {
+		if (fuse_session_mount(se, opts.mountpoint) == 0) {
+			fuse_daemonize(opts.foreground);
+			if (opts.singlethread) ret = fuse_session_loop(se);
+			else ret = fuse_session_loop_mt(se, opts.clone_fd);
+			fuse_session_unmount(se);
+		}
+		fuse_remove_signal_handlers(se);
+	}
+	fuse_session_destroy(se);
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return ret ? 1 : 0;
 }
@@ -0,0 +1,287 @@
+#define _FILE_OFFSET_BITS 64
+#define ROOT_BLOCK 0x60			// where the root directory goes, same as a fresh TempleOS ISO.C
+#define BOOT_CATALOG_SECTOR 0x14
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include "../redsea_format.h"
+
+/* Synthetic ISO.C generator
+ * builds a RedSea image with a tree of directories and files for the
+ * benchmarks. Everything the driver looks at is filled in: the volume
+ * descriptors, the El Torito boot catalog with the TempleOS signature, the
+ * root pointers and block count in the RedSea boot block, and the directory
+ * entries. There's no actual boot code, TempleOS won't boot from these.
+ *
+ * File contents are a pattern that depends on the file number and offset
+ * (see pattern_byte) so a benchmark can tell if it read back the right data.
+ * With -h some files get a deleted neighbour with its own extent, which is
+ * what an image looks like after being edited for a while.
+ */
+
+struct gen_file {
+	char name[38];
+	unsigned long long int size;
+	unsigned long long int block;
+	bool deleted;
+};
+struct gen_directory {
+	char name[38];
+	unsigned long long int block;
+	unsigned long long int size;		// bytes, whole blocks
+	struct gen_directory* parent;
+	struct gen_directory** subdirs;
+	unsigned long long int num_subdirs;
+	struct gen_file* files;
+	unsigned long long int num_files;
+	unsigned long long int max_files;
+};
+
+struct gen_options {
+	unsigned long long int files;
+	unsigned int depth;
+	unsigned int fanout;
+	unsigned long long int min_size;
+	unsigned long long int max_size;
+	bool log_sizes;				// sizes spread evenly over orders of magnitude instead of bytes
+	unsigned int holes;			// percent of files that get a deleted file next to them
+	unsigned int seed;
+	const char* output;
+} gen = {1000, 2, 4, 0, 65536, true, 0, 1, NULL};
+
+unsigned char pattern_byte(unsigned long long int file_number, unsigned long long int offset) {
+	return (file_number*31 + offset*7 + offset/BLOCK_SIZE) & 0xff;
+}
+
+// xorshift so images come out the same for the same seed on every libc
+unsigned long long int rng_state;
+unsigned long long int rng() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+unsigned long long int random_size() {
+	if (gen.max_size <= gen.min_size) return gen.min_size;
+	if (!gen.log_sizes) return gen.min_size + rng() % (gen.max_size - gen.min_size + 1);
+	// pick a power of two between the two, then a size inside it
+	unsigned int low_bits = 0;
+	unsigned int high_bits = 0;
+	while ((1ULL << low_bits) <= gen.min_size) low_bits++;
+	while ((1ULL << high_bits) <= gen.max_size) high_bits++;
+	unsigned int bits = low_bits + rng() % (high_bits - low_bits + 1);
+	unsigned long long int size = bits == 0 ? 0 : (1ULL << (bits-1)) + rng() % (1ULL << (bits-1));
+	if (size < gen.min_size) size = gen.min_size;
+	if (size > gen.max_size) size = gen.max_size;
+	return size;
+}
+
+struct gen_directory* new_directory(const char* name, struct gen_directory* parent) {
+	struct gen_directory* directory = calloc(1, sizeof(struct gen_directory));
+	snprintf(directory->name, sizeof(directory->name), "%s", name);
+	directory->parent = parent;
+	return directory;
+}
+
+void add_file(struct gen_directory* directory, const char* name, unsigned long long int size, bool deleted) {
+	if (directory->num_files == directory->max_files) {
+		directory->max_files = directory->max_files ? directory->max_files*2 : 16;
+		directory->files = realloc(directory->files, sizeof(struct gen_file)*directory->max_files);
+	}
+	struct gen_file* file = &directory->files[directory->num_files++];
+	memset(file, 0, sizeof(struct gen_file));
+	snprintf(file->name, sizeof(file->name), "%s", name);
+	file->size = size;
+	file->deleted = deleted;
+}
+
+// every directory at every level gets fanout subdirectories until depth runs out
+void build_tree(struct gen_directory* directory, unsigned int depth, struct gen_directory*** all, unsigned long long int* count, unsigned long long int* max) {
+	if (*count == *max) {
+		*max *= 2;
+		*all = realloc(*all, sizeof(struct gen_directory*)*(*max));
+	}
+	(*all)[(*count)++] = directory;
+	if (depth == 0) return;
+	directory->subdirs = malloc(sizeof(struct gen_directory*)*gen.fanout);
+	for (unsigned int i = 0; i < gen.fanout; i++) {
+		// numbered across the whole tree, no child has its directory's name (older drivers took it for the directory's own entry)
+		char name[38];
+		snprintf(name, sizeof(name), "D%llu", *count);
+		directory->subdirs[directory->num_subdirs++] = new_directory(name, directory);
+		build_tree(directory->subdirs[i], depth-1, all, count, max);
+	}
+}
+
+void write_or_die(int fd, const void* buffer, unsigned long long int size, unsigned long long int offset) {
+	const unsigned char* pos = buffer;
+	unsigned long long int done = 0;
+	while (done < size) {
+		ssize_t written = pwrite(fd, pos + done, size - done, offset + done);
+		if (written <= 0) {
+			perror("pwrite");
+			exit(1);
+		}
+		done += written;
+	}
+}
+
+void write_boot_area(int fd, unsigned long long int image_length) {
+	unsigned char* boot = calloc(ROOT_BLOCK*BLOCK_SIZE, 1);
+	unsigned int sectors = image_length / ISO_9660_SECTOR_SIZE;
+	// primary volume descriptor and the copy the driver keeps in sync at 0x9000
+	for (unsigned long long int pvd = 0x8000; pvd <= 0x9000; pvd += 0x1000) {
+		boot[pvd] = 1;
+		memcpy(boot+pvd+1, "CD001", 5);
+		boot[pvd+6] = 1;
+		memcpy(boot+pvd+40, "REDSEA                          ", 32);
+		put_both32(boot+pvd+0x50, sectors);
+		put_root_pointer(boot+pvd+0x98, ROOT_BLOCK);
+	}
+	// El Torito boot record pointing at the catalog
+	boot[0x8800] = 0;
+	memcpy(boot+0x8801, "CD001", 5);
+	boot[0x8806] = 1;
+	memcpy(boot+0x8807, "EL TORITO SPECIFICATION", 23);
+	put_le32(boot+0x8847, BOOT_CATALOG_SECTOR);
+	// set terminator
+	boot[0x9800] = 255;
+	memcpy(boot+0x9801, "CD001", 5);
+	boot[0x9806] = 1;
+	// validation entry, the id string is what identifies a TempleOS disk
+	unsigned char* catalog = boot + BOOT_CATALOG_SECTOR*ISO_9660_SECTOR_SIZE;
+	catalog[0] = 1;
+	memcpy(catalog+4, "TempleOS", 8);
+	catalog[0x1e] = 0x55;
+	catalog[0x1f] = 0xaa;
+	// RedSea boot block
+	put_le64(boot + BOOT_BLOCK*BLOCK_SIZE + 0x10, image_length/BLOCK_SIZE - BOOT_BLOCK);
+	put_le64(boot + BOOT_BLOCK*BLOCK_SIZE + 0x18, ROOT_BLOCK);
+	write_or_die(fd, boot, ROOT_BLOCK*BLOCK_SIZE, 0);
+	free(boot);
+}
+
+void usage(const char* name) {
+	fprintf(stderr, "usage: %s [options] -o IMAGE\n"
+		"  -f FILES     number of files (default 1000)\n"
+		"  -d DEPTH     directory depth below the root (default 2)\n"
+		"  -w FANOUT    subdirectories per directory (default 4)\n"
+		"  -s MIN:MAX   file size range in bytes (default 0:65536)\n"
+		"  -u           sizes uniform in bytes instead of log distributed\n"
+		"  -h PERCENT   files that get a deleted file and a hole next to them (default 0)\n"
+		"  -r SEED      random seed (default 1)\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "f:d:w:s:uh:r:o:")) != -1) {
+		switch (opt) {
+		case 'f': gen.files = strtoull(optarg, NULL, 0); break;
+		case 'd': gen.depth = atoi(optarg); break;
+		case 'w': gen.fanout = atoi(optarg); break;
+		case 's':
+			if (sscanf(optarg, "%llu:%llu", &gen.min_size, &gen.max_size) != 2) usage(argv[0]);
+			break;
+		case 'u': gen.log_sizes = false; break;
+		case 'h': gen.holes = atoi(optarg); break;
+		case 'r': gen.seed = atoi(optarg); break;
+		case 'o': gen.output = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (gen.output == NULL || gen.fanout == 0) usage(argv[0]);
+	rng_state = gen.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+	unsigned long long int directory_count = 0;
+	unsigned long long int max_directories = 16;
+	struct gen_directory** directories = malloc(sizeof(struct gen_directory*)*max_directories);
+	struct gen_directory* root = new_directory(".", NULL);
+	build_tree(root, gen.depth, &directories, &directory_count, &max_directories);
+
+	// spread the files round robin so every directory gets about the same
+	unsigned long long int total_size = 0;
+	unsigned long long int deleted = 0;
+	for (unsigned long long int i = 0; i < gen.files; i++) {
+		struct gen_directory* directory = directories[i % directory_count];
+		char name[38];
+		snprintf(name, sizeof(name), "F%llu.BIN", i);
+		unsigned long long int size = random_size();
+		add_file(directory, name, size, false);
+		total_size += size;
+		if (rng() % 100 < gen.holes) {
+			snprintf(name, sizeof(name), "Gone%llu.BIN", i);
+			add_file(directory, name, random_size(), true);
+			deleted++;
+		}
+	}
+
+	// lay out directories first (each right before its files), then the files in order
+	unsigned long long int block = ROOT_BLOCK;
+	for (unsigned long long int i = 0; i < directory_count; i++) {
+		struct gen_directory* directory = directories[i];
+		unsigned long long int entries = 2 + directory->num_subdirs + directory->num_files + 1;	// +1 for the end marker
+		directory->size = blocks_for(entries*64)*BLOCK_SIZE;
+		directory->block = block;
+		block += directory->size/BLOCK_SIZE;
+		for (unsigned long long int j = 0; j < directory->num_files; j++) {
+			directory->files[j].block = block;
+			block += blocks_for(directory->files[j].size);
+		}
+	}
+	unsigned long long int image_length = (block*BLOCK_SIZE + ISO_9660_SECTOR_SIZE-1) / ISO_9660_SECTOR_SIZE * ISO_9660_SECTOR_SIZE;
+
+	int fd = open(gen.output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror(gen.output);
+		return 1;
+	}
+	if (ftruncate(fd, image_length) != 0) {
+		perror("ftruncate");
+		return 1;
+	}
+	write_boot_area(fd, image_length);
+
+	unsigned long long int timestamp = unix_to_cdate(time(NULL));
+	unsigned long long int file_number = 0;
+	unsigned char* data = malloc(gen.max_size > BLOCK_SIZE ? gen.max_size : BLOCK_SIZE);
+	for (unsigned long long int i = 0; i < directory_count; i++) {
+		struct gen_directory* directory = directories[i];
+		unsigned char* entries = calloc(directory->size, 1);
+		write_entry(entries, 0x0810, directory->name, directory->block, directory->size, timestamp);
+		struct gen_directory* parent = directory->parent ? directory->parent : directory;
+		// .. only carries the block, the driver writes them the same way
+		write_entry(entries+64, 0x0810, "..", parent->block, directory->parent ? 0 : directory->size, timestamp);
+		unsigned long long int entry = 2;
+		for (unsigned long long int j = 0; j < directory->num_subdirs; j++, entry++) {
+			struct gen_directory* subdir = directory->subdirs[j];
+			write_entry(entries + entry*64, 0x0810, subdir->name, subdir->block, subdir->size, timestamp);
+		}
+		for (unsigned long long int j = 0; j < directory->num_files; j++, entry++) {
+			struct gen_file* file = &directory->files[j];
+			uint16_t attributes = file->deleted ? 0x0920 : 0x0820;
+			write_entry(entries + entry*64, attributes, file->name, file->block, file->size, timestamp);
+			if (file->deleted) continue;
+			unsigned long long int number = strtoull(file->name+1, NULL, 10);
+			for (unsigned long long int k = 0; k < file->size; k++) data[k] = pattern_byte(number, k);
+			write_or_die(fd, data, file->size, file->block*BLOCK_SIZE);
+			file_number++;
+		}
+		write_or_die(fd, entries, directory->size, directory->block*BLOCK_SIZE);
+		free(entries);
+	}
+	free(data);
+	close(fd);
+
+	// the same kind of line the benchmark prints, so both can go in one results file
+	printf("{\"bench\":\"image\",\"path\":\"%s\",\"files\":%llu,\"directories\":%llu,\"deleted\":%llu,\"data_bytes\":%llu,\"image_bytes\":%llu,\"depth\":%u,\"fanout\":%u,\"seed\":%u}\n",
+		gen.output, file_number, directory_count, deleted, total_size, image_length, gen.depth, gen.fanout, gen.seed);
+	return 0;
+}
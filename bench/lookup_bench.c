@@ -0,0 +1,155 @@
+#define main redsea_main		// the driver's main isn't used, only its lookup code
+#include "../FuseRedSea.c"
+#undef main
+
+/* Lookup microbenchmark
+ * builds a directory with more and more entries in memory, the same way
+ * load_directory does, and times file_position and directory_position on
+ * it. Nothing's mounted and no image is read, it's only the child tables.
+ * Every size gets the same number of lookups at random names. A scan
+ * would take 10x longer with every step, the hash tables should only slow
+ * down as the tables stop fitting in the CPU caches. Misses (names that
+ * aren't there) are timed too since create looks up a name before making it.
+ *
+ * One JSON object per line like redsea_bench, errors is how many lookups
+ * found the wrong thing.
+ */
+
+#define LOOKUP_DIRECTORY_EVERY 16	// one entry in this many is a directory
+
+unsigned long long int lookup_rng_state = 1;
+unsigned long long int lookup_rng() {
+	lookup_rng_state ^= lookup_rng_state << 13;
+	lookup_rng_state ^= lookup_rng_state >> 7;
+	lookup_rng_state ^= lookup_rng_state << 17;
+	return lookup_rng_state;
+}
+
+double lookup_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void lookup_report(const char* name, unsigned long long int entries, unsigned long long int lookups, double seconds, unsigned long long int errors) {
+	if (seconds <= 0) seconds = 1e-9;
+	printf("{\"bench\":\"%s\",\"entries\":%llu,\"lookups\":%llu,\"seconds\":%.6f,\"ns_per_lookup\":%.1f,\"errors\":%llu}\n",
+		name, entries, lookups, seconds, seconds * 1e9 / lookups, errors);
+	fflush(stdout);
+}
+
+void entry_name(char* name, unsigned long long int i) {
+	if (i % LOOKUP_DIRECTORY_EVERY == 0) sprintf(name, "D%llu", i);
+	else sprintf(name, "F%llu.TXT", i);
+}
+
+// a fresh root with entries children, the arena and old tables are just left behind
+struct redsea_directory* build_root(unsigned long long int entries) {
+	struct redsea_directory* root = arena_alloc(sizeof(struct redsea_directory));
+	strcpy(root->name, ".");
+	root->loaded = true;
+	root->ino = FUSE_ROOT_ID;
+	directory_structs[0] = root;
+	directory_count = 1;
+	file_count = 0;
+	for (unsigned long long int i = 0; i < entries; i++) {
+		if (i % LOOKUP_DIRECTORY_EVERY == 0) {
+			struct redsea_directory* directory = arena_alloc(sizeof(struct redsea_directory));
+			entry_name(directory->name, i);
+			directory->parent = root;
+			directory->seek_to = i;
+			add_directory_position(directory);
+			child_insert(root, NULL, directory);
+		} else {
+			struct redsea_file* file = arena_alloc(sizeof(struct redsea_file));
+			entry_name(file->name, i);
+			file->parent = root;
+			file->seek_to = i;
+			add_file_position(file);
+			child_insert(root, file, NULL);
+		}
+	}
+	return root;
+}
+
+// lookups paths, made upfront so sprintf isn't timed. kind 0 files, 1 directories, 2 misses
+char** make_paths(unsigned long long int entries, unsigned long long int lookups, int kind) {
+	char** paths = malloc(lookups*sizeof(char*));
+	char name[40];
+	for (unsigned long long int i = 0; i < lookups; i++) {
+		unsigned long long int n = lookup_rng() % entries;
+		if (kind == 0 && n % LOOKUP_DIRECTORY_EVERY == 0) n++;
+		if (kind == 1) n -= n % LOOKUP_DIRECTORY_EVERY;
+		if (kind == 2) sprintf(name, "M%llu.TXT", n);
+		else entry_name(name, n);
+		paths[i] = malloc(strlen(name) + 2);
+		sprintf(paths[i], "/%s", name);
+	}
+	return paths;
+}
+
+void free_paths(char** paths, unsigned long long int lookups) {
+	for (unsigned long long int i = 0; i < lookups; i++) free(paths[i]);
+	free(paths);
+}
+
+void bench_lookups(unsigned long long int entries, unsigned long long int lookups) {
+	build_root(entries);
+	char** paths = make_paths(entries, lookups, 0);
+	unsigned long long int errors = 0;
+	double start = lookup_now();
+	for (unsigned long long int i = 0; i < lookups; i++) {
+		unsigned long long int fid = file_position(paths[i]);
+		if (fid == (unsigned long long int) -1 || strcmp(file_structs[fid]->name, paths[i] + 1) != 0) errors++;
+	}
+	lookup_report("file_position", entries, lookups, lookup_now() - start, errors);
+	free_paths(paths, lookups);
+
+	paths = make_paths(entries, lookups, 1);
+	errors = 0;
+	start = lookup_now();
+	for (unsigned long long int i = 0; i < lookups; i++) {
+		unsigned long long int did = directory_position(paths[i]);
+		if (did == (unsigned long long int) -1 || strcmp(directory_structs[did]->name, paths[i] + 1) != 0) errors++;
+	}
+	lookup_report("directory_position", entries, lookups, lookup_now() - start, errors);
+	free_paths(paths, lookups);
+
+	paths = make_paths(entries, lookups, 2);
+	errors = 0;
+	start = lookup_now();
+	for (unsigned long long int i = 0; i < lookups; i++) {
+		if (file_position(paths[i]) != (unsigned long long int) -1) errors++;
+	}
+	lookup_report("file_position_miss", entries, lookups, lookup_now() - start, errors);
+	free_paths(paths, lookups);
+}
+
+void usage(const char* name) {
+	fprintf(stderr, "usage: %s [-n MAX_ENTRIES] [-l LOOKUPS] [-s SEED]\n"
+		"  -n  biggest directory, sizes go up by 10x from 100 (default 1000000)\n"
+		"  -l  lookups timed at each size (default 1000000)\n"
+		"  -s  random seed\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	unsigned long long int max_entries = 1000000;
+	unsigned long long int lookups = 1000000;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:l:s:")) != -1) {
+		switch (opt) {
+		case 'n': max_entries = strtoull(optarg, NULL, 0); break;
+		case 'l': lookups = strtoull(optarg, NULL, 0); break;
+		case 's': lookup_rng_state = strtoull(optarg, NULL, 0) | 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (max_entries < 100 || lookups == 0) usage(argv[0]);
+	directory_structs = malloc(sizeof(struct redsea_directory*)*max_directory_count);
+	file_structs = malloc(sizeof(struct redsea_file*)*max_file_count);
+	for (unsigned long long int entries = 100; entries <= max_entries; entries *= 10) {
+		bench_lookups(entries, lookups);
+	}
+	return 0;
+}
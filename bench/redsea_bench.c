@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#define BLOCK_SIZE 512
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* RedSea benchmark
+ * runs a fixed set of operations against a mounted image and prints one
+ * JSON object per line for each, so results from different versions can
+ * be diffed or loaded into anything. Give it -i and -d and it mounts the
+ * image itself (and times that), otherwise point -m at something already
+ * mounted. It writes to the image, so use a copy (make bench makes a
+ * fresh one every time).
+ *
+ * Files from genimage have a known pattern, the read benchmarks check it
+ * and count mismatches so a fast but wrong driver doesn't look good.
+ */
+
+struct bench_options {
+	const char* mountpoint;
+	const char* driver;
+	const char* image;
+	const char* driver_options;		// passed to the driver with -o
+	unsigned long long int sequential_bytes;
+	unsigned long long int random_ops;
+	unsigned long long int create_count;
+	unsigned long long int relocate_bytes;
+	bool relocate_only;
+	unsigned int seed;
+} bench = {NULL, NULL, NULL, NULL, 64ULL << 20, 2000, 500, 64ULL << 20, false, 1};
+
+char** paths = NULL;			// every file found by the walk
+unsigned long long int* sizes = NULL;
+unsigned long long int path_count = 0;
+unsigned long long int max_paths = 0;
+unsigned long long int directories_walked = 0;
+pid_t driver_pid = 0;
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned long long int rng_state;
+unsigned long long int rng() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+// same as genimage
+unsigned char pattern_byte(unsigned long long int file_number, unsigned long long int offset) {
+	return (file_number*31 + offset*7 + offset/BLOCK_SIZE) & 0xff;
+}
+
+void report(const char* name, unsigned long long int ops, unsigned long long int bytes, double seconds, unsigned long long int errors) {
+	if (seconds <= 0) seconds = 1e-9;
+	printf("{\"bench\":\"%s\",\"ops\":%llu,\"bytes\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"errors\":%llu}\n",
+		name, ops, bytes, seconds, ops / seconds, bytes / seconds / (1 << 20), errors);
+	fflush(stdout);
+}
+
+void die(const char* what) {
+	perror(what);
+	if (driver_pid > 0) kill(driver_pid, SIGTERM);
+	exit(1);
+}
+
+char* join_path(const char* directory, const char* name) {
+	char* path = malloc(strlen(directory) + strlen(name) + 2);
+	sprintf(path, "%s/%s", directory, name);
+	return path;
+}
+
+// the mountpoint is mounted once it's on a different device than its parent
+bool is_mounted(const char* path) {
+	struct stat mount_stat;
+	struct stat parent_stat;
+	char* parent = join_path(path, "..");
+	bool mounted = stat(path, &mount_stat) == 0 && stat(parent, &parent_stat) == 0 && mount_stat.st_dev != parent_stat.st_dev;
+	free(parent);
+	return mounted;
+}
+
+void mount_image() {
+	double start = now();
+	driver_pid = fork();
+	if (driver_pid == -1) die("fork");
+	if (driver_pid == 0) {
+		// the driver prints a lot, keep it out of the results
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		if (bench.driver_options != NULL) execl(bench.driver, bench.driver, "-f", "-o", bench.driver_options, bench.image, bench.mountpoint, (char*) NULL);
+		else execl(bench.driver, bench.driver, "-f", bench.image, bench.mountpoint, (char*) NULL);
+		perror(bench.driver);
+		_exit(127);
+	}
+	while (!is_mounted(bench.mountpoint)) {
+		int status;
+		if (waitpid(driver_pid, &status, WNOHANG) == driver_pid) {
+			fprintf(stderr, "driver exited before mounting\n");
+			exit(1);
+		}
+		if (now() - start > 60) {
+			fprintf(stderr, "timed out waiting for the mount\n");
+			kill(driver_pid, SIGTERM);
+			exit(1);
+		}
+		usleep(1000);
+	}
+	report("mount", 1, 0, now() - start, 0);
+}
+
+void unmount_image() {
+	double start = now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		execlp("fusermount3", "fusermount3", "-u", bench.mountpoint, (char*) NULL);
+		_exit(127);
+	}
+	waitpid(pid, NULL, 0);
+	waitpid(driver_pid, NULL, 0);
+	report("unmount", 1, 0, now() - start, 0);
+}
+
+/* Walks the whole tree. readdir and getattr are timed separately, each
+ * directory gets listed then everything in it stat'ed like ls -l would (the
+ * stats are answered from what readdirplus already handed the kernel).
+ */
+double readdir_seconds = 0;
+double getattr_seconds = 0;
+unsigned long long int readdir_entries = 0;
+unsigned long long int getattr_count = 0;
+unsigned long long int walk_errors = 0;
+
+void walk(const char* directory) {
+	double start = now();
+	DIR* dir = opendir(directory);
+	if (dir == NULL) {
+		walk_errors++;
+		return;
+	}
+	char** names = NULL;
+	unsigned long long int name_count = 0;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+		names = realloc(names, sizeof(char*)*(name_count+1));
+		names[name_count++] = join_path(directory, entry->d_name);
+	}
+	closedir(dir);
+	readdir_seconds += now() - start;
+	readdir_entries += name_count;
+	directories_walked++;
+
+	bool* is_directory = calloc(name_count, sizeof(bool));
+	start = now();
+	for (unsigned long long int i = 0; i < name_count; i++) {
+		struct stat st;
+		getattr_count++;
+		if (stat(names[i], &st) != 0) {
+			walk_errors++;
+			continue;
+		}
+		is_directory[i] = S_ISDIR(st.st_mode);
+		if (is_directory[i]) continue;
+		if (path_count == max_paths) {
+			max_paths = max_paths ? max_paths*2 : 1024;
+			paths = realloc(paths, sizeof(char*)*max_paths);
+			sizes = realloc(sizes, sizeof(unsigned long long int)*max_paths);
+		}
+		sizes[path_count] = st.st_size;
+		paths[path_count++] = names[i];
+	}
+	getattr_seconds += now() - start;
+
+	for (unsigned long long int i = 0; i < name_count; i++) {
+		if (!is_directory[i]) continue;
+		walk(names[i]);
+		free(names[i]);
+	}
+	free(is_directory);
+	free(names);
+}
+
+void bench_metadata() {
+	walk(bench.mountpoint);
+	report("readdir", readdir_entries, 0, readdir_seconds, walk_errors);
+	report("getattr", getattr_count, 0, getattr_seconds, 0);
+}
+
+// genimage names files F<number>.BIN, anything else has no pattern to check
+long long int file_number(const char* path) {
+	const char* name = strrchr(path, '/') + 1;
+	if (name[0] != 'F') return -1;
+	return strtoll(name+1, NULL, 10);
+}
+
+unsigned long long int check_pattern(const char* path, const unsigned char* data, unsigned long long int size, unsigned long long int offset) {
+	long long int number = file_number(path);
+	if (number < 0) return 0;
+	for (unsigned long long int i = 0; i < size; i++) {
+		if (data[i] != pattern_byte(number, offset + i)) return 1;
+	}
+	return 0;
+}
+
+// the biggest file on the image. random reads run first so it's still cold
+unsigned long long int biggest_file() {
+	unsigned long long int biggest = 0;
+	for (unsigned long long int i = 1; i < path_count; i++) {
+		if (sizes[i] > sizes[biggest]) biggest = i;
+	}
+	return biggest;
+}
+
+void bench_sequential_read() {
+	unsigned char* buffer = malloc(1 << 16);
+	unsigned long long int bytes = 0;
+	unsigned long long int errors = 0;
+	double start = now();
+	// every file once start to finish, like copying the whole image out
+	for (unsigned long long int i = 0; i < path_count; i++) {
+		int fd = open(paths[i], O_RDONLY);
+		if (fd == -1) {
+			errors++;
+			continue;
+		}
+		ssize_t got;
+		unsigned long long int offset = 0;
+		bool bad = false;
+		while ((got = read(fd, buffer, 1 << 16)) > 0) {
+			if (check_pattern(paths[i], buffer, got, offset)) bad = true;
+			offset += got;
+		}
+		if (got < 0 || offset != sizes[i] || bad) errors++;
+		bytes += offset;
+		close(fd);
+	}
+	report("sequential_read", path_count, bytes, now() - start, errors);
+	free(buffer);
+}
+
+void bench_random_read() {
+	if (path_count == 0) return;
+	unsigned long long int target = biggest_file();
+	unsigned long long int size = sizes[target];
+	int fd = open(paths[target], O_RDONLY);
+	if (fd == -1 || size < 4096) {
+		if (fd != -1) close(fd);
+		return;
+	}
+	unsigned char buffer[4096];
+	unsigned long long int errors = 0;
+	double start = now();
+	for (unsigned long long int i = 0; i < bench.random_ops; i++) {
+		unsigned long long int offset = rng() % (size - 4096 + 1);
+		if (pread(fd, buffer, 4096, offset) != 4096 || check_pattern(paths[target], buffer, 4096, offset)) errors++;
+	}
+	report("random_read_4k", bench.random_ops, bench.random_ops*4096, now() - start, errors);
+	close(fd);
+}
+
+void bench_write() {
+	char* path = join_path(bench.mountpoint, "BenchSeq.BIN");
+	unsigned char* buffer = malloc(1 << 16);
+	for (int i = 0; i < (1 << 16); i++) buffer[i] = i*13;
+	unsigned long long int errors = 0;
+
+	double start = now();
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) die(path);
+	for (unsigned long long int done = 0; done < bench.sequential_bytes; done += 1 << 16) {
+		if (write(fd, buffer, 1 << 16) != (1 << 16)) errors++;
+	}
+	if (fsync(fd) != 0) errors++;
+	report("sequential_write", bench.sequential_bytes >> 16, bench.sequential_bytes, now() - start, errors);
+
+	errors = 0;
+	start = now();
+	for (unsigned long long int i = 0; i < bench.random_ops; i++) {
+		unsigned long long int offset = rng() % (bench.sequential_bytes / 4096) * 4096;
+		if (pwrite(fd, buffer, 4096, offset) != 4096) errors++;
+	}
+	if (fsync(fd) != 0) errors++;
+	report("random_write_4k", bench.random_ops, bench.random_ops*4096, now() - start, errors);
+	close(fd);
+	unlink(path);
+	free(path);
+	free(buffer);
+}
+
+void bench_create_unlink() {
+	char* directory = join_path(bench.mountpoint, "BenchDir");
+	if (mkdir(directory, 0755) != 0 && errno != EEXIST) die(directory);
+	char** names = malloc(sizeof(char*)*bench.create_count);
+	char name[38];
+	for (unsigned long long int i = 0; i < bench.create_count; i++) {
+		snprintf(name, sizeof(name), "C%llu.TXT", i);
+		names[i] = join_path(directory, name);
+	}
+
+	unsigned long long int errors = 0;
+	double start = now();
+	for (unsigned long long int i = 0; i < bench.create_count; i++) {
+		int fd = open(names[i], O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd == -1) errors++;
+		else close(fd);
+	}
+	report("create", bench.create_count, 0, now() - start, errors);
+
+	errors = 0;
+	start = now();
+	for (unsigned long long int i = 0; i < bench.create_count; i++) {
+		if (unlink(names[i]) != 0) errors++;
+		free(names[i]);
+	}
+	report("unlink", bench.create_count, 0, now() - start, errors);
+	rmdir(directory);
+	free(names);
+	free(directory);
+}
+
+/* Not a benchmark, names are 37 chars at most. A 38 char one has to be
+ * refused both by create and rename, and 37 char ones have to still be there
+ * under the same name after a remount (with -d and -i, otherwise just
+ * stat'ed back). Any of that going wrong counts as an error.
+ */
+#define NAME_LONGEST "N234567890123456789012345678901234.37"
+#define NAME_TOO_LONG "N234567890123456789012345678901234.038"
+void check_names() {
+	char* longest = join_path(bench.mountpoint, NAME_LONGEST);
+	char* too_long = join_path(bench.mountpoint, NAME_TOO_LONG);
+	char* renamed = join_path(bench.mountpoint, "R234567890123456789012345678901234.37");
+	char* source = join_path(bench.mountpoint, "NameSrc.TXT");
+	unsigned long long int errors = 0;
+	double start = now();
+	int fd = open(too_long, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd != -1 || errno != ENAMETOOLONG) errors++;
+	if (fd != -1) close(fd);
+	fd = open(longest, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) errors++;
+	else close(fd);
+	fd = open(source, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) errors++;
+	else close(fd);
+	if (rename(source, too_long) == 0 || errno != ENAMETOOLONG) errors++;
+	if (rename(source, renamed) != 0) errors++;
+	if (bench.driver != NULL) {
+		unmount_image();
+		mount_image();
+	}
+	struct stat st;
+	if (stat(longest, &st) != 0 || stat(renamed, &st) != 0) errors++;
+	if (stat(too_long, &st) == 0 || stat(source, &st) == 0) errors++;
+	report("names", 5, 0, now() - start, errors);
+	unlink(longest);
+	unlink(renamed);
+	unlink(source);
+	free(longest);
+	free(too_long);
+	free(renamed);
+	free(source);
+}
+
+/* A hole file with files after it, the hole gets deleted and compaction
+ * moves each file down into the space the one before it left, so it's all
+ * whole extent copies inside the image. With -i the image's pages get
+ * written out and dropped from the host's cache first so it's the disk that
+ * gets timed and not memcpy. The files are read back and checked after.
+ */
+#define RELOCATE_FILE_BYTES (4ULL << 20)
+void bench_relocate() {
+	unsigned long long int count = bench.relocate_bytes / RELOCATE_FILE_BYTES;
+	if (count == 0) count = 1;
+	unsigned char* buffer = malloc(1 << 16);
+	unsigned char* check = malloc(1 << 16);
+	char** names = malloc(sizeof(char*)*(count+1));
+	char name[38];
+	unsigned long long int errors = 0;
+	for (unsigned long long int i = 0; i <= count; i++) {
+		snprintf(name, sizeof(name), i ? "Reloc%llu.BIN" : "RelocHole.BIN", i);
+		names[i] = join_path(bench.mountpoint, name);
+		int fd = open(names[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1) die(names[i]);
+		for (unsigned long long int done = 0; done < RELOCATE_FILE_BYTES; done += 1 << 16) {
+			for (int j = 0; j < (1 << 16); j++) buffer[j] = (i*31 + done + j) & 0xff;
+			if (write(fd, buffer, 1 << 16) != (1 << 16)) errors++;
+		}
+		close(fd);
+	}
+	if (unlink(names[0]) != 0) errors++;
+	if (bench.image != NULL) {
+		int fd = open(bench.image, O_RDONLY);
+		if (fd != -1) {
+			fdatasync(fd);
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+	}
+
+	char* control = join_path(bench.mountpoint, ".redsea/compact");
+	char report_text[256] = "";
+	double start = now();
+	int fd = open(control, O_RDWR);
+	if (fd == -1 || write(fd, "1", 1) != 1) errors++;
+	ssize_t got = fd == -1 ? -1 : pread(fd, report_text, sizeof(report_text)-1, 0);
+	double seconds = now() - start;
+	if (fd != -1) close(fd);
+	unsigned long long int moved = 0;
+	unsigned long long int bytes = 0;
+	if (got <= 0 || sscanf(report_text, "moved: %llu\nbytes moved: %llu", &moved, &bytes) != 2) errors++;
+
+	for (unsigned long long int i = 1; i <= count; i++) {
+		fd = open(names[i], O_RDONLY);
+		if (fd == -1) {
+			errors++;
+			continue;
+		}
+		for (unsigned long long int done = 0; done < RELOCATE_FILE_BYTES; done += 1 << 16) {
+			for (int j = 0; j < (1 << 16); j++) buffer[j] = (i*31 + done + j) & 0xff;
+			if (read(fd, check, 1 << 16) != (1 << 16) || memcmp(buffer, check, 1 << 16) != 0) {
+				errors++;
+				break;
+			}
+		}
+		close(fd);
+		unlink(names[i]);
+	}
+	report("relocate", moved, bytes, seconds, errors);
+	for (unsigned long long int i = 0; i <= count; i++) free(names[i]);
+	free(names);
+	free(control);
+	free(check);
+	free(buffer);
+}
+
+void usage(const char* name) {
+	fprintf(stderr, "usage: %s -m MOUNTPOINT [-d DRIVER -i IMAGE] [options]\n"
+		"  -m DIR       where the image is (or gets) mounted\n"
+		"  -d DRIVER    redsea binary to mount with, needs -i\n"
+		"  -i IMAGE     image to mount, it gets written to\n"
+		"  -s MB        size of the sequential write (default 64)\n"
+		"  -n OPS       random reads and writes (default 2000)\n"
+		"  -c COUNT     files to create and unlink (default 500)\n"
+		"  -l MB        data compaction relocates (default 64)\n"
+		"  -R           only the relocation benchmark\n"
+		"  -o OPTIONS   mount options for the driver, needs -d\n"
+		"  -r SEED      random seed (default 1)\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "m:d:i:s:n:c:l:Ro:r:")) != -1) {
+		switch (opt) {
+		case 'm': bench.mountpoint = optarg; break;
+		case 'd': bench.driver = optarg; break;
+		case 'i': bench.image = optarg; break;
+		case 's': bench.sequential_bytes = strtoull(optarg, NULL, 0) << 20; break;
+		case 'n': bench.random_ops = strtoull(optarg, NULL, 0); break;
+		case 'c': bench.create_count = strtoull(optarg, NULL, 0); break;
+		case 'l': bench.relocate_bytes = strtoull(optarg, NULL, 0) << 20; break;
+		case 'R': bench.relocate_only = true; break;
+		case 'o': bench.driver_options = optarg; break;
+		case 'r': bench.seed = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (bench.mountpoint == NULL || (bench.driver == NULL) != (bench.image == NULL)) usage(argv[0]);
+	if (bench.driver_options != NULL && bench.driver == NULL) usage(argv[0]);
+	if (bench.sequential_bytes < (1 << 16)) bench.sequential_bytes = 1 << 16;
+	rng_state = bench.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+	if (bench.driver != NULL) mount_image();
+	if (!bench.relocate_only) {
+		bench_metadata();
+		bench_random_read();
+		bench_sequential_read();
+		bench_write();
+		bench_create_unlink();
+		check_names();
+	}
+	bench_relocate();
+	if (bench.driver != NULL) unmount_image();
+	return 0;
+}
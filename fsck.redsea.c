@@ -0,0 +1,492 @@
+#define _FILE_OFFSET_BITS 64
+#include <linux/fs.h>				// BLKGETSIZE64, before redsea_format.h
+#define EMPTY_BLOCK 0xFFFFFFFFFFFFFFFF	// templeos empty file, takes no space
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include "redsea_format.h"
+
+/* fsck.redsea
+ * checks an ISO.C that isn't mounted. The boot area first: the TempleOS
+ * boot catalog, the three copies of the root pointer (0xB018 in the RedSea
+ * boot block, which is the one the driver uses, and the mirrored ones in
+ * both volume descriptors at 0x8098 and 0x9098), the ISO 9660 volume size
+ * in both descriptors and the block count in the boot block. Then the whole
+ * directory tree the same way the driver's free space scan walks it, with
+ * the directories handed out to a pool of threads so big images don't take
+ * long. Every directory's own entry and .. have to point at it and its
+ * parent, attributes have to make sense, names have to be unique, and every
+ * extent has to be past the boot block and inside the image. Once the walk
+ * is done all the extents are sorted to find any that overlap.
+ *
+ * With -r the simple things get fixed in place: the root pointers and
+ * sizes in the boot area (padding the image out to a whole sector if it
+ * needs it), the . and .. entries, and attributes. Overlapping or out of
+ * bounds extents and duplicate names are only reported, there's no telling
+ * which side is right. Run it on an image with a journal only after a
+ * mount has replayed it.
+ *
+ * Exits 0 if nothing was wrong, 1 if everything wrong was fixed, 4 if
+ * something's still wrong and 8 if it's not a RedSea image at all, like
+ * fsck does.
+ */
+
+struct check_extent {
+	unsigned long long int block;
+	unsigned long long int count;			// in blocks
+	char* path;
+};
+
+// a directory waiting to be checked
+struct check_directory {
+	char* path;
+	unsigned long long int block;
+	unsigned long long int size;			// what its entry in the parent says
+	unsigned long long int parent_block;
+	struct check_directory* next;
+};
+
+// each thread keeps its own extents, they're put together once the walk is done
+struct check_thread {
+	pthread_t thread;
+	struct check_extent* extents;
+	unsigned long long int extent_count;
+	unsigned long long int max_extents;
+	unsigned long long int directories;
+	unsigned long long int files;
+};
+
+struct check_options {
+	bool repair;
+	unsigned int threads;
+	const char* image;
+} check = {false, 0, NULL};
+
+int image_fd = -1;
+unsigned long long int image_length = 0;
+unsigned long long int problems = 0;
+unsigned long long int repaired = 0;
+
+/* the directories still to check. pending counts the ones in the queue and
+ * the ones being checked, the walk's over when it's 0. visited has the
+ * blocks of every directory that's been queued so a broken image that
+ * loops back on itself doesn't go round forever
+ */
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+struct check_directory* queue = NULL;
+unsigned long long int pending = 0;
+unsigned long long int* visited = NULL;
+unsigned long long int visited_count = 0;
+unsigned long long int visited_capacity = 0;		// power of 2
+
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// one line per problem, fixed says whether -r took care of it
+void report(bool fixed, const char* path, const char* format, ...) {
+	char message[512];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	pthread_mutex_lock(&report_lock);
+	printf("%s: %s%s\n", path[0] ? path : "/", message, fixed ? " (fixed)" : "");
+	problems++;
+	if (fixed) repaired++;
+	pthread_mutex_unlock(&report_lock);
+}
+
+bool read_image(void* buffer, unsigned long long int size, unsigned long long int offset) {
+	unsigned char* pos = buffer;
+	unsigned long long int done = 0;
+	while (done < size) {
+		ssize_t got = pread(image_fd, pos + done, size - done, offset + done);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) return false;
+		done += got;
+	}
+	return true;
+}
+
+// only with -r, false if it didn't go in
+bool write_image(const void* buffer, unsigned long long int size, unsigned long long int offset) {
+	if (!check.repair) return false;
+	const unsigned char* pos = buffer;
+	unsigned long long int done = 0;
+	while (done < size) {
+		ssize_t written = pwrite(image_fd, pos + done, size - done, offset + done);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) {
+			perror("pwrite");
+			return false;
+		}
+		done += written;
+	}
+	return true;
+}
+
+// whether an extent fits between the boot block and the end of the image
+bool extent_in_bounds(unsigned long long int block, unsigned long long int size) {
+	return block > BOOT_BLOCK && block < image_length/BLOCK_SIZE && size <= image_length - block*BLOCK_SIZE;
+}
+
+// whether block looks like the start of a directory, its first entry pointing back at it
+bool looks_like_directory(unsigned long long int block) {
+	unsigned char entry[64];
+	if (!extent_in_bounds(block, 64) || !read_image(entry, 64, block*BLOCK_SIZE)) return false;
+	uint16_t attributes = entry[0] | entry[1] << 8;
+	return (attributes & RS_ATTR_DIR) && !(attributes & RS_ATTR_DELETED) && get_le64(entry+40) == block
+		&& get_le64(entry+48) >= 128 && extent_in_bounds(block, get_le64(entry+48));
+}
+
+// true if it wasn't there already
+bool mark_visited(unsigned long long int block) {
+	if (visited_count*2 >= visited_capacity) {
+		unsigned long long int* old = visited;
+		unsigned long long int old_capacity = visited_capacity;
+		visited_capacity = visited_capacity ? visited_capacity*2 : 1024;
+		visited = malloc(sizeof(unsigned long long int)*visited_capacity);
+		memset(visited, 0xff, sizeof(unsigned long long int)*visited_capacity);	// EMPTY_BLOCK is never a directory
+		visited_count = 0;
+		for (unsigned long long int i = 0; i < old_capacity; i++) {
+			if (old[i] != EMPTY_BLOCK) mark_visited(old[i]);
+		}
+		free(old);
+	}
+	unsigned long long int slot = (block * 0x9E3779B97F4A7C15ULL) & (visited_capacity-1);
+	while (visited[slot] != EMPTY_BLOCK) {
+		if (visited[slot] == block) return false;
+		slot = (slot + 1) & (visited_capacity-1);
+	}
+	visited[slot] = block;
+	visited_count++;
+	return true;
+}
+
+// false if it's been seen before, then it isn't queued again
+bool queue_directory(const char* path, unsigned long long int block, unsigned long long int size, unsigned long long int parent_block) {
+	pthread_mutex_lock(&queue_lock);
+	if (!mark_visited(block)) {
+		pthread_mutex_unlock(&queue_lock);
+		return false;
+	}
+	struct check_directory* directory = malloc(sizeof(struct check_directory));
+	directory->path = strdup(path);
+	directory->block = block;
+	directory->size = size;
+	directory->parent_block = parent_block;
+	directory->next = queue;
+	queue = directory;
+	pending++;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return true;
+}
+
+void note_extent(struct check_thread* thread, unsigned long long int block, unsigned long long int count, const char* path) {
+	if (thread->extent_count == thread->max_extents) {
+		thread->max_extents = thread->max_extents ? thread->max_extents*2 : 256;
+		thread->extents = realloc(thread->extents, sizeof(struct check_extent)*thread->max_extents);
+	}
+	struct check_extent* extent = &thread->extents[thread->extent_count++];
+	extent->block = block;
+	extent->count = count;
+	extent->path = strdup(path);
+}
+
+// what's wrong with an entry's attributes, NULL if nothing
+const char* attribute_problem(uint16_t attributes) {
+	if (attributes & ~RS_ATTR_KNOWN) return "unknown attribute bits";
+	if ((attributes & RS_ATTR_DIR) && (attributes & RS_ATTR_COMPRESSED)) return "compressed directory";
+	if (!(attributes & RS_ATTR_CONTIGUOUS)) return "not contiguous";
+	return NULL;
+}
+
+uint16_t fixed_attributes(uint16_t attributes) {
+	attributes &= RS_ATTR_KNOWN;
+	if (attributes & RS_ATTR_DIR) attributes &= ~RS_ATTR_COMPRESSED;
+	return attributes | RS_ATTR_CONTIGUOUS;
+}
+
+int compare_names(const void* a, const void* b) {
+	return strcmp(*(const char**) a, *(const char**) b);
+}
+
+void check_directory(struct check_thread* thread, struct check_directory* directory) {
+	thread->directories++;
+	unsigned long long int size = directory->size;
+	if (size % BLOCK_SIZE != 0) report(false, directory->path, "directory size %llu isn't whole blocks", size);
+	unsigned char* entries = malloc(size);
+	if (!read_image(entries, size, directory->block*BLOCK_SIZE)) {
+		report(false, directory->path, "can't read directory at block %#llx", directory->block);
+		free(entries);
+		return;
+	}
+	unsigned long long int count = size/64;
+	unsigned long long int base = directory->block*BLOCK_SIZE;
+
+	// the directory's own entry and .., the same as add_entry_to_dir and move_directory_data write them
+	unsigned char* self = entries;
+	unsigned char* parent = entries + 64;
+	if (get_le64(self+40) != directory->block) {
+		unsigned long long int wrong = get_le64(self+40);
+		put_le64(self+40, directory->block);
+		report(write_image(self+40, 8, base + 40), directory->path, "own entry points at block %#llx", wrong);
+	}
+	if (get_le64(self+48) != size) {
+		unsigned long long int wrong = get_le64(self+48);
+		put_le64(self+48, size);
+		report(write_image(self+48, 8, base + 48), directory->path, "own entry says size %llu, its parent says %llu", wrong, size);
+	}
+	if (!(self[0] & RS_ATTR_DIR)) {
+		self[0] |= RS_ATTR_DIR;
+		report(write_image(self, 1, base), directory->path, "own entry isn't marked as a directory");
+	}
+	if (strncmp((char*) parent+2, "..", 38) != 0) {
+		memset(parent+2, 0, 38);
+		strcpy((char*) parent+2, "..");
+		report(write_image(parent+2, 38, base + 66), directory->path, "second entry isn't ..");
+	}
+	if (get_le64(parent+40) != directory->parent_block) {
+		unsigned long long int wrong = get_le64(parent+40);
+		put_le64(parent+40, directory->parent_block);
+		report(write_image(parent+40, 8, base + 104), directory->path, ".. points at block %#llx, the parent is at %#llx", wrong, directory->parent_block);
+	}
+	if (!(parent[0] & RS_ATTR_DIR)) {
+		parent[0] |= RS_ATTR_DIR;
+		report(write_image(parent, 1, base + 64), directory->path, ".. isn't marked as a directory");
+	}
+
+	char** names = malloc(sizeof(char*)*(count ? count : 1));
+	unsigned long long int name_count = 0;
+	for (unsigned long long int i = 2; i < count; i++) {
+		unsigned char* entry = entries + i*64;
+		uint16_t attributes = entry[0] | entry[1] << 8;
+		if (attributes == 0) break;			// end of directory
+		if (attributes & RS_ATTR_DELETED) continue;
+		char name[39];
+		memcpy(name, entry+2, 38);
+		name[38] = '\0';
+		char* path = malloc(strlen(directory->path) + strlen(name) + 2);
+		sprintf(path, "%s/%s", directory->path, name);
+		unsigned long long int block = get_le64(entry+40);
+		unsigned long long int entry_size = get_le64(entry+48);
+
+		if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) report(false, path, "entry %llu has a bad name", i);
+		else if (strlen(name) > 37) report(false, path, "name has no terminator");
+		else names[name_count++] = strdup(name);
+		const char* problem = attribute_problem(attributes);
+		if (problem != NULL) {
+			uint16_t fixed = fixed_attributes(attributes);
+			entry[0] = fixed & 0xff;
+			entry[1] = (fixed >> 8) & 0xff;
+			report(write_image(entry, 2, base + i*64), path, "%s, attributes %#x", problem, attributes);
+			attributes = fixed;
+		}
+
+		if (attributes & RS_ATTR_DIR) {
+			if (!extent_in_bounds(block, entry_size)) report(false, path, "directory at block %#llx size %llu is outside the image", block, entry_size);
+			else if (entry_size < 128) {
+				report(false, path, "directory at block %#llx is %llu bytes, too small for its own entry and ..", block, entry_size);
+				note_extent(thread, block, blocks_for(entry_size), path);
+			}
+			else {
+				note_extent(thread, block, blocks_for(entry_size), path);
+				if (!queue_directory(path, block, entry_size, directory->block)) report(false, path, "directory at block %#llx is already in the tree", block);
+			}
+		}
+		else {
+			thread->files++;
+			if (block == EMPTY_BLOCK) {
+				if (entry_size != 0) report(false, path, "no blocks but size %llu", entry_size);
+			}
+			else if (!extent_in_bounds(block, entry_size)) report(false, path, "extent at block %#llx size %llu is outside the image", block, entry_size);
+			else note_extent(thread, block, blocks_for(entry_size), path);
+		}
+		free(path);
+	}
+	qsort(names, name_count, sizeof(char*), compare_names);
+	for (unsigned long long int i = 0; i < name_count; i++) {
+		if (i > 0 && strcmp(names[i-1], names[i]) == 0) report(false, directory->path, "%s is in it more than once", names[i]);
+		if (i > 0) free(names[i-1]);
+	}
+	if (name_count > 0) free(names[name_count-1]);
+	free(names);
+	free(entries);
+}
+
+void* check_thread_main(void* arg) {
+	struct check_thread* thread = arg;
+	pthread_mutex_lock(&queue_lock);
+	for (;;) {
+		while (queue == NULL && pending > 0) pthread_cond_wait(&queue_cond, &queue_lock);
+		if (queue == NULL) break;
+		struct check_directory* directory = queue;
+		queue = directory->next;
+		pthread_mutex_unlock(&queue_lock);
+		check_directory(thread, directory);
+		free(directory->path);
+		free(directory);
+		pthread_mutex_lock(&queue_lock);
+		if (--pending == 0) pthread_cond_broadcast(&queue_cond);
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return NULL;
+}
+
+int compare_extents(const void* a, const void* b) {
+	const struct check_extent* x = a;
+	const struct check_extent* y = b;
+	if (x->block != y->block) return x->block < y->block ? -1 : 1;
+	return 0;
+}
+
+/* the root pointers, volume sizes and block count. Returns the root
+ * directory's block or EMPTY_BLOCK if there isn't one anywhere
+ */
+unsigned long long int check_boot_area() {
+	unsigned char boot[0xB020];
+	if (!read_image(boot, sizeof(boot), 0)) return EMPTY_BLOCK;
+	unsigned int catalog = get_le32(boot+0x8847);
+	unsigned char signature[4];		// only the start of it, like redsea_identity_check
+	if (!read_image(signature, 4, (unsigned long long int) catalog*ISO_9660_SECTOR_SIZE + 4) || memcmp(signature, "Temp", 4) != 0) return EMPTY_BLOCK;
+
+	// 0xB018 is the one the driver goes by, the other two only if it's no good
+	unsigned long long int pointers[3] = {get_le64(boot+0xB018), get_le32(boot+0x8098), get_le32(boot+0x9098)};
+	unsigned long long int root = EMPTY_BLOCK;
+	for (int i = 0; i < 3 && root == EMPTY_BLOCK; i++) {
+		if (looks_like_directory(pointers[i])) root = pointers[i];
+	}
+	if (root == EMPTY_BLOCK) return EMPTY_BLOCK;
+	unsigned char expected[8];
+	put_le64(expected, root);
+	if (memcmp(boot+0xB018, expected, 8) != 0) report(write_image(expected, 8, 0xB018), "", "root pointer at 0xB018 is %#llx, the root is at %#llx", pointers[0], root);
+	put_root_pointer(expected, root);
+	if (memcmp(boot+0x8098, expected, 8) != 0) report(write_image(expected, 8, 0x8098), "", "root pointer at 0x8098 doesn't match %#llx", root);
+	if (memcmp(boot+0x9098, expected, 8) != 0) report(write_image(expected, 8, 0x9098), "", "root pointer at 0x9098 doesn't match %#llx", root);
+
+	// the driver pads the image to a whole sector at unmount, rewrite_redsea_boot sizes it from that
+	if (image_length % ISO_9660_SECTOR_SIZE != 0) {
+		unsigned long long int padded = (image_length + ISO_9660_SECTOR_SIZE-1) / ISO_9660_SECTOR_SIZE * ISO_9660_SECTOR_SIZE;
+		bool fixed = check.repair && ftruncate(image_fd, padded) == 0;
+		report(fixed, "", "image is %llu bytes, not whole %d byte sectors", image_length, ISO_9660_SECTOR_SIZE);
+		if (fixed) image_length = padded;
+	}
+	put_both32(expected, image_length / ISO_9660_SECTOR_SIZE);
+	if (memcmp(boot+0x8050, expected, 8) != 0) report(write_image(expected, 8, 0x8050), "", "volume size at 0x8050 is %u sectors, the image is %llu", get_le32(boot+0x8050), image_length / ISO_9660_SECTOR_SIZE);
+	if (memcmp(boot+0x9050, expected, 8) != 0) report(write_image(expected, 8, 0x9050), "", "volume size at 0x9050 is %u sectors, the image is %llu", get_le32(boot+0x9050), image_length / ISO_9660_SECTOR_SIZE);
+	put_le64(expected, image_length/BLOCK_SIZE - BOOT_BLOCK);
+	if (memcmp(boot+0xB010, expected, 8) != 0) report(write_image(expected, 8, 0xB010), "", "block count at 0xB010 is %#llx, should be %#llx", get_le64(boot+0xB010), image_length/BLOCK_SIZE - BOOT_BLOCK);
+	return root;
+}
+
+void usage(const char* name) {
+	fprintf(stderr, "usage: %s [options] IMAGE\n"
+		"  -r           fix what can be fixed\n"
+		"  -j THREADS   directories checked at once (default one per CPU)\n", name);
+	exit(8);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "rj:")) != -1) {
+		switch (opt) {
+		case 'r': check.repair = true; break;
+		case 'j': check.threads = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc-1) usage(argv[0]);
+	check.image = argv[optind];
+	if (check.threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		check.threads = cpus > 0 ? cpus : 1;
+	}
+
+	image_fd = open(check.image, check.repair ? O_RDWR : O_RDONLY);
+	if (image_fd == -1) {
+		perror(check.image);
+		return 8;
+	}
+	// a block device's stat size is 0, it has to be asked
+	struct stat st;
+	if (fstat(image_fd, &st) != 0) {
+		perror(check.image);
+		return 8;
+	}
+	image_length = st.st_size;
+	if (S_ISBLK(st.st_mode) && ioctl(image_fd, BLKGETSIZE64, &image_length) != 0) {
+		perror(check.image);
+		return 8;
+	}
+
+	unsigned long long int root = check_boot_area();
+	if (root == EMPTY_BLOCK) {
+		fprintf(stderr, "%s: not a RedSea image, or the root directory is gone\n", check.image);
+		return 8;
+	}
+	unsigned char root_entry[64];
+	read_image(root_entry, 64, root*BLOCK_SIZE);
+	unsigned long long int root_size = get_le64(root_entry+48);
+
+	struct check_thread* threads = calloc(check.threads, sizeof(struct check_thread));
+	note_extent(&threads[0], root, blocks_for(root_size), "/");
+	queue_directory("", root, root_size, root);
+	for (unsigned int i = 0; i < check.threads; i++) pthread_create(&threads[i].thread, NULL, check_thread_main, &threads[i]);
+	for (unsigned int i = 0; i < check.threads; i++) pthread_join(threads[i].thread, NULL);
+
+	// every extent together, sorted, anything starting before the furthest end so far overlaps it
+	unsigned long long int extent_count = 0;
+	unsigned long long int directories = 0;
+	unsigned long long int files = 0;
+	for (unsigned int i = 0; i < check.threads; i++) {
+		extent_count += threads[i].extent_count;
+		directories += threads[i].directories;
+		files += threads[i].files;
+	}
+	struct check_extent* extents = malloc(sizeof(struct check_extent)*(extent_count ? extent_count : 1));
+	unsigned long long int n = 0;
+	for (unsigned int i = 0; i < check.threads; i++) {
+		memcpy(extents + n, threads[i].extents, sizeof(struct check_extent)*threads[i].extent_count);
+		n += threads[i].extent_count;
+		free(threads[i].extents);
+	}
+	qsort(extents, extent_count, sizeof(struct check_extent), compare_extents);
+	unsigned long long int end = 0;
+	unsigned long long int used_blocks = 0;
+	unsigned long long int holes = 0;
+	unsigned long long int hole_blocks = 0;
+	struct check_extent* furthest = NULL;
+	for (unsigned long long int i = 0; i < extent_count; i++) {
+		struct check_extent* extent = &extents[i];
+		used_blocks += extent->count;
+		if (furthest != NULL && extent->block < end) report(false, extent->path, "blocks %#llx-%#llx overlap %s", extent->block, extent->block + extent->count - 1, furthest->path);
+		else if (furthest != NULL && extent->block > end) {
+			holes++;
+			hole_blocks += extent->block - end;
+		}
+		if (extent->block + extent->count > end || furthest == NULL) {
+			end = extent->block + extent->count;
+			furthest = extent;
+		}
+	}
+
+	printf("%s: %llu directories, %llu files, %llu blocks used, %llu holes (%llu blocks), %llu problems",
+		check.image, directories, files, used_blocks, holes, hole_blocks, problems);
+	if (check.repair) printf(", %llu fixed", repaired);
+	printf("\n");
+	if (check.repair && repaired > 0 && fsync(image_fd) != 0) perror(check.image);
+	close(image_fd);
+	if (problems == 0) return 0;
+	return repaired == problems ? 1 : 4;
+}
@@ -0,0 +1,404 @@
+#define _FILE_OFFSET_BITS 64
+#define ROOT_BLOCK 0x60			// where the root directory goes, same as a fresh TempleOS ISO.C
+#define BOOT_CATALOG_SECTOR 0x14
+#define COPY_CHUNK (1ULL << 20)		// how much of a host file a copy thread reads at once
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "redsea_format.h"
+
+/* mkfs.redsea
+ * builds an ISO.C out of a directory on the host in one go, instead of
+ * mounting an empty image and copying everything in through the driver
+ * (where every file starts as one block and gets moved each time it
+ * outgrows its extent). The whole tree is scanned first so every
+ * directory's size is known before anything is written: each directory is
+ * exactly as many blocks as its entries need, followed by its files, each
+ * one right after the other with no holes, the same layout genimage makes.
+ * Then the boot area and directories are written and the file contents are
+ * copied across by a pool of threads, each taking the next file in image
+ * order, so the image is written once front to back.
+ *
+ * The boot area is what the driver needs to see a RedSea disk (volume
+ * descriptors, an El Torito catalog with the TempleOS signature, the RedSea
+ * boot block). With -b it's taken from an existing ISO.C instead, boot code
+ * and all, with the sizes and root pointers fixed up for the new image.
+ *
+ * Only directories and regular files go in. Anything else, names longer
+ * than RedSea allows and a directory holding something with its own name
+ * (older versions of the driver took that for the directory's own entry)
+ * get skipped with a warning. Files ending in .Z get the compressed attribute like they do
+ * when created through the driver, their contents are copied as they are.
+ */
+
+struct build_file {
+	char name[MAX_NAME+1];
+	char* path;				// on the host
+	unsigned long long int size;
+	unsigned long long int block;
+	unsigned long long int timestamp;
+	uint16_t attributes;
+};
+struct build_directory {
+	char name[MAX_NAME+1];
+	char* path;
+	unsigned long long int block;
+	unsigned long long int size;		// bytes, whole blocks
+	unsigned long long int timestamp;
+	struct build_directory* parent;
+	struct build_directory** subdirs;
+	unsigned long long int num_subdirs;
+	unsigned long long int max_subdirs;
+	struct build_file* files;
+	unsigned long long int num_files;
+	unsigned long long int max_files;
+};
+
+struct build_options {
+	unsigned int threads;
+	const char* boot_template;
+	const char* output;
+	const char* source;
+} build = {0, NULL, NULL, NULL};
+
+// every directory in the order they go on the image, parents before children
+struct build_directory** directories;
+unsigned long long int directory_count = 0;
+unsigned long long int max_directories = 0;
+// and every file, in the same order
+struct build_file** files;
+unsigned long long int file_count = 0;
+unsigned long long int skipped = 0;
+
+int image_fd = -1;
+unsigned char* boot_template = NULL;		// the first ROOT_BLOCK blocks of -b's image
+unsigned long long int next_file = 0;		// the next one a copy thread takes
+unsigned long long int bytes_copied = 0;
+
+char* join_path(const char* directory, const char* name) {
+	char* path = malloc(strlen(directory) + strlen(name) + 2);
+	sprintf(path, "%s/%s", directory, name);
+	return path;
+}
+
+struct build_directory* new_directory(const char* name, const char* path, struct build_directory* parent, unsigned long long int timestamp) {
+	struct build_directory* directory = calloc(1, sizeof(struct build_directory));
+	snprintf(directory->name, sizeof(directory->name), "%s", name);
+	directory->path = strdup(path);
+	directory->parent = parent;
+	directory->timestamp = timestamp;
+	return directory;
+}
+
+void add_subdir(struct build_directory* directory, struct build_directory* subdir) {
+	if (directory->num_subdirs == directory->max_subdirs) {
+		directory->max_subdirs = directory->max_subdirs ? directory->max_subdirs*2 : 8;
+		directory->subdirs = realloc(directory->subdirs, sizeof(struct build_directory*)*directory->max_subdirs);
+	}
+	directory->subdirs[directory->num_subdirs++] = subdir;
+}
+
+void add_file(struct build_directory* directory, const char* name, const char* path, const struct stat* st) {
+	if (directory->num_files == directory->max_files) {
+		directory->max_files = directory->max_files ? directory->max_files*2 : 16;
+		directory->files = realloc(directory->files, sizeof(struct build_file)*directory->max_files);
+	}
+	struct build_file* file = &directory->files[directory->num_files++];
+	memset(file, 0, sizeof(struct build_file));
+	snprintf(file->name, sizeof(file->name), "%s", name);
+	file->path = strdup(path);
+	file->size = st->st_size;
+	file->timestamp = unix_to_cdate(st->st_mtime);
+	file->attributes = 0x0820;
+	size_t length = strlen(name);
+	if (length >= 2 && strcmp(name + length - 2, ".Z") == 0) file->attributes |= 0x0400;
+}
+
+int compare_names(const void* a, const void* b) {
+	return strcmp(*(const char**) a, *(const char**) b);
+}
+
+/* reads one host directory into directory and then its subdirectories,
+ * depth first so every directory comes right before everything under it.
+ * Entries are sorted so the same tree always makes the same image
+ */
+void scan_directory(struct build_directory* directory) {
+	if (directory_count == max_directories) {
+		max_directories = max_directories ? max_directories*2 : 64;
+		directories = realloc(directories, sizeof(struct build_directory*)*max_directories);
+	}
+	directories[directory_count++] = directory;
+	DIR* dir = opendir(directory->path);
+	if (dir == NULL) {
+		perror(directory->path);
+		exit(1);
+	}
+	char** names = NULL;
+	unsigned long long int count = 0;
+	unsigned long long int max = 0;
+	struct dirent* dirent;
+	while ((dirent = readdir(dir)) != NULL) {
+		if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) continue;
+		if (count == max) {
+			max = max ? max*2 : 64;
+			names = realloc(names, sizeof(char*)*max);
+		}
+		names[count++] = strdup(dirent->d_name);
+	}
+	closedir(dir);
+	qsort(names, count, sizeof(char*), compare_names);
+
+	for (unsigned long long int i = 0; i < count; i++) {
+		char* path = join_path(directory->path, names[i]);
+		struct stat st;
+		if (lstat(path, &st) != 0) {
+			perror(path);
+			exit(1);
+		}
+		const char* why = NULL;
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) why = "not a file or directory";
+		else if (strlen(names[i]) > MAX_NAME) why = "name too long";
+		else if (strcmp(names[i], directory->name) == 0) why = "same name as its directory";
+		if (why != NULL) {
+			fprintf(stderr, "skipping %s: %s\n", path, why);
+			skipped++;
+		}
+		else if (S_ISDIR(st.st_mode)) add_subdir(directory, new_directory(names[i], path, directory, unix_to_cdate(st.st_mtime)));
+		else add_file(directory, names[i], path, &st);
+		free(path);
+		free(names[i]);
+	}
+	free(names);
+	for (unsigned long long int i = 0; i < directory->num_subdirs; i++) scan_directory(directory->subdirs[i]);
+}
+
+void write_or_die(int fd, const void* buffer, unsigned long long int size, unsigned long long int offset) {
+	const unsigned char* pos = buffer;
+	unsigned long long int done = 0;
+	while (done < size) {
+		ssize_t written = pwrite(fd, pos + done, size - done, offset + done);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) {
+			perror("pwrite");
+			exit(1);
+		}
+		done += written;
+	}
+}
+
+// everything before the root directory out of another ISO.C, false if it doesn't look like one
+bool read_boot_template(const char* path, unsigned char* boot) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		perror(path);
+		return false;
+	}
+	ssize_t got = pread(fd, boot, ROOT_BLOCK*BLOCK_SIZE, 0);
+	close(fd);
+	if (got != ROOT_BLOCK*BLOCK_SIZE) {
+		fprintf(stderr, "%s: too short for an ISO.C\n", path);
+		return false;
+	}
+	unsigned int catalog = boot[0x8847] | boot[0x8848] << 8 | boot[0x8849] << 16 | (unsigned int) boot[0x884a] << 24;
+	if (catalog*ISO_9660_SECTOR_SIZE + 12 > ROOT_BLOCK*BLOCK_SIZE || memcmp(boot + catalog*ISO_9660_SECTOR_SIZE + 4, "TempleOS", 8) != 0) {
+		fprintf(stderr, "%s: no TempleOS boot catalog\n", path);
+		return false;
+	}
+	return true;
+}
+
+void write_boot_area(int fd, unsigned long long int image_length) {
+	unsigned char* boot = calloc(ROOT_BLOCK*BLOCK_SIZE, 1);
+	unsigned int sectors = image_length / ISO_9660_SECTOR_SIZE;
+	if (boot_template != NULL) memcpy(boot, boot_template, ROOT_BLOCK*BLOCK_SIZE);
+	else {
+		// primary volume descriptor and the copy the driver keeps in sync at 0x9000
+		for (unsigned long long int pvd = 0x8000; pvd <= 0x9000; pvd += 0x1000) {
+			boot[pvd] = 1;
+			memcpy(boot+pvd+1, "CD001", 5);
+			boot[pvd+6] = 1;
+			memcpy(boot+pvd+40, "REDSEA                          ", 32);
+		}
+		// El Torito boot record pointing at the catalog
+		boot[0x8800] = 0;
+		memcpy(boot+0x8801, "CD001", 5);
+		boot[0x8806] = 1;
+		memcpy(boot+0x8807, "EL TORITO SPECIFICATION", 23);
+		put_le32(boot+0x8847, BOOT_CATALOG_SECTOR);
+		// set terminator
+		boot[0x9800] = 255;
+		memcpy(boot+0x9801, "CD001", 5);
+		boot[0x9806] = 1;
+		// validation entry, the id string is what identifies a TempleOS disk
+		unsigned char* catalog = boot + BOOT_CATALOG_SECTOR*ISO_9660_SECTOR_SIZE;
+		catalog[0] = 1;
+		memcpy(catalog+4, "TempleOS", 8);
+		catalog[0x1e] = 0x55;
+		catalog[0x1f] = 0xaa;
+	}
+	// same fields rewrite_redsea_boot and move_directory_data keep up to date in the driver
+	put_both32(boot+0x8050, sectors);
+	put_both32(boot+0x9050, sectors);
+	put_root_pointer(boot+0x8098, ROOT_BLOCK);
+	put_root_pointer(boot+0x9098, ROOT_BLOCK);
+	put_le64(boot + BOOT_BLOCK*BLOCK_SIZE + 0x10, image_length/BLOCK_SIZE - BOOT_BLOCK);
+	put_le64(boot + BOOT_BLOCK*BLOCK_SIZE + 0x18, ROOT_BLOCK);
+	write_or_die(fd, boot, ROOT_BLOCK*BLOCK_SIZE, 0);
+	free(boot);
+}
+
+void write_directory(struct build_directory* directory) {
+	unsigned char* entries = calloc(directory->size, 1);
+	write_entry(entries, 0x0810, directory->name, directory->block, directory->size, directory->timestamp);
+	struct build_directory* parent = directory->parent ? directory->parent : directory;
+	// .. only carries the block, the driver writes them the same way
+	write_entry(entries+64, 0x0810, "..", parent->block, directory->parent ? 0 : directory->size, parent->timestamp);
+	unsigned long long int entry = 2;
+	for (unsigned long long int i = 0; i < directory->num_subdirs; i++, entry++) {
+		struct build_directory* subdir = directory->subdirs[i];
+		write_entry(entries + entry*64, 0x0810, subdir->name, subdir->block, subdir->size, subdir->timestamp);
+	}
+	for (unsigned long long int i = 0; i < directory->num_files; i++, entry++) {
+		struct build_file* file = &directory->files[i];
+		write_entry(entries + entry*64, file->attributes, file->name, file->block, file->size, file->timestamp);
+	}
+	write_or_die(image_fd, entries, directory->size, directory->block*BLOCK_SIZE);
+	free(entries);
+}
+
+/* copies a host file to its extent. It was sized when the tree was scanned,
+ * if it's grown since only that much goes in, if it's shrunk the rest stays
+ * zeroes
+ */
+void copy_file(struct build_file* file, unsigned char* buffer) {
+	int fd = open(file->path, O_RDONLY);
+	if (fd == -1) {
+		perror(file->path);
+		exit(1);
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	unsigned long long int done = 0;
+	while (done < file->size) {
+		unsigned long long int want = file->size - done < COPY_CHUNK ? file->size - done : COPY_CHUNK;
+		ssize_t got = pread(fd, buffer, want, done);
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0) {
+			perror(file->path);
+			exit(1);
+		}
+		if (got == 0) {
+			fprintf(stderr, "%s: shrank while copying, the rest is zeroes\n", file->path);
+			break;
+		}
+		write_or_die(image_fd, buffer, got, file->block*BLOCK_SIZE + done);
+		done += got;
+	}
+	close(fd);
+	__atomic_fetch_add(&bytes_copied, done, __ATOMIC_RELAXED);
+}
+
+void* copy_thread_main(void* arg) {
+	(void) arg;
+	unsigned char* buffer = malloc(COPY_CHUNK);
+	for (;;) {
+		unsigned long long int i = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED);
+		if (i >= file_count) break;
+		copy_file(files[i], buffer);
+	}
+	free(buffer);
+	return NULL;
+}
+
+void usage(const char* name) {
+	fprintf(stderr, "usage: %s [options] -o IMAGE DIRECTORY\n"
+		"  -j THREADS   files copied at once (default one per CPU)\n"
+		"  -b ISO.C     take the boot area (and boot code) from an existing image\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "j:b:o:")) != -1) {
+		switch (opt) {
+		case 'j': build.threads = atoi(optarg); break;
+		case 'b': build.boot_template = optarg; break;
+		case 'o': build.output = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (build.output == NULL || optind != argc-1) usage(argv[0]);
+	build.source = argv[optind];
+	if (build.threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		build.threads = cpus > 0 ? cpus : 1;
+	}
+
+	if (build.boot_template != NULL) {
+		boot_template = malloc(ROOT_BLOCK*BLOCK_SIZE);
+		if (!read_boot_template(build.boot_template, boot_template)) return 1;
+	}
+	struct stat st;
+	if (stat(build.source, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: not a directory\n", build.source);
+		return 1;
+	}
+	struct build_directory* root = new_directory(".", build.source, NULL, unix_to_cdate(st.st_mtime));
+	scan_directory(root);
+
+	// every directory right before its files, then the next directory
+	unsigned long long int block = ROOT_BLOCK;
+	unsigned long long int max_files = 0;
+	for (unsigned long long int i = 0; i < directory_count; i++) max_files += directories[i]->num_files;
+	files = malloc(sizeof(struct build_file*)*(max_files ? max_files : 1));
+	for (unsigned long long int i = 0; i < directory_count; i++) {
+		struct build_directory* directory = directories[i];
+		unsigned long long int entries = 2 + directory->num_subdirs + directory->num_files + 1;	// +1 for the end marker
+		directory->size = blocks_for(entries*64)*BLOCK_SIZE;
+		directory->block = block;
+		block += directory->size/BLOCK_SIZE;
+		for (unsigned long long int j = 0; j < directory->num_files; j++) {
+			struct build_file* file = &directory->files[j];
+			file->block = block;
+			block += blocks_for(file->size);
+			files[file_count++] = file;
+		}
+	}
+	unsigned long long int image_length = (block*BLOCK_SIZE + ISO_9660_SECTOR_SIZE-1) / ISO_9660_SECTOR_SIZE * ISO_9660_SECTOR_SIZE;
+
+	image_fd = open(build.output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (image_fd == -1) {
+		perror(build.output);
+		return 1;
+	}
+	if (ftruncate(image_fd, image_length) != 0) {
+		perror("ftruncate");
+		return 1;
+	}
+	// copying starts right away, the directories are written meanwhile
+	pthread_t* threads = malloc(sizeof(pthread_t)*build.threads);
+	for (unsigned int i = 0; i < build.threads; i++) pthread_create(&threads[i], NULL, copy_thread_main, NULL);
+	write_boot_area(image_fd, image_length);
+	for (unsigned long long int i = 0; i < directory_count; i++) write_directory(directories[i]);
+	for (unsigned int i = 0; i < build.threads; i++) pthread_join(threads[i], NULL);
+	free(threads);
+	if (fsync(image_fd) != 0) {
+		perror(build.output);
+		return 1;
+	}
+	close(image_fd);
+
+	printf("%s: %llu files, %llu directories, %llu bytes of data, %llu byte image", build.output, file_count, directory_count, bytes_copied, image_length);
+	if (skipped) printf(", %llu skipped", skipped);
+	printf("\n");
+	return 0;
+}
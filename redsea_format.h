@@ -0,0 +1,115 @@
+#ifndef REDSEA_FORMAT_H
+#define REDSEA_FORMAT_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* RedSea on disk format
+ * what the driver, mkfs.redsea, fsck.redsea and genimage all have to agree
+ * on, so there's one copy of it. Each of them is a single file, the
+ * functions are static inline so including this is all it takes.
+ *
+ * Anything that includes <linux/fs.h> has to do it before this, it has its
+ * own BLOCK_SIZE (1024).
+ *
+ * A directory entry is 64 bytes:
+ *  0  attributes, see RS_ATTR_*
+ *  2  name, up to 37 chars and a terminator
+ *  40 first block
+ *  48 size in bytes
+ *  56 date, a CDate
+ * The first entry is the directory itself and the second is .., which only
+ * carries the parent's block.
+ */
+#undef BLOCK_SIZE
+#define BLOCK_SIZE 512			// RedSea Block Size
+#define ISO_9660_SECTOR_SIZE 2048
+#define UNIX_CDATE_SECONDS 62167132800 	// seconds to subtract from CDate seconds for unix time
+					// 719527*86400
+#define BOOT_BLOCK 0x58			// RedSea boot block, root pointer lives at byte 0x18 of it
+#define MAX_NAME 37			// the name field is 38 bytes with the terminator
+
+// the attribute bits, the same as templeos
+#define RS_ATTR_READ_ONLY 0x01
+#define RS_ATTR_HIDDEN 0x02
+#define RS_ATTR_SYSTEM 0x04
+#define RS_ATTR_VOL_ID 0x08
+#define RS_ATTR_DIR 0x10
+#define RS_ATTR_ARCHIVE 0x20
+#define RS_ATTR_DELETED 0x100
+#define RS_ATTR_RESIDENT 0x200
+#define RS_ATTR_COMPRESSED 0x400
+#define RS_ATTR_CONTIGUOUS 0x800
+#define RS_ATTR_FIXED 0x1000
+#define RS_ATTR_KNOWN 0x1f3f
+
+//Converts TempleOS CDate (Christ date?) format to unix time.
+static inline long long int cdate_to_unix(unsigned long long int cdate) {
+	unsigned int lower = cdate & 0xFFFFFFFF;
+	unsigned int upper = (cdate>>32) & 0xFFFFFFFF;
+	unsigned long long int cdate_upper_seconds = upper*86400LL;
+	long int cdate_lower_seconds = lower/49710;
+	return cdate_upper_seconds+cdate_lower_seconds-UNIX_CDATE_SECONDS;
+}
+
+//Converts unix time to TempleOS CDate.
+static inline unsigned long long int unix_to_cdate(long long int unix_time) {
+	unsigned int lower = (unix_time % 86400LL)*49710;
+	unsigned int upper = (unix_time + UNIX_CDATE_SECONDS) / 86400;
+	return (unsigned long long int) upper << 32 | lower;
+}
+
+// blocks taken up by size bytes. even empty files get a block of their own
+static inline unsigned long long int blocks_for(unsigned long long int size) {
+	if (size == 0) return 1;
+	return (size + BLOCK_SIZE-1) / BLOCK_SIZE;
+}
+
+// little endian helpers, RedSea (and the host) is little endian
+static inline unsigned int get_le32(const unsigned char* buf) {
+	return buf[0] | buf[1] << 8 | buf[2] << 16 | (unsigned int) buf[3] << 24;
+}
+
+static inline unsigned long long int get_le64(const unsigned char* buf) {
+	unsigned long long int value = 0;
+	for (int i = 0; i < 8; i++) value |= (unsigned long long int) buf[i] << (i*8);
+	return value;
+}
+
+static inline void put_le32(unsigned char* buf, unsigned int value) {
+	for (int i = 0; i < 4; i++) buf[i] = (value >> (i*8)) & 0xff;
+}
+
+static inline void put_le64(unsigned char* buf, unsigned long long int value) {
+	for (int i = 0; i < 8; i++) buf[i] = (value >> (i*8)) & 0xff;
+}
+
+// ISO 9660 is both little AND big endian
+static inline void put_both32(unsigned char* buf, unsigned int value) {
+	put_le32(buf, value);
+	for (int i = 0; i < 4; i++) buf[4+i] = (value >> ((3-i)*8)) & 0xff;
+}
+
+/* the root directory pointer in the volume descriptors at 0x8098 and
+ * 0x9098 follows both endian too, the low half then mirrored. Poses a
+ * problem for a root directory past block 0xFFFFFFFF
+ */
+static inline void put_root_pointer(unsigned char* buf, unsigned long long int block) {
+	put_le64(buf, block);
+	buf[4] = buf[3];
+	buf[5] = buf[2];
+	buf[6] = buf[1];
+	buf[7] = buf[0];
+}
+
+static inline void write_entry(unsigned char* entry, uint16_t attributes, const char* name, unsigned long long int block, unsigned long long int size, unsigned long long int timestamp) {
+	memset(entry, 0, 64);
+	entry[0] = attributes & 0xff;
+	entry[1] = (attributes >> 8) & 0xff;
+	memcpy(entry+2, name, strnlen(name, MAX_NAME));
+	put_le64(entry+40, block);
+	put_le64(entry+48, size);
+	put_le64(entry+56, timestamp);
+}
+
+#endif